@@ -4,22 +4,59 @@
 #include <iostream>
 #include <exception>
 #include <cstring>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
 #include <vector>
+#include <memory>
 #include <chrono>
 #include <future>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <atomic>
+#include <algorithm>
+#include <variant>
+#include <typeinfo>
+#include <array>
+#if defined(__SSE4_2__) && (defined(__x86_64__) || defined(_M_X64))
+#   include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#   include <arm_acle.h>
+#endif
 #ifdef _WIN32
 #   include <windows.h>
 #   include <io.h>
+#   include <sys/stat.h>
 #else
 #   include <spawn.h>
 #   include <unistd.h>
 #   include <fcntl.h>
 #   include <sys/wait.h>
+#   include <sys/resource.h>
+#   include <poll.h>
 #   include <signal.h>
+#   include <sys/ioctl.h>
+#   include <sys/uio.h>
+#   include <sys/stat.h>
+#   include <sys/mman.h>
+#   include <sys/file.h>
+#   ifdef __linux__
+#       include <sys/syscall.h>
+#       include <sys/prctl.h>
+#       include <dirent.h>
+#   endif
 
 #   if STDIN_FILENO != 0 || STDOUT_FILENO != 1 || STDERR_FILENO != 2
 #       error
 #   endif
+
+extern char** environ;
 #endif
 
 namespace subprocess {
@@ -93,9 +130,38 @@ public:
     { return *this; }
 };
 
-struct Return
+/// Timing of a captured stream, as seen by the parent.
+struct StreamStats
+{
+    clock::time_point first_byte;
+    clock::time_point last_byte;
+    size_t bytes = 0;
+    /// Bytes left out of the capture by a CaptureLimit.
+    size_t dropped = 0;
+};
+
+/// Resource usage and timing of a child, filled when it is reaped.
+struct ProcessStats
+{
+    clock::time_point spawned;
+    clock::time_point exited;
+    std::chrono::microseconds user_time {0};
+    std::chrono::microseconds system_time {0};
+    /// Peak resident set size in kilobytes (POSIX only).
+    long max_rss_kb = 0;
+    long minor_faults = 0;
+    long major_faults = 0;
+    long voluntary_switches = 0;
+    long involuntary_switches = 0;
+    StreamStats output;
+    StreamStats error;
+};
+
+template<class T>
+struct BasicReturn
 {
-    Bytes output, error;
+    T output, error;
+    ProcessStats stats;
 
     template<class T1, class T2>
     void
@@ -106,2055 +172,7856 @@ struct Return
     }
 };
 
-#ifdef _WIN32
-class OSError : public std::runtime_error
+typedef BasicReturn<Bytes> Return;
+
+/// Outcome of run(): the outputs and the return code, zero or not.
+template<class T>
+struct BasicResult : BasicReturn<T>
 {
-public:
-    OSError(const std::string& function_name)
-    :   std::runtime_error(nullptr)
+    retcode returncode = 0;
+};
+
+typedef BasicResult<Bytes> Result;
+
+/// Why a call of the no-throw API has no result.
+struct Error
+{
+    enum Code
     {
-        char* message;
-        FormatMessageA(
-            FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-            NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), reinterpret_cast<LPTSTR>(&message), 0, NULL);
-        auto s = function_name + ": " + message;
-        message = new char[s.size() + 1];
-        memcpy(message, s.c_str(), s.size() + 1);
-    }
+        eNone,
+        eStillActive,   ///< the child is still running
+        eLockMissed,    ///< another thread is waiting for the child
+        eTimeout,       ///< the timeout expired
+        eOSError,       ///< starting or waiting for the child failed, see message
+        eCancelled      ///< not run, as another job failed, see parallel_map()
+    };
+
+    Code code = eNone;
+    std::string message;
 };
 
+/**
+ * @brief Either a value or the Error explaining its absence, returned by
+ * the no-throw API (TryWait(), TryPoll(), run()) instead of throwing.
+ */
 template<class T>
-void
-_noopDelete(T* s)
-{}
+class Expected
+{
+private:
+    std::variant<T, subprocess::Error> _value;
 
-template<class T>
-void
-_delete(T* s)
-{ delete s; }
+public:
+    Expected(T value)
+    :   _value(std::in_place_index<0>, std::move(value))
+    {}
 
-std::string
-shellEscaped(const std::string& arg)
+    Expected(subprocess::Error error)
+    :   _value(std::in_place_index<1>, std::move(error))
+    {}
+
+    bool
+    HasValue() const
+    { return _value.index() == 0; }
+
+    explicit
+    operator bool() const
+    { return HasValue(); }
+
+    /// @throw std::bad_variant_access if there is no value.
+    T&
+    Value()
+    { return std::get<0>(_value); }
+
+    const T&
+    Value() const
+    { return std::get<0>(_value); }
+
+    T&
+    operator*()
+    { return Value(); }
+
+    T*
+    operator->()
+    { return &Value(); }
+
+    const T&
+    operator*() const
+    { return Value(); }
+
+    const T*
+    operator->() const
+    { return &Value(); }
+
+    const subprocess::Error&
+    Error() const
+    { return std::get<1>(_value); }
+};
+
+/**
+ * @brief How the capture loop writes into a buffer of type T.
+ *
+ * Prepare() returns where to write up to `size` bytes, and may lower `size`
+ * (0 stops the capture). Commit() is told how many of the prepared bytes were
+ * written, and returns false to stop the capture. Data() and Size() expose the
+ * content, e.g. for error reports.
+ *
+ * The default works for any contiguous container of single-byte elements
+ * with resize(): Bytes, std::string, std::vector<char>, their std::pmr
+ * flavors, or containers with a custom allocator. Specialize it for other
+ * buffer types.
+ */
+template<class T, class = void>
+struct BufferTraits;
+
+template<class T>
+struct BufferTraits<T, typename std::enable_if<sizeof (*std::declval<T&>().data()) == 1
+    and std::is_same<decltype (std::declval<T&>().resize(0)), void>::value>::type>
 {
-    std::string s;
-    bool needquote = arg.empty() or arg.find_first_of(" \t") != std::string::npos;
-    if (needquote) {
-        s.reserve(arg.size() + 2);
-        s += '"';
-    } else {
-        s.reserve(arg.size());
-    }
-    size_t k = 0;
-    for (const auto& c : arg) {
-        if (c == '\\') {
-            ++k;
-        } else if (c == '"') {
-            s += std::string(2 * k + 2, '\\');
-            s.back() = '"';
-            k = 0;
-        } else if (k > 0) {
-            s += std::string(k + 1, '\\');
-            s.back() = c;
-            k = 0;
-        } else {
-            s += c;
-        }
+    static byte*
+    Prepare(T& buffer, size_t& size)
+    {
+        auto length = buffer.size();
+        buffer.resize(length + size);
+        return reinterpret_cast<byte*>(&buffer[0]) + length;
     }
-    s += std::string(k, '\\');
-    if (needquote) {
-        s += std::string(k, '\\') + '"';
+
+    static bool
+    Commit(T& buffer, size_t prepared, size_t size)
+    {
+        buffer.resize(buffer.size() - prepared + size);
+        return true;
     }
-    return s;
-}
-#else
-class OSError : public std::runtime_error
-{
-public:
-    OSError(const std::string& function_name)
-    :   std::runtime_error(function_name + ": " + std::strerror(errno))
-    {}
 
-    OSError(const std::string& function_name, int errno_)
-    :   std::runtime_error(function_name + ": " + std::strerror(errno_))
-    {}
+    static const byte*
+    Data(const T& buffer)
+    { return reinterpret_cast<const byte*>(buffer.data()); }
+
+    static size_t
+    Size(const T& buffer)
+    { return buffer.size(); }
 };
 
-void
-_deleteTwoArrays(char** a)
+/// Scratch space to read data that is thrown away into.
+byte*
+_Scratch(size_t& size)
 {
-    delete[] a[0];
-    delete[] a;
+    static thread_local byte scratch[4096];
+    size = std::min(size, sizeof scratch);
+    return scratch;
 }
 
-void
-_deleteOneArray(char** a)
-{ delete[] a; }
+/// What a FixedBuffer does with output beyond its capacity.
+enum Overflow
+{
+    oTruncate,  ///< keep the first bytes, drain and count the rest
+    oFail,      ///< kill the child and throw OutputOverflow
+    oSpill      ///< keep the rest in the heap-allocated spill
+};
 
-/// \todo add support for quotes, comments and other stuff
-std::unique_ptr<char*[], decltype (&_deleteTwoArrays)>
-shellSplitted(const char* str)
+/**
+ * @brief Caller-provided storage for Communicate(), e.g. an array on the stack.
+ *
+ * Up to capacity bytes are captured without any allocation; overflowed
+ * counts the bytes beyond that, handled according to overflow.
+ */
+struct FixedBuffer
 {
-    // assuming str != nullptr
-    auto sizeof_str = strlen(str) + 1;
-    // copy str while substituting whitespace
-    auto s = new char[sizeof_str];
-    bool substitution = false;
-    auto argc = 1u;
-	bool single_quote = false;
-	bool double_quote = false;
-	bool back_slash = false;
-    auto end = str + sizeof_str;
-    for (auto p = s; str != end; ++p, ++str) {
-		bool back_slash1 = back_slash;
-		back_slash = false;
-		bool substitution1 = substitution;
-		substitution = false;
-		switch (*str) {
-			case ' ':
-			case '\t':
-				if (single_quote or double_quote) {
-					*p = *str;
-				} else {
-					*p = '\0';
-					if (not substitution1) {
-						++argc;
-					}
-					substitution = true;
-				}
-				break;
-			case '\\':
-				if (single_quote) {
-					*p = '\\';
-				} else if (back_slash1) {// escaped back slash
-					*p = '\\';
-					//back_slash = false;
-				} else {
-					--p;
-					back_slash = true;
-				}
-				break;
-			case '\'':
-				if (back_slash1) {// escaped single quote
-					*p = '\'';
-				} else if (single_quote) {// single quote end
-					--p;
-					single_quote = false;
-				} else if (not double_quote) {// single quote begin
-					--p;
-					single_quote = true;
-				} else {
-					*p = '\'';
-				}
-				break;
-			case '"':
-				if (back_slash1) {// escaped double quote
-					*p = '"';
-				} else if (double_quote) {// double quote end
-					--p;
-					double_quote = false;
-				} else if (not single_quote) {// double quote begin
-					--p;
-					double_quote = true;
-				} else {
-					*p = '"';
-				}
-				break;
-			default:
-				if (double_quote and back_slash) {
-					*p = '\\';
-					++p;
-				}
-				*p = *str;
-				if (substitution1 and *str == '\0') {// str ended with white space
-					--argc;
-				}
-				break;
-		}
+    byte* data;
+    size_t capacity;
+    size_t size = 0;
+    Overflow overflow;
+    size_t overflowed = 0;
+    Bytes spill;
+
+    FixedBuffer(void* data_, size_t capacity_, Overflow overflow_ = oTruncate)
+    :   data(static_cast<byte*>(data_))
+    ,   capacity(capacity_)
+    ,   overflow(overflow_)
+    {}
+
+    template<class T, size_t N, class = typename std::enable_if<sizeof (T) == 1>::type>
+    FixedBuffer(T (&array)[N], Overflow overflow_ = oTruncate)
+    :   FixedBuffer(array, N, overflow_)
+    {}
+};
+
+template<>
+struct BufferTraits<FixedBuffer>
+{
+    static byte*
+    Prepare(FixedBuffer& buffer, size_t& size)
+    {
+        if (buffer.size < buffer.capacity) {
+            size = std::min(size, buffer.capacity - buffer.size);
+            return buffer.data + buffer.size;
+        }
+        if (buffer.overflow == oSpill) {
+            return BufferTraits<Bytes>::Prepare(buffer.spill, size);
+        }
+        // past the end, read into scratch space to drain the pipe or detect the overflow
+        return _Scratch(size);
     }
-    // record the positions of the strings
-    auto argv = new char*[argc + 1];
-    auto p = argv;
-    *p = s;
-    ++p;
-    end = s + sizeof_str - 1;
-    for (++s; s < end; ++s) {
-        if (s[-1] == '\0' and s[0] != '\0') {
-            *p = s;
-            ++p;
+
+    static bool
+    Commit(FixedBuffer& buffer, size_t prepared, size_t size)
+    {
+        if (buffer.size < buffer.capacity) {
+            buffer.size += size;
+            return true;
+        }
+        buffer.overflowed += size;
+        if (buffer.overflow == oSpill) {
+            return BufferTraits<Bytes>::Commit(buffer.spill, prepared, size);
         }
+        return buffer.overflow != oFail;
     }
-    *p = nullptr;
-    return {argv, _deleteTwoArrays};
-}
 
-void
-_deletePosixSpawnFileActions(posix_spawn_file_actions_t* fa)
-{
-	posix_spawn_file_actions_destroy(fa);
-	delete fa;
-}
+    static const byte*
+    Data(const FixedBuffer& buffer)
+    { return buffer.data; }
 
-void
-_deletePosixSpawnattr(posix_spawnattr_t* sa)
-{
-	posix_spawnattr_destroy(sa);
-	delete sa;
-}
-#endif
+    static size_t
+    Size(const FixedBuffer& buffer)
+    { return buffer.size; }
+};
 
-class FileHandler
+/// What to keep of a captured stream, see Popen::StdOutLimit().
+struct CaptureLimit
 {
-protected:
-    union
+    enum Action
     {
-        file_id _id;
-        FILE* _file;
-#ifdef _WIN32
-        int _fd;
-#endif
+        aDrain,     ///< keep reading, so the child never blocks on a full pipe
+        aKill       ///< kill the child at the first dropped byte
     };
-    enum {
-        tNone,
-        tFileId,
-        tFILE,
-        tFileDescriptor
-    } _type;
-    unsigned _self_closing;
 
-public:
-#ifdef _WIN32
-    FileHandler()
-    :   _id(INVALID_HANDLE_VALUE)
-    ,   _type(tNone)
-    ,   _self_closing(false)
-    {}
-#else
-    FileHandler()
-    :   _id(-1)
-    ,   _type(tNone)
-    ,   _self_closing(false)
-    {}
-#endif
-    FileHandler(file_id id, bool self_closing = false)
-    :   _id(id)
-    ,   _type(tFileId)
-    ,   _self_closing(self_closing)
+    size_t head = SIZE_MAX;
+    size_t tail = 0;
+    Action action = aDrain;
+
+    CaptureLimit() = default;
+
+    CaptureLimit(size_t head_, size_t tail_ = 0, Action action_ = aDrain)
+    :   head(head_)
+    ,   tail(tail_)
+    ,   action(action_)
     {}
+};
 
-    FileHandler(FILE* file, bool self_closing = false)
-    :   _file(file)
-    ,   _type(tFILE)
-    ,   _self_closing(self_closing)
-    {}
-#ifdef _WIN32
-    FileHandler(int fd, bool self_closing = false)
-    :   _fd(fd)
-    ,   _type(tFileDescriptor)
-    ,   _self_closing(self_closing)
+/**
+ * Capture adapter enforcing a CaptureLimit on any buffer: the head goes
+ * straight into buffer, the rest cycles through a ring of limit.tail bytes
+ * appended to buffer when the adapter goes away.
+ */
+template<class T>
+struct _BoundedBuffer
+{
+    T& buffer;
+    const CaptureLimit& limit;
+    StreamStats& stats;
+    size_t size = 0;
+    std::unique_ptr<byte[]> ring;
+    size_t ring_pos = 0;
+    byte* chunk = nullptr;
+
+    _BoundedBuffer(T& buffer_, const CaptureLimit& limit_, StreamStats& stats_)
+    :   buffer(buffer_)
+    ,   limit(limit_)
+    ,   stats(stats_)
     {}
-#endif
-    FileHandler(FileHandler&) = delete;
 
-    FileHandler(FileHandler&& o)
+    ~_BoundedBuffer()
     {
-        _id = o._id;
-        _type = o._type;
-        _self_closing = o._self_closing;
-        // invalidate the other file handler
-#ifdef _WIN32
-        o._id = INVALID_HANDLE_VALUE;
-#else
-        o._id = -1;
-#endif
-        o._type = tNone;
-        o._self_closing = false;
+        stats.dropped = Dropped();
+        if (size <= limit.head or limit.tail == 0) {
+            return;
+        }
+        // oldest bytes first
+        try {
+            if (size - limit.head < limit.tail) {
+                _Append(ring.get(), ring_pos);
+            } else {
+                _Append(ring.get() + ring_pos, limit.tail - ring_pos);
+                _Append(ring.get(), ring_pos);
+            }
+        } catch (...) {
+        }
     }
 
-    ~FileHandler()
+    size_t
+    Dropped() const
+    { return size <= limit.head ? 0 : size - limit.head - std::min(size - limit.head, limit.tail); }
+
+private:
+    void
+    _Append(const byte* data, size_t count)
     {
-        if (IsSelfClosing()) {
-            Close();
+        while (count > 0) {
+            size_t room = count;
+            byte* p = BufferTraits<T>::Prepare(buffer, room);
+            if (room == 0) {
+                return;
+            }
+            memcpy(p, data, room);
+            BufferTraits<T>::Commit(buffer, room, room);
+            data += room;
+            count -= room;
         }
     }
+};
 
-#ifdef _WIN32
-    file_id
-    Id() const
+template<class T>
+struct BufferTraits<_BoundedBuffer<T>>
+{
+    static byte*
+    Prepare(_BoundedBuffer<T>& b, size_t& size)
     {
-        switch (_type) {
-            case tFileId: return _id;
-            case tFILE: return reinterpret_cast<file_id>(_get_osfhandle(fileno(_file)));
-            case tFileDescriptor: return reinterpret_cast<file_id>(_get_osfhandle(_fd));
-            default: return INVALID_HANDLE_VALUE;
+        if (b.size < b.limit.head) {
+            size = std::min(size, b.limit.head - b.size);
+            return BufferTraits<T>::Prepare(b.buffer, size);
         }
+        // past the head, read whole chunks whatever the size of the ring
+        return b.chunk = _Scratch(size);
     }
-#else
-    file_id
-    Id() const
+
+    static bool
+    Commit(_BoundedBuffer<T>& b, size_t prepared, size_t size)
     {
-        switch (_type) {
-            case tFileId: return _id;
-            case tFILE: return fileno(_file);
-            case tFileDescriptor: return _id;
-            default: return -1;
+        if (b.size < b.limit.head) {
+            b.size += size;
+            return BufferTraits<T>::Commit(b.buffer, prepared, size);
         }
-    }
-#endif
-    void
-    Id(file_id id)
-    {
-        _id = id;
-        _type = tFileId;
+        if (b.limit.tail != 0 and size > 0) {
+            if (b.ring == nullptr) {
+                b.ring.reset(new byte[b.limit.tail]);
+            }
+            // only the last bytes of the chunk can still be part of the tail
+            size_t keep = std::min(size, b.limit.tail);
+            size_t pos = (b.ring_pos + size - keep) % b.limit.tail;
+            size_t first = std::min(keep, b.limit.tail - pos);
+            memcpy(b.ring.get() + pos, b.chunk + size - keep, first);
+            memcpy(b.ring.get(), b.chunk + size - keep + first, keep - first);
+            b.ring_pos = (b.ring_pos + size) % b.limit.tail;
+        }
+        b.size += size;
+        return b.limit.action != CaptureLimit::aKill or b.Dropped() == 0;
     }
 
-    bool
-    IsSelfClosing() const
-    { return _self_closing; }
+    static const byte*
+    Data(const _BoundedBuffer<T>& b)
+    { return BufferTraits<T>::Data(b.buffer); }
 
-    void
-    IsSelfClosing(bool self_closing)
-    { _self_closing = self_closing; }
+    static size_t
+    Size(const _BoundedBuffer<T>& b)
+    { return BufferTraits<T>::Size(b.buffer); }
+};
 
-    bool
-    IsFileId() const
-    { return _type == tFileId; }
+/**
+ * @brief Hash updated with each captured chunk as it arrives, see Popen::StdOutDigest().
+ *
+ * Implement it to plug in another algorithm; Xxh64 and Crc32c are built in.
+ */
+struct Digest
+{
+    virtual ~Digest() = default;
 
-    bool
-    IsFILE() const
-    { return _type == tFILE; }
-#ifdef _WIN32
-    bool
-    IsFileDescriptor() const
-    { return _type == tFileDescriptor; }
-#else
-    bool
-    IsFileDescriptor() const
-    { return IsFileId(); }
-#endif
-#ifdef _WIN32
-    bool
-    IsValid() const
-    { return (IsFileId() and _id != INVALID_HANDLE_VALUE) or (IsFILE() and _file != nullptr) or (IsFileDescriptor() and _fd != -1); }
-#else
-    bool
-    IsValid() const
-    { return (IsFileId() and _id != -1) or (IsFILE() and _file != nullptr); }
-#endif
-#ifdef _WIN32
-    int
-    Close() const
+    /// Hash the next size bytes of the stream.
+    virtual void
+    Update(const byte* data, size_t size) = 0;
+
+    /// The hash of everything seen so far; Update() may still be called afterwards.
+    virtual uint64_t
+    Value() const = 0;
+};
+
+/// Little-endian loads, whatever the host order; compilers turn them into plain loads.
+uint32_t
+_Load32(const byte* p)
+{ return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24; }
+
+uint64_t
+_Load64(const byte* p)
+{ return uint64_t(_Load32(p)) | uint64_t(_Load32(p + 4)) << 32; }
+
+/// XXH64, a fast non-cryptographic hash, computed in one streaming pass.
+class Xxh64 : public Digest
+{
+private:
+    static constexpr uint64_t P1 = 11400714785074694791ULL;
+    static constexpr uint64_t P2 = 14029467366897019727ULL;
+    static constexpr uint64_t P3 = 1609587929392839161ULL;
+    static constexpr uint64_t P4 = 9650029242287828579ULL;
+    static constexpr uint64_t P5 = 2870177450012600261ULL;
+
+    uint64_t _seed;
+    uint64_t _v[4];
+    uint64_t _total = 0;
+    byte _pending[32];
+    size_t _pending_size = 0;
+
+    static uint64_t
+    _Rotl(uint64_t x, int r)
+    { return x << r | x >> (64 - r); }
+
+    static uint64_t
+    _Round(uint64_t acc, uint64_t input)
+    { return _Rotl(acc + input * P2, 31) * P1; }
+
+    static uint64_t
+    _Merge(uint64_t acc, uint64_t v)
+    { return (acc ^ _Round(0, v)) * P1 + P4; }
+
+    void
+    _Stripe(const byte* p)
     {
-        switch (_type) {
-            case tFileId: return CloseHandle(_id);
-            case tFILE: return fclose(_file);
-            case tFileDescriptor: return _close(_fd);
-            default: return -1;
+        for (int i = 0; i < 4; ++i) {
+            _v[i] = _Round(_v[i], _Load64(p + 8 * i));
         }
     }
-#else
-    int
-    Close() const
+
+public:
+    explicit Xxh64(uint64_t seed = 0)
+    :   _seed(seed)
+    ,   _v{seed + P1 + P2, seed + P2, seed, seed - P1}
+    {}
+
+    void
+    Update(const byte* data, size_t size) override
     {
-        switch (_type) {
-            case tFileId: return close(_id);
-            case tFILE: return fclose(_file);
-            case tFileDescriptor: return close(_id);
-            default: return -1;
+        _total += size;
+        if (_pending_size + size < sizeof _pending) {
+            memcpy(_pending + _pending_size, data, size);
+            _pending_size += size;
+            return;
         }
-    }
-#endif
-#ifdef _WIN32
-    FileHandler&
-    MakeInheritable(bool inherit)
-    {
-        if (_type == tFileId) {
-            SetHandleInformation(_id, HANDLE_FLAG_INHERIT, inherit)
-            or _throw(OSError("SetHandleInformation"));
+        if (_pending_size > 0) {
+            size_t fill = sizeof _pending - _pending_size;
+            memcpy(_pending + _pending_size, data, fill);
+            _Stripe(_pending);
+            data += fill;
+            size -= fill;
+            _pending_size = 0;
         }
-        return *this;
+        for (; size >= 32; data += 32, size -= 32) {
+            _Stripe(data);
+        }
+        memcpy(_pending, data, size);
+        _pending_size = size;
     }
-#else
-    FileHandler&
-    CloseOnExec(bool close)
+
+    uint64_t
+    Value() const override
     {
-        int flags = fcntl(Id(), F_GETFD, 0);
-        if (close) {
-            flags |= FD_CLOEXEC;
+        uint64_t h;
+        if (_total >= 32) {
+            h = _Rotl(_v[0], 1) + _Rotl(_v[1], 7) + _Rotl(_v[2], 12) + _Rotl(_v[3], 18);
+            for (auto v : _v) {
+                h = _Merge(h, v);
+            }
         } else {
-            flags &= ~FD_CLOEXEC;
+            h = _seed + P5;
         }
-        fcntl(Id(), F_SETFD, flags) == 0 or _throw(OSError("fcntl(2)"));
-        return *this;
+        h += _total;
+        const byte* p = _pending;
+        const byte* end = _pending + _pending_size;
+        for (; p + 8 <= end; p += 8) {
+            h = _Rotl(h ^ _Round(0, _Load64(p)), 27) * P1 + P4;
+        }
+        if (p + 4 <= end) {
+            h = _Rotl(h ^ uint64_t(_Load32(p)) * P1, 23) * P2 + P3;
+            p += 4;
+        }
+        for (; p < end; ++p) {
+            h = _Rotl(h ^ *p * P5, 11) * P1;
+        }
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        return h ^ h >> 32;
     }
-#endif
 };
 
-namespace Pipe
+/**
+ * @brief CRC-32C (Castagnoli), as used by iSCSI, ext4 or gRPC.
+ *
+ * Uses the CRC32 instructions when the build targets them (-msse4.2 on x86,
+ * armv8 with +crc on ARM), a lookup table otherwise.
+ */
+class Crc32c : public Digest
 {
-    class Receiver : public FileHandler
+private:
+    uint32_t _crc = 0xFFFFFFFF;
+
+    static const uint32_t*
+    _Table()
     {
-    public:
-        using FileHandler::FileHandler;
-#ifdef _WIN32
-        ssize_t
-        Receive(void* buf, size_t count) const
-        {
-            if (IsFileId()) {
-                DWORD size, length = 0;
-                while (count > 0 and ReadFile(_id, buf, count, &size, NULL) and size > 0) {
-                    length += size;
-                    count -= static_cast<size_t>(size);
-                    buf = static_cast<char*>(buf) + size;
-                }
-                return length;
-            } else if (IsFILE()) {
-                int size, length = 0;
-                while (count > 0 and (size = fread(buf, 1, count, _file)) > 0) {
-                    length += size;
-                    count -= static_cast<size_t>(size);
-                    buf = static_cast<char*>(buf) + size;
-                }
-                return length;
-            } else if (IsFileDescriptor()) {
-                int size, length = 0;
-                while (count > 0 and (size = _read(_fd, buf, count)) > 0) {
-                    length += size;
-                    count -= static_cast<size_t>(size);
-                    buf = static_cast<char*>(buf) + size;
+        static const auto table = [] {
+            std::array<uint32_t, 256> t;
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k) {
+                    c = c & 1 ? c >> 1 ^ 0x82F63B78 : c >> 1;
                 }
-                return length;
+                t[i] = c;
             }
-            return -1;
+            return t;
+        }();
+        return table.data();
+    }
+
+public:
+    void
+    Update(const byte* data, size_t size) override
+    {
+        uint32_t crc = _crc;
+#if defined(__SSE4_2__) && (defined(__x86_64__) || defined(_M_X64))
+        uint64_t crc64 = crc;
+        for (; size >= 8; data += 8, size -= 8) {
+            crc64 = _mm_crc32_u64(crc64, _Load64(data));
+        }
+        crc = static_cast<uint32_t>(crc64);
+        for (; size > 0; ++data, --size) {
+            crc = _mm_crc32_u8(crc, *data);
+        }
+#elif defined(__ARM_FEATURE_CRC32)
+        for (; size >= 8; data += 8, size -= 8) {
+            crc = __crc32cd(crc, _Load64(data));
+        }
+        for (; size > 0; ++data, --size) {
+            crc = __crc32cb(crc, *data);
         }
 #else
-        ssize_t
-        Receive(void* buf, size_t count) const
-        {
-            if (IsFileId()) {
-                ssize_t size, length = 0;
-                while (count > 0 and (size = read(_id, buf, count)) > 0) {
-                    length += size;
-                    count -= static_cast<size_t>(size);
-                    buf = static_cast<char*>(buf) + size;
-                }
-                return length;
-            } else if (IsFILE()) {
-                size_t size, length = 0;
-                while (count > 0 and (size = fread(buf, 1, count, _file)) > 0) {
-                    length += size;
-                    count -= size;
-                    buf = static_cast<char*>(buf) + size;
-                }
-                return static_cast<ssize_t>(length);
-            }
-            return -1;
+        auto table = _Table();
+        for (; size > 0; ++data, --size) {
+            crc = table[(crc ^ *data) & 0xFF] ^ crc >> 8;
         }
 #endif
-        Bytes
-        Receive() const
-        {
-            Bytes bytes;
-            ssize_t size;
-            size_t length = 0;
-            bytes.resize(4096);
-            while ((size = Receive(const_cast<byte*>(bytes.data()) + length, 4096)) > 0) {
-                length += static_cast<size_t>(size);
-                bytes.resize(length + 4096);
-            }
-            bytes.resize(length);
-            return bytes;
-        }
-    };
+        _crc = crc;
+    }
 
-    class Sender : public FileHandler
-    {
-    public:
-        using FileHandler::FileHandler;
-#ifdef _WIN32
-        ssize_t
-        Send(const void* buf, size_t count) const
-        {
-            if (IsFileId()) {
-                DWORD size;
-                WriteFile(_id, buf, count, &size, NULL);
-                return size;
-            } else if (IsFILE()) {
-                return fwrite(buf, 1, count, _file);
-            } else if (IsFileDescriptor()) {
-                return _write(_fd, buf, count);
-            }
-            return -1;
-        }
-#else
-        ssize_t
-        Send(const void* buf, size_t count) const
-        {
-            if (IsFileId()) {
-                return write(_id, buf, count);
-            } else if (IsFILE()) {
-                return static_cast<ssize_t>(fwrite(buf, 1, count, _file));
-            }
-            return -1;
-        }
-#endif
-        ssize_t
-        Send(const Bytes& v) const
-        { return Send(v.data(), v.size()); }
-
-        ssize_t
-        Send(const std::string& s) const
-        { return Send(s.c_str(), s.size()); }
-    };
-
-    std::pair<Receiver*, Sender*>
-    Pipe()
-    {
-#ifdef _WIN32
-        HANDLE fh[2];
-        // make the handles inheritable
-        SECURITY_ATTRIBUTES sa;
-        sa.nLength = sizeof sa;
-        sa.bInheritHandle = TRUE;
-        sa.lpSecurityDescriptor = NULL;
-        //
-        CreatePipe(fh, fh + 1, &sa, 0) or _throw(OSError("CreatePipe"));
-        return {new Receiver(fh[0], true), new Sender(fh[1], true)};
-#else
-        int fd[2];
-#   ifdef _GNU_SOURCE
-        pipe2(fd, O_CLOEXEC) == 0 or _throw(OSError("pipe2(2)"));
-        return {new Receiver(fd[0], true), new Sender(fd[1], true)};
-#   else
-        pipe(fd) == 0 or _throw(OSError("pipe(2)"));
-        auto r = new Receiver(fd[0], true);
-        auto s = new Sender(fd[1], true);
-        r->CloseOnExec(true);
-        s->CloseOnExec(true);
-        return {r, s};
-#   endif
-#endif
-    }
+    uint64_t
+    Value() const override
+    { return ~_crc; }
 };
 
-class _PIPE
-{};
-class _STDOUT
-{};
-class _DEVNUL
-{};
-class _INFINITE_TIME
-{};
-static const _PIPE PIPE;
-static const _STDOUT STDOUT;
-static const _DEVNUL DEVNUL;
-static const _INFINITE_TIME INFINITE_TIME;
-
-struct SubprocessError : std::exception
+/**
+ * @brief Capture adapter updating digest with every chunk committed to buffer.
+ *
+ * Communicate() wraps its buffers in it for Popen::StdOutDigest(); wrap a
+ * buffer yourself to digest the captures of CommunicateInto(), or a Forward
+ * to digest output that is never kept.
+ */
+template<class T>
+struct Digested
 {
-    Bytes output;
-    Bytes error;
-    retcode returncode;
-    const std::vector<std::string>& args;
+    T& buffer;
+    Digest* digest;
+    byte* chunk = nullptr;
 
-    SubprocessError
-    (   const std::vector<std::string>& args_
-    ,   retcode returncode_
-    ,   const Bytes& output_ = {}
-    ,   const Bytes& error_ = {}
-    )
-    :   output(std::move(output_))
-    ,   error(std::move(error_))
-    ,   returncode(returncode_)
-    ,   args(args_)
+    Digested(T& buffer_, Digest* digest_)
+    :   buffer(buffer_)
+    ,   digest(digest_)
     {}
 
-    const char*
-    what() const noexcept
+    Digested(T& buffer_, Digest& digest_)
+    :   Digested(buffer_, &digest_)
+    {}
+};
+
+template<class T>
+struct BufferTraits<Digested<T>>
+{
+    static byte*
+    Prepare(Digested<T>& b, size_t& size)
+    { return b.chunk = BufferTraits<T>::Prepare(b.buffer, size); }
+
+    static bool
+    Commit(Digested<T>& b, size_t prepared, size_t size)
     {
-        std::string a;
-        for (const auto& i : args) {
-            if (i.empty()) {
-                a += " \"\"";
-            } else {
-                a += " " + i;
-            }
+        if (b.digest != nullptr and size > 0) {
+            b.digest->Update(b.chunk, size);
         }
-        a = "SubprocessError\n"
-            "Arguments:" + a + "\n"
-            "Return code: " + std::to_string(returncode) + "\n"
-            "Output: " + (output.size() <= 10 ? output.string() : output.string().substr(0, 10) + "[...]") + "\n"
-            "Error: " + (error.size() <= 10 ? error.string() : error.string().substr(0, 10) + "[...]");
-        char* m = new char[a.size() + 1];
-        memcpy(m, a.data(), a.size() + 1);
-        return m;
+        return BufferTraits<T>::Commit(b.buffer, prepared, size);
     }
-};
 
-struct CalledProcessError : public SubprocessError
-{
-    using SubprocessError::SubprocessError;
-};
+    static const byte*
+    Data(const Digested<T>& b)
+    { return BufferTraits<T>::Data(b.buffer); }
 
-struct TimeoutExpired : public SubprocessError
-{
-    using SubprocessError::SubprocessError;
+    static size_t
+    Size(const Digested<T>& b)
+    { return BufferTraits<T>::Size(b.buffer); }
 };
 
-struct ProcessStillActive : public SubprocessError
+/**
+ * @brief Capture "buffer" handing each chunk to write() as it arrives instead of keeping it.
+ *
+ * write() returns false to stop the capture; without write() the output is drained.
+ */
+struct Forward
 {
-    using SubprocessError::SubprocessError;
+    std::function<bool(const byte* data, size_t size)> write;
+    byte* _chunk = nullptr;
 };
 
-struct WaitLockMissed : public SubprocessError
+template<>
+struct BufferTraits<Forward>
 {
-    using SubprocessError::SubprocessError;
-};
+    static byte*
+    Prepare(Forward& buffer, size_t& size)
+    { return buffer._chunk = _Scratch(size); }
 
-class Stream
-{
-protected:
-    inline static FileHandler _devnull;
+    static bool
+    Commit(Forward& buffer, size_t, size_t size)
+    { return size == 0 or not buffer.write or buffer.write(buffer._chunk, size); }
 
-    static FileHandler&
-    _GetDevNull()
-    {
-        if (_devnull.IsValid()) {
-            return _devnull;
-        }
-#ifdef _WIN32
-        SECURITY_ATTRIBUTES sa;
-        sa.nLength = sizeof sa;
-        sa.lpSecurityDescriptor = NULL;
-        sa.bInheritHandle = TRUE;
-        _devnull.Id(CreateFileA("nul", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
-            &sa, OPEN_EXISTING, 0, NULL));
-        _devnull.IsValid() or _throw(OSError("CreateFileA"));
-#else
-        _devnull.Id(open("/dev/null", O_RDWR | O_CLOEXEC));
-        _devnull.IsValid() or _throw(OSError("open(2)"));
-#endif
-        _devnull.IsSelfClosing(true);
-        return _devnull;
-    }
+    static const byte*
+    Data(const Forward&)
+    { return nullptr; }
+
+    static size_t
+    Size(const Forward&)
+    { return 0; }
 };
 
-class InputStream : Stream
+template<class T>
+Bytes
+_ToBytes(const T& buffer)
 {
-private:
-    std::unique_ptr<Pipe::Receiver> _receiver;
-    std::unique_ptr<Pipe::Sender> _sender;
+    auto data = BufferTraits<T>::Data(buffer);
+    return Bytes(data, data + BufferTraits<T>::Size(buffer));
+}
 
-public:
-    const std::unique_ptr<Pipe::Receiver>&
-    Receiver() const
-    { return _receiver; }
+Bytes
+_ToBytes(Bytes&& buffer)
+{ return std::move(buffer); }
 
-    const std::unique_ptr<Pipe::Sender>&
-    Sender() const
-    { return _sender; }
+Bytes
+_ToBytes(const Bytes& buffer)
+{ return buffer; }
 
-    InputStream()
-    {}
+/**
+ * @brief Monotonic arena for the transient data of a spawn.
+ *
+ * Allocations come from an inline buffer, so an arena on the stack serves
+ * the usual argv/envp without touching the heap; larger requests spill
+ * into heap blocks released with the arena.
+ */
+class _Arena
+{
+private:
+    alignas(std::max_align_t) char _inline[2048];
+    char* _current = _inline;
+    size_t _left = sizeof _inline;
+    std::vector<std::unique_ptr<char[]>> _blocks;
 
-    InputStream(InputStream&) = delete;
+public:
+    _Arena() = default;
 
-    InputStream(InputStream&& o)
-    {
-        _receiver = std::move(o._receiver);
-        _sender = std::move(o._sender);
-    }
-    InputStream(file_id id, bool self_closing = false)
-    :   _receiver(new Pipe::Receiver(id, self_closing))
-    {}
+    _Arena(_Arena&) = delete;
 
-    InputStream(FILE* file, bool self_closing = false)
-    :   _receiver(new Pipe::Receiver(file, self_closing))
-    {}
-#ifdef _WIN32
-    InputStream(int fd, bool self_closing = false)
-    :   _receiver(new Pipe::Receiver(fd, self_closing))
-    {}
-#endif
-    InputStream(decltype (nullptr))
-    {}
+    _Arena&
+    operator=(_Arena&) = delete;
 
-    InputStream(const _PIPE&)
+    void*
+    Allocate(size_t size, size_t align = alignof(std::max_align_t))
     {
-        auto pipe = Pipe::Pipe();
-        _receiver.reset(pipe.first);
-        _sender.reset(pipe.second);
-#ifdef _WIN32
-        // disable inheritance of _sender by child process
-        _sender->MakeInheritable(false);
-#endif
+        size_t padding = (align - reinterpret_cast<uintptr_t>(_current) % align) % align;
+        if (padding + size > _left) {
+            size_t capacity = std::max<size_t>(size + align, 4096);
+            _blocks.emplace_back(new char[capacity]);
+            _current = _blocks.back().get();
+            _left = capacity;
+            padding = (align - reinterpret_cast<uintptr_t>(_current) % align) % align;
+        }
+        void* p = _current + padding;
+        _current += padding + size;
+        _left -= padding + size;
+        return p;
     }
-    InputStream(const _DEVNUL&)
-    :   _receiver(new Pipe::Receiver(_GetDevNull().Id()))
-    {}
-
-    void
-    DestroyReceiver()
-    { _receiver.reset(); }
-
-    InputStream&
-    operator=(InputStream&) = delete;
 
-    InputStream&
-    operator=(InputStream&& o)
-    {
-        _receiver = std::move(o._receiver);
-        _sender = std::move(o._sender);
-        return *this;
-    }
+    template<class T>
+    T*
+    Allocate(size_t n)
+    { return static_cast<T*>(Allocate(n * sizeof (T), alignof(T))); }
 };
 
-class OutputStream : Stream
+#ifdef _WIN32
+class OSError : public std::runtime_error
 {
-private:
-    std::unique_ptr<Pipe::Receiver> _receiver;
-    std::unique_ptr<Pipe::Sender> _sender;
-
 public:
-    const std::unique_ptr<Pipe::Receiver>&
-    Receiver() const
-    { return _receiver; }
-
-    const std::unique_ptr<Pipe::Sender>&
-    Sender() const
-    { return _sender; }
-
-    OutputStream()
-    {}
-
-    OutputStream(OutputStream&) = delete;
-
-    OutputStream(OutputStream&& o)
+    OSError(const std::string& function_name)
+    :   std::runtime_error(nullptr)
     {
-        _receiver = std::move(o._receiver);
-        _sender = std::move(o._sender);
-        o._receiver = nullptr;
-        o._sender = nullptr;
+        char* message;
+        FormatMessageA(
+            FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+            NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), reinterpret_cast<LPTSTR>(&message), 0, NULL);
+        auto s = function_name + ": " + message;
+        message = new char[s.size() + 1];
+        memcpy(message, s.c_str(), s.size() + 1);
     }
+};
 
-    OutputStream(file_id id, bool self_closing = false)
-    :   _sender(new Pipe::Sender(id, self_closing))
-    {}
+template<class T>
+void
+_noopDelete(T* s)
+{}
 
-    OutputStream(FILE* file, bool self_closing = false)
-    :   _sender(new Pipe::Sender(file, self_closing))
-    {}
-#ifdef _WIN32
-    OutputStream(int fd, bool self_closing = false)
-    :   _sender(new Pipe::Sender(fd, self_closing))
-    {}
-#endif
-    OutputStream(decltype (nullptr))
-    {}
+template<class T>
+void
+_delete(T* s)
+{ delete s; }
 
-    OutputStream(const _PIPE&)
-    {
-        auto pipe = Pipe::Pipe();
-        _receiver.reset(pipe.first);
-        _sender.reset(pipe.second);
-#ifdef _WIN32
-        // disable inheritance of _receiver by child process
-        _receiver->MakeInheritable(false);
-#endif
+std::string
+shellEscaped(const std::string& arg)
+{
+    std::string s;
+    bool needquote = arg.empty() or arg.find_first_of(" \t") != std::string::npos;
+    if (needquote) {
+        s.reserve(arg.size() + 2);
+        s += '"';
+    } else {
+        s.reserve(arg.size());
     }
-    OutputStream(const _DEVNUL&)
-    :   _sender(new Pipe::Sender(_GetDevNull().Id()))
+    size_t k = 0;
+    for (const auto& c : arg) {
+        if (c == '\\') {
+            ++k;
+        } else if (c == '"') {
+            s += std::string(2 * k + 2, '\\');
+            s.back() = '"';
+            k = 0;
+        } else if (k > 0) {
+            s += std::string(k + 1, '\\');
+            s.back() = c;
+            k = 0;
+        } else {
+            s += c;
+        }
+    }
+    s += std::string(k, '\\');
+    if (needquote) {
+        s += std::string(k, '\\') + '"';
+    }
+    return s;
+}
+#else
+class OSError : public std::runtime_error
+{
+public:
+    OSError(const std::string& function_name)
+    :   std::runtime_error(function_name + ": " + std::strerror(errno))
     {}
 
-    void
-    DestroySender()
-    { _sender.reset(); }
+    OSError(const std::string& function_name, int errno_)
+    :   std::runtime_error(function_name + ": " + std::strerror(errno_))
+    {}
+};
 
-    OutputStream&
-    operator=(OutputStream&) = delete;
+void
+_deleteTwoArrays(char** a)
+{
+    delete[] a[0];
+    delete[] a;
+}
 
-    OutputStream&
-    operator=(OutputStream&& o)
-    {
-        _receiver = std::move(o._receiver);
-        _sender = std::move(o._sender);
-        return *this;
+/**
+ * Split str into an argv array, with memory from alloc_chars(size) for the
+ * strings and alloc_pointers(argc + 1) for the array.
+ */
+template<class AllocChars, class AllocPointers>
+char**
+_shellSplit(const char* str, AllocChars alloc_chars, AllocPointers alloc_pointers)
+{
+    // assuming str != nullptr
+    auto sizeof_str = strlen(str) + 1;
+    // copy str while substituting whitespace
+    char* s = alloc_chars(sizeof_str);
+    bool substitution = false;
+    auto argc = 1u;
+	bool single_quote = false;
+	bool double_quote = false;
+	bool back_slash = false;
+    auto end = str + sizeof_str;
+    for (auto p = s; str != end; ++p, ++str) {
+		bool back_slash1 = back_slash;
+		back_slash = false;
+		bool substitution1 = substitution;
+		substitution = false;
+		switch (*str) {
+			case ' ':
+			case '\t':
+				if (single_quote or double_quote) {
+					*p = *str;
+				} else {
+					*p = '\0';
+					if (not substitution1) {
+						++argc;
+					}
+					substitution = true;
+				}
+				break;
+			case '\\':
+				if (single_quote) {
+					*p = '\\';
+				} else if (back_slash1) {// escaped back slash
+					*p = '\\';
+					//back_slash = false;
+				} else {
+					--p;
+					back_slash = true;
+				}
+				break;
+			case '\'':
+				if (back_slash1) {// escaped single quote
+					*p = '\'';
+				} else if (single_quote) {// single quote end
+					--p;
+					single_quote = false;
+				} else if (not double_quote) {// single quote begin
+					--p;
+					single_quote = true;
+				} else {
+					*p = '\'';
+				}
+				break;
+			case '"':
+				if (back_slash1) {// escaped double quote
+					*p = '"';
+				} else if (double_quote) {// double quote end
+					--p;
+					double_quote = false;
+				} else if (not single_quote) {// double quote begin
+					--p;
+					double_quote = true;
+				} else {
+					*p = '"';
+				}
+				break;
+			default:
+				if (double_quote and back_slash) {
+					*p = '\\';
+					++p;
+				}
+				*p = *str;
+				if (substitution1 and *str == '\0') {// str ended with white space
+					--argc;
+				}
+				break;
+		}
     }
-};
+    // record the positions of the strings
+    char** argv = alloc_pointers(argc + 1);
+    auto p = argv;
+    *p = s;
+    ++p;
+    end = s + sizeof_str - 1;
+    for (++s; s < end; ++s) {
+        if (s[-1] == '\0' and s[0] != '\0') {
+            *p = s;
+            ++p;
+        }
+    }
+    *p = nullptr;
+    return argv;
+}
 
-class ErrorStream : Stream
+/// \todo add support for quotes, comments and other stuff
+std::unique_ptr<char*[], decltype (&_deleteTwoArrays)>
+shellSplitted(const char* str)
 {
-private:
-    std::unique_ptr<Pipe::Receiver> _receiver;
-    std::unique_ptr<Pipe::Sender> _sender;
-    bool _stdout = false;
+    return {
+        _shellSplit(str, [](size_t n) { return new char[n]; }, [](size_t n) { return new char*[n]; }),
+        _deleteTwoArrays
+    };
+}
 
-public:
-    const std::unique_ptr<Pipe::Receiver>&
-    Receiver() const
-    { return _receiver; }
+/// Same as above, with both arrays in arena.
+char**
+shellSplitted(const char* str, _Arena& arena)
+{ return _shellSplit(str, [&](size_t n) { return arena.Allocate<char>(n); }, [&](size_t n) { return arena.Allocate<char*>(n); }); }
 
-    const std::unique_ptr<Pipe::Sender>&
-    Sender() const
-    { return _sender; }
+/// posix_spawn_file_actions_t kept on the stack, destroyed if it was used.
+class _PosixSpawnFileActions
+{
+private:
+    posix_spawn_file_actions_t _actions;
+    bool _initialized = false;
 
-    bool
-    IsStdOut() const
-    { return _stdout; }
+public:
+    _PosixSpawnFileActions() = default;
 
-    ErrorStream()
-    {}
+    _PosixSpawnFileActions(_PosixSpawnFileActions&) = delete;
 
-    ErrorStream(ErrorStream&) = delete;
+    ~_PosixSpawnFileActions()
+    {
+        if (_initialized) {
+            posix_spawn_file_actions_destroy(&_actions);
+        }
+    }
 
-    ErrorStream(ErrorStream&& o)
+    posix_spawn_file_actions_t*
+    Init()
     {
-        _receiver = std::move(o._receiver);
-        _sender = std::move(o._sender);
-        _stdout = o._stdout;
-        o._stdout = false;
+        posix_spawn_file_actions_init(&_actions);
+        _initialized = true;
+        return &_actions;
     }
 
-    ErrorStream(file_id id, bool self_closing = false)
-    :   _sender(new Pipe::Sender(id, self_closing))
-    {}
+    posix_spawn_file_actions_t*
+    Get()
+    { return _initialized ? &_actions : nullptr; }
+};
 
-    ErrorStream(FILE* file, bool self_closing = false)
-    :   _sender(new Pipe::Sender(file, self_closing))
-    {}
-#ifdef _WIN32
-    ErrorStream(int fd, bool self_closing = false)
-    :   _sender(new Pipe::Sender(fd, self_closing))
-    {}
-#endif
-    ErrorStream(decltype (nullptr))
-    {}
+/// posix_spawnattr_t kept on the stack, destroyed if it was used.
+class _PosixSpawnattr
+{
+private:
+    posix_spawnattr_t _attr;
+    bool _initialized = false;
 
-    ErrorStream(const _PIPE&)
+public:
+    _PosixSpawnattr() = default;
+
+    _PosixSpawnattr(_PosixSpawnattr&) = delete;
+
+    ~_PosixSpawnattr()
     {
-        auto pipe = Pipe::Pipe();
-        _receiver.reset(pipe.first);
-        _sender.reset(pipe.second);
-#ifdef _WIN32
-        // disable inheritance of _receiver by child process
-        _receiver->MakeInheritable(false);
-#endif
+        if (_initialized) {
+            posix_spawnattr_destroy(&_attr);
+        }
     }
 
-    ErrorStream(const _STDOUT&)
-    :   _stdout(true)
-    {}
+    posix_spawnattr_t*
+    Init()
+    {
+        if (not _initialized) {
+            posix_spawnattr_init(&_attr);
+            _initialized = true;
+        }
+        return &_attr;
+    }
 
-    ErrorStream(const _DEVNUL&)
-    :   _sender(new Pipe::Sender(_GetDevNull().Id()))
-    {}
+    posix_spawnattr_t*
+    Get()
+    { return _initialized ? &_attr : nullptr; }
+};
+#endif
+
+/**
+ * @brief Process-wide budget of the file descriptors held by the library.
+ *
+ * Pipe ends, /dev/null and pidfds are accounted for, and creating them is
+ * admitted only while the total stays within Limit(): a fraction of
+ * RLIMIT_NOFILE, minus some headroom left to the rest of the program.
+ * Over budget, creation waits for descriptors to be released, or fails
+ * fast with EMFILE before anything is half set up: a spawn is admitted
+ * whole, with all the pipes it needs at once.
+ *
+ * Waiting only ends when another thread releases descriptors. A thread
+ * that holds the budget itself, e.g. keeping a few hundred children
+ * alive in a ProcessSet or a LineMerger, is never woken; such programs
+ * want FailFast(true), or a larger Fraction().
+ */
+class FdBudget
+{
+public:
+    struct Counters
+    {
+        size_t fds;         ///< descriptors held by the library
+        size_t children;    ///< children started and not reaped yet
+        size_t waiting;     ///< admissions waiting right now
+        size_t waited;      ///< admissions that had to wait
+        size_t rejected;    ///< admissions that failed fast
+        size_t limit;
+    };
 
+private:
+    std::atomic<size_t> _fds {0};
+    std::atomic<size_t> _children {0};
+    std::atomic<size_t> _waiting {0};
+    std::atomic<size_t> _waited {0};
+    std::atomic<size_t> _rejected {0};
+    std::atomic<size_t> _limit {0};
+    std::atomic<double> _fraction {0.9};
+    std::atomic<size_t> _headroom {16};
+    std::atomic<bool> _fail_fast {false};
+    std::mutex _mutex;
+    std::condition_variable _released;
+
+    static size_t
+    _SystemLimit()
+    {
 #ifdef _WIN32
-    void
-    OutputStream(const OutputStream& stream)
-    { _sender.reset(new Pipe::Sender(stream.Sender() != nullptr and stream.Sender()->IsValid() ? stream.Sender()->Id() : GetStdHandle(STD_OUTPUT_HANDLE))); }
+        return SIZE_MAX;
 #else
-    void
-    OutputStream(const OutputStream& stream)
-    { _sender.reset(new Pipe::Sender(stream.Sender() != nullptr and stream.Sender()->IsValid() ? stream.Sender()->Id() : STDOUT_FILENO)); }
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) != 0 or limit.rlim_cur == RLIM_INFINITY) {
+            return SIZE_MAX;
+        }
+        return static_cast<size_t>(limit.rlim_cur);
 #endif
+    }
 
     void
-    DestroySender()
-    { _sender.reset(); }
+    _Update()
+    {
+        auto system = _SystemLimit();
+        size_t limit = SIZE_MAX;
+        if (system != SIZE_MAX) {
+            limit = static_cast<size_t>(static_cast<double>(system) * _fraction);
+            limit = limit > _headroom ? limit - _headroom : 1;
+        }
+        _limit = limit;
+        _released.notify_all();
+    }
 
-    ErrorStream&
-    operator=(ErrorStream&) = delete;
+public:
+    static FdBudget&
+    Default()
+    {
+        static FdBudget budget;
+        return budget;
+    }
 
-    ErrorStream&
-    operator=(ErrorStream&& o)
+    /// Share of RLIMIT_NOFILE the library may use, 0.9 by default.
+    FdBudget&
+    Fraction(double fraction)
     {
-        _receiver = std::move(o._receiver);
-        _sender = std::move(o._sender);
-        _stdout = o._stdout;
+        _fraction = fraction;
+        _Update();
         return *this;
     }
-};
 
-struct Popen;
-class Popen_impl
-{
-protected:
-    std::vector<std::string> _args;
-    bool _args_is_seq;
-    InputStream  _std_in;
-    OutputStream _std_out;
-    ErrorStream  _std_err;
-#ifndef _WIN32
-    bool _restore_signals;
-#endif
-    bool _close_fds;
-
-#ifdef _WIN32
-    process_id _ph;
-    DWORD _pid;
-#else
-    process_id _pid;
-    std::shared_ptr<std::mutex> _waitpid_lock;
-#endif
-    retcode _returncode;
-    enum {
-        sInitial,
-        sProcessStarted,
-        sEnd
-    } _state = sInitial;
+    /// Descriptors kept free for the rest of the program, 16 by default.
+    FdBudget&
+    Headroom(size_t headroom)
+    {
+        _headroom = headroom;
+        _Update();
+        return *this;
+    }
 
-public:
-    Popen_impl() = default;
+    /// Fail with EMFILE instead of waiting when over budget.
+    FdBudget&
+    FailFast(bool fail_fast)
+    {
+        _fail_fast = fail_fast;
+        return *this;
+    }
 
-    Popen_impl(Popen_impl&) = delete;
+    /// Re-read RLIMIT_NOFILE, e.g. after setrlimit().
+    FdBudget&
+    Refresh()
+    {
+        _Update();
+        return *this;
+    }
 
-    Popen_impl&
-    operator=(Popen_impl&) = delete;
+    size_t
+    Limit()
+    {
+        if (_limit == 0) {
+            _Update();
+        }
+        return _limit;
+    }
 
-    Popen_impl(Popen_impl&& o)
-    { *this = std::move(o); }
+    /// Take count descriptors if the budget allows it; never blocks.
+    bool
+    TryAcquire(size_t count)
+    {
+        auto limit = Limit();
+        auto used = _fds.load();
+        do {
+            // let a lone oversized request through rather than block forever
+            if (used != 0 and used + count > limit) {
+                return false;
+            }
+        } while (not _fds.compare_exchange_weak(used, used + count));
+        return true;
+    }
 
-    Popen_impl&
-    operator=(Popen_impl&& o)
+    /// Take count descriptors, waiting for them or failing fast when over budget.
+    /// Never wait for descriptors the calling thread holds itself: nobody would release them.
+    void
+    Acquire(size_t count) noexcept(false)
     {
-        if (_state == sInitial and o._state == sInitial) {
-            return *this;
+        if (TryAcquire(count)) {
+            return;
         }
-        _state = o._state;
-        // avoid closing the handle in the destructor
-        o._state = sInitial;
-        _pid = o._pid;
+        if (_fail_fast) {
+            ++_rejected;
 #ifdef _WIN32
-        _ph = o._ph;
+            SetLastError(ERROR_TOO_MANY_OPEN_FILES);
+            _throw(OSError("FdBudget::Acquire"));
 #else
-        _waitpid_lock = std::move(o._waitpid_lock);
+            _throw(OSError("FdBudget::Acquire", EMFILE));
 #endif
-        _returncode = o._returncode;
-        return *this;
+        }
+        ++_waited;
+        std::unique_lock<std::mutex> lock (_mutex);
+        ++_waiting;
+        _released.wait(lock, [this, count] { return TryAcquire(count); });
+        --_waiting;
     }
 
-    ~Popen_impl()
+    void
+    Release(size_t count)
     {
-        if (_state != sInitial) {
-            // Wait for the process to terminate, to avoid zombies.
-#ifdef _WIN32
-            WaitForSingleObject(_ph, INFINITE);
-            CloseHandle(_ph);
-#else
-            waitpid(_pid, nullptr, 0);
-#endif
+        _fds -= count;
+        if (_waiting > 0) {
+            const std::lock_guard<std::mutex> lock (_mutex);
+            _released.notify_all();
         }
     }
 
     void
-    Start(Popen& p) noexcept(false);
+    ChildStarted()
+    { ++_children; }
+
+    void
+    ChildReaped(size_t count = 1)
+    { _children -= count; }
 
+    Counters
+    Snapshot()
+    { return {_fds, _children, _waiting, _waited, _rejected, Limit()}; }
+};
+
+class FileHandler
+{
+protected:
+    union
+    {
+        file_id _id;
+        FILE* _file;
 #ifdef _WIN32
-    retcode
-    Wait(Popen& p, const _INFINITE_TIME& = INFINITE_TIME) noexcept(false)
-    { return Wait(p, INFINITE); }
+        int _fd;
+#endif
+    };
+    enum {
+        tNone,
+        tFileId,
+        tFILE,
+        tFileDescriptor
+    } _type;
+    unsigned _self_closing;
+    bool _budgeted = false;
 
-    retcode
-    Wait(Popen& p, duration timeout_ms) noexcept(false)
+public:
+#ifdef _WIN32
+    FileHandler()
+    :   _id(INVALID_HANDLE_VALUE)
+    ,   _type(tNone)
+    ,   _self_closing(false)
+    {}
+#else
+    FileHandler()
+    :   _id(-1)
+    ,   _type(tNone)
+    ,   _self_closing(false)
+    {}
+#endif
+    FileHandler(file_id id, bool self_closing = false)
+    :   _id(id)
+    ,   _type(tFileId)
+    ,   _self_closing(self_closing)
+    {}
+
+    FileHandler(FILE* file, bool self_closing = false)
+    :   _file(file)
+    ,   _type(tFILE)
+    ,   _self_closing(self_closing)
+    {}
+#ifdef _WIN32
+    FileHandler(int fd, bool self_closing = false)
+    :   _fd(fd)
+    ,   _type(tFileDescriptor)
+    ,   _self_closing(self_closing)
+    {}
+#endif
+    FileHandler(FileHandler&) = delete;
+
+    FileHandler(FileHandler&& o)
     {
-        if (_state == sEnd) {
-            return _returncode;
-        }
-        Start(p);
-        WaitForSingleObject(_ph, timeout_ms) != WAIT_TIMEOUT or _throw(TimeoutExpired(_args, timeout_ms));
-        _state = sEnd;
-        GetExitCodeProcess(_ph, &_returncode);
-        return _returncode;
-    }
+        _id = o._id;
+        _type = o._type;
+        _self_closing = o._self_closing;
+        _budgeted = o._budgeted;
+        o._budgeted = false;
+        // invalidate the other file handler
+#ifdef _WIN32
+        o._id = INVALID_HANDLE_VALUE;
 #else
-    retcode
-    Wait(Popen& p, const _INFINITE_TIME& = INFINITE_TIME) noexcept(false)
+        o._id = -1;
+#endif
+        o._type = tNone;
+        o._self_closing = false;
+    }
+
+    ~FileHandler()
     {
-        if (_state == sEnd) {
-            return _returncode;
+        if (IsSelfClosing()) {
+            Close();
         }
-        Start(p);
-        while (_state != sEnd) {
-            // make sure the mutex is unlocked when going out of scope
-            const std::lock_guard<std::mutex> lock (*_waitpid_lock);
-            if (_state == sEnd) {
-                // Another thread waited.
-                return _returncode;
-            }
-            int status;
-            auto ret = _Wait(status, 0);
-            // Check the pid and loop as waitpid has been known to
-            // return 0 even without WNOHANG in odd situations.
-            if (ret == _pid) {
-                _HandleExitStatus(status);
-                _state = sEnd;
-                return _returncode;
-            }
+        if (_budgeted) {
+            FdBudget::Default().Release(1);
         }
-        return _returncode;
     }
 
-    retcode
-    Wait(Popen& p, duration timeout_ms) noexcept(false)
+#ifdef _WIN32
+    file_id
+    Id() const
     {
-        if (_state == sEnd) {
-            return _returncode;
-        }
-        Start(p);
-        auto end_time = clock::now() + std::chrono::milliseconds(timeout_ms);
-        auto delay = std::chrono::microseconds(500);
-        auto bound = std::chrono::microseconds(50000);
-        // make sure the mutex is unlocked when going out of scope
-        std::unique_lock<std::mutex> lock (*_waitpid_lock, std::defer_lock);
-        while (true) {
-            if (lock.try_lock()) {
-                if (_state == sEnd) {
-                    // Another thread waited.
-                    return _returncode;
-                }
-                int status;
-                if (_Wait(status, WNOHANG) == _pid) {
-                    _HandleExitStatus(status);
-                    _state = sEnd;
-                    return _returncode;
-                }
-                lock.unlock();
-            }
-            auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(end_time - clock::now());
-            if (remaining.count() <= 0) {
-                _throw(TimeoutExpired(_args, timeout_ms));
-            }
-            delay = std::min(std::min(2 * delay, remaining), bound);
-            std::this_thread::sleep_for(delay);
+        switch (_type) {
+            case tFileId: return _id;
+            case tFILE: return reinterpret_cast<file_id>(_get_osfhandle(fileno(_file)));
+            case tFileDescriptor: return reinterpret_cast<file_id>(_get_osfhandle(_fd));
+            default: return INVALID_HANDLE_VALUE;
         }
-        return _returncode;
     }
-#endif
-
-    Return
-    Communicate
-    (                    Popen& p
-    ,              const Bytes& input = {}
-    ,   const _INFINITE_TIME& = INFINITE_TIME
-    ) noexcept(false)
+#else
+    file_id
+    Id() const
     {
-        if (_state == sEnd) {
-            return {};
+        switch (_type) {
+            case tFileId: return _id;
+            case tFILE: return fileno(_file);
+            case tFileDescriptor: return _id;
+            default: return -1;
         }
-        Start(p);
-        Return ret;
-        if ((_std_in.Sender() == nullptr and (_std_out.Receiver() == nullptr or _std_err.Receiver() == nullptr))
-            or (_std_out.Receiver() == nullptr and _std_err.Receiver() == nullptr)) {
-            if (_std_in.Sender() != nullptr) {
-                if (not input.empty()) {
-                    _std_in.Sender()->Send(input);
-                }
-                _std_in.Sender()->Close();
-            } else if (_std_out.Receiver() != nullptr) {
-                ret.output = _std_out.Receiver()->Receive();
-                _std_out.Receiver()->Close();
-            } else if (_std_err.Receiver() != nullptr) {
-                ret.error = _std_err.Receiver()->Receive();
-                _std_err.Receiver()->Close();
-            }
-            Wait(p);
-            return ret;
-        } else {
-#ifndef _WIN32
-            if (_std_in.Sender() != nullptr) {
-                fsync(_std_in.Sender()->Id());
-            }
+    }
 #endif
-            // send input data
-            if (_std_in.Sender() != nullptr and not input.empty()) {
-                _std_in.Sender()->Send(input);
-                _std_in.Sender()->Close();
-            }
-            std::future<void> _output_future;
-            std::future<void> _error_future;
-            // start receiver threads
-            if (_std_out.Receiver() != nullptr) {
-                auto& output = ret.output;
-                auto receiver = _std_out.Receiver().get();
-                _output_future = std::async(std::launch::async, [&output, receiver] { output = receiver->Receive(); });
-            }
-            if (_std_err.Receiver() != nullptr) {
-                auto& error = ret.error;
-                auto receiver = _std_err.Receiver().get();
-                _error_future = std::async(std::launch::async, [&error, receiver] { error = receiver->Receive(); });
-            }
-            // wait for threads
-            if (_std_out.Receiver() != nullptr) {
-                _output_future.wait();
-            }
-            if (_std_err.Receiver() != nullptr) {
-                _error_future.wait();
-            }
-            Wait(p);
-            return ret;
-        }
-    }
-
-    Return
-    Communicate
-    (         Popen& p
-    ,   const Bytes& input
-    ,       duration timeout_ms
-    ) noexcept(false)
+    void
+    Id(file_id id)
     {
-        if (_state == sEnd) {
-            return {};
-        }
-        Start(p);
-        Return ret;
-        auto end_time = clock::now() + std::chrono::milliseconds(timeout_ms);
-#ifndef _WIN32
-        if (_std_in.Sender() != nullptr) {
-            fsync(_std_in.Sender()->Id());
-        }
-#endif
-        // send input data
-        if (_std_in.Sender() != nullptr and not input.empty()) {
-            _std_in.Sender()->Send(input);
-            _std_in.Sender()->Close();
-        }
-        std::future<void> _output_future;
-        std::future<void> _error_future;
-        // start receiver threads
-        if (_std_out.Receiver() != nullptr) {
-            auto& output = ret.output;
-            auto receiver = _std_out.Receiver().get();
-            _output_future = std::async(std::launch::async, [&output, receiver] { output = receiver->Receive(); });
-        }
-        if (_std_err.Receiver() != nullptr) {
-            auto& error = ret.error;
-            auto receiver = _std_err.Receiver().get();
-            _error_future = std::async(std::launch::async, [&error, receiver] { error = receiver->Receive(); });
-        }
-        // wait for threads
-        if (_std_out.Receiver() != nullptr and _output_future.wait_until(end_time) != std::future_status::ready) {
-            _throw(TimeoutExpired(_args, timeout_ms));
-        }
-        if (_std_err.Receiver() != nullptr and _error_future.wait_until(end_time) != std::future_status::ready) {
-            _throw(TimeoutExpired(_args, timeout_ms));
-        }
-        auto remaining = end_time - clock::now();
-        if (remaining.count() <= 0) {
-            _throw(TimeoutExpired(_args, timeout_ms));
-        }
-        Wait(p, std::chrono::duration_cast<std::chrono::milliseconds>(remaining).count());
-        return ret;
+        _id = id;
+        _type = tFileId;
     }
 
+    bool
+    IsSelfClosing() const
+    { return _self_closing; }
+
+    void
+    IsSelfClosing(bool self_closing)
+    { _self_closing = self_closing; }
+
+    /// Whether the descriptor counts against the FdBudget, released with the handler.
+    bool
+    IsBudgeted() const
+    { return _budgeted; }
+
+    void
+    IsBudgeted(bool budgeted)
+    { _budgeted = budgeted; }
+
+    bool
+    IsFileId() const
+    { return _type == tFileId; }
+
+    bool
+    IsFILE() const
+    { return _type == tFILE; }
 #ifdef _WIN32
-    retcode
-    Poll(Popen& p) noexcept(false)
-    {
-        if (_state == sEnd) {
-            return _returncode;
-        }
-        Start(p);
-        int ret = WaitForSingleObject(_ph, 0);
-        ret != STILL_ACTIVE or _throw(ProcessStillActive(_args, 0));
-        ret == WAIT_OBJECT_0 or _throw(OSError("WaitForSingleObject"));
-        _state = sEnd;
-        GetExitCodeProcess(_ph, &_returncode);
-        return _returncode;
-    }
+    bool
+    IsFileDescriptor() const
+    { return _type == tFileDescriptor; }
 #else
-    retcode
-    Poll(Popen& p) noexcept(false)
-    {
-        if (_state == sEnd) {
-            return _returncode;
-        }
-        Start(p);
-        // make sure the mutex is unlocked when going out of scope
-        std::unique_lock<std::mutex> lock (*_waitpid_lock, std::defer_lock);
-        lock.try_lock() or _throw(WaitLockMissed(_args, 0));
-        if (_state == sEnd) {
-            // Another thread waited.
-            return _returncode;
-        }
-        int status;
-        auto ret = _Wait(status, WNOHANG);
-        if (ret == 0) {
-            _throw(ProcessStillActive(_args, 0));
-        } else if (ret == _pid) {
-            _HandleExitStatus(status);
-        } else {
-            _returncode = status;
-        }
-        _state = sEnd;
-        return _returncode;
-    }
+    bool
+    IsFileDescriptor() const
+    { return IsFileId(); }
 #endif
-
 #ifdef _WIN32
-    int
-    SendSignal(int sig)
-    {
-        if (_state == sEnd) {
-            return 0;
-        }
-        if (sig == SIGTERM) {
-            return Terminate();
-        } else if (sig == CTRL_C_EVENT) {
-            return GenerateConsoleCtrlEvent(CTRL_C_EVENT, _pid) != 0;
-        } else if (sig == CTRL_BREAK_EVENT) {
-            return GenerateConsoleCtrlEvent(CTRL_BREAK_EVENT, _pid) != 0;
-        }
-        return 1;
-    }
+    bool
+    IsValid() const
+    { return (IsFileId() and _id != INVALID_HANDLE_VALUE) or (IsFILE() and _file != nullptr) or (IsFileDescriptor() and _fd != -1); }
 #else
-    int
-    SendSignal(int sig)
-    {
-        if (_state == sEnd) {
-            return 0;
-        }
-        return kill(_pid, sig);
-    }
+    bool
+    IsValid() const
+    { return (IsFileId() and _id != -1) or (IsFILE() and _file != nullptr); }
 #endif
-
 #ifdef _WIN32
     int
-    Terminate()
+    Close() const
     {
-        if (_state == sEnd) {
-            return 0;
-        }
-        int ret = TerminateProcess(_ph, 1);
-        if (ret != 0) {
-            return 0;
+        switch (_type) {
+            case tFileId: return CloseHandle(_id);
+            case tFILE: return fclose(_file);
+            case tFileDescriptor: return _close(_fd);
+            default: return -1;
         }
-        _state = sEnd;
-        GetExitCodeProcess(_ph, &_returncode);
-        return _returncode == STILL_ACTIVE;
     }
 #else
     int
-    Terminate()
+    Close() const
     {
-        if (_state == sEnd) {
-            return 0;
+        switch (_type) {
+            case tFileId: return close(_id);
+            case tFILE: return fclose(_file);
+            case tFileDescriptor: return close(_id);
+            default: return -1;
         }
-        return kill(_pid, SIGTERM);
     }
 #endif
-
 #ifdef _WIN32
-    int
-    Kill()
-    { return Terminate(); }
-#else
-    int
-    Kill()
+    FileHandler&
+    MakeInheritable(bool inherit)
     {
-        if (_state == sEnd) {
-            return 0;
+        if (_type == tFileId) {
+            SetHandleInformation(_id, HANDLE_FLAG_INHERIT, inherit)
+            or _throw(OSError("SetHandleInformation"));
         }
-        return kill(_pid, SIGKILL);
+        return *this;
     }
-#endif
-
-#ifdef _WIN32
-    DWORD
-    Pid() const
-    { return _pid; }
 #else
-    pid_t
-    Pid() const
-    { return _pid; }
-#endif
-    retcode
-    ReturnCode() const
-    { return _returncode; }
-
-    std::vector<std::string>
-    Arguments() const
-    { return _args; }
-
-protected:
-#ifdef _WIN32
-    std::unique_ptr<STARTUPINFO>
-    _GetStartupInfo()
+    FileHandler&
+    CloseOnExec(bool close)
     {
-        bool v0 = _std_in .Receiver() != nullptr and _std_in .Receiver()->IsValid();
-        bool v1 = _std_out.Sender  () != nullptr and _std_out.Sender  ()->IsValid();
-        bool v2 = _std_err.Sender  () != nullptr and _std_err.Sender  ()->IsValid();
-        auto si = new STARTUPINFO();
-        si->cb = sizeof (STARTUPINFO);
-        if (v0 or v1 or v2) {
-            si->dwFlags = STARTF_USESTDHANDLES;
-            si->hStdInput  = v0 ? _std_in .Receiver()->Id() : GetStdHandle(STD_INPUT_HANDLE);
-            si->hStdOutput = v1 ? _std_out.Sender  ()->Id() : GetStdHandle(STD_OUTPUT_HANDLE);
-            si->hStdError  = v2 ? _std_err.Sender  ()->Id() : GetStdHandle(STD_ERROR_HANDLE);
-            _close_fds = false;
+        int flags = fcntl(Id(), F_GETFD, 0);
+        if (close) {
+            flags |= FD_CLOEXEC;
+        } else {
+            flags &= ~FD_CLOEXEC;
         }
-        return std::unique_ptr<STARTUPINFO>(si);
+        fcntl(Id(), F_SETFD, flags) == 0 or _throw(OSError("fcntl(2)"));
+        return *this;
     }
+#endif
+};
 
-    std::unique_ptr<std::string, void (*)(std::string*)>
-    _GetCommand()
-    {
-        if (not _args_is_seq) {
-            return {&_args.front(), _noopDelete};
-        }
-        auto s = new std::string(shellEscaped(_args.front()));
-        auto i = _args.cbegin() + 1, e = _args.cend();
-        for (; i != e; ++i) {
-            s->append(" " + shellEscaped(*i));
-        }
-        return {s, _delete};
-    }
+#if not defined(_WIN32) and not defined(_GNU_SOURCE)
+/// Without pipe2(2), FD_CLOEXEC is only set after the descriptors exist: spawns hold
+/// this lock shared, and the code creating such descriptors holds it exclusively.
+std::shared_mutex&
+_CloseOnExecLock()
+{
+    static std::shared_mutex lock;
+    return lock;
+}
+#endif
 
-    std::unique_ptr<char[]>
-    _GetEnvironment(Popen& p) const;
-#else
-    std::unique_ptr<posix_spawn_file_actions_t, decltype (&_deletePosixSpawnFileActions)>
-    _GetFileActions()
+namespace Pipe
+{
+    class Receiver : public FileHandler
     {
-        bool v0 = _std_in .Sender  () != nullptr and _std_in .Sender  ()->IsValid();
-        bool v1 = _std_out.Receiver() != nullptr and _std_out.Receiver()->IsValid();
-        bool v2 = _std_err.Receiver() != nullptr and _std_err.Receiver()->IsValid();
-        bool v3 = _std_in .Receiver() != nullptr and _std_in .Receiver()->IsValid();
-        bool v4 = _std_out.Sender  () != nullptr and _std_out.Sender  ()->IsValid();
-        bool v5 = _std_err.Sender  () != nullptr and _std_err.Sender  ()->IsValid();
-        if (not (v0 or v1 or v2 or v3 or v4 or v5 or _close_fds)) {
-            return {nullptr, nullptr};
-        }
-        if (v3 and _std_in .Receiver()->Id() > STDERR_FILENO) {
-            _std_in .Receiver()->CloseOnExec(true);
-        }
-        if (v4 and _std_out.Sender  ()->Id() > STDERR_FILENO) {
-            _std_out.Sender  ()->CloseOnExec(true);
-        }
-        if (v5 and _std_err.Sender  ()->Id() > STDERR_FILENO) {
-            _std_err.Sender  ()->CloseOnExec(true);
-        }
-        int max_fd;
-        if (_close_fds) {
-            max_fd = sysconf(_SC_OPEN_MAX);
+    public:
+        using FileHandler::FileHandler;
+#ifdef _WIN32
+        ssize_t
+        Receive(void* buf, size_t count) const
+        {
+            if (IsFileId()) {
+                DWORD size, length = 0;
+                while (count > 0 and ReadFile(_id, buf, count, &size, NULL) and size > 0) {
+                    length += size;
+                    count -= static_cast<size_t>(size);
+                    buf = static_cast<char*>(buf) + size;
+                }
+                return length;
+            } else if (IsFILE()) {
+                int size, length = 0;
+                while (count > 0 and (size = fread(buf, 1, count, _file)) > 0) {
+                    length += size;
+                    count -= static_cast<size_t>(size);
+                    buf = static_cast<char*>(buf) + size;
+                }
+                return length;
+            } else if (IsFileDescriptor()) {
+                int size, length = 0;
+                while (count > 0 and (size = _read(_fd, buf, count)) > 0) {
+                    length += size;
+                    count -= static_cast<size_t>(size);
+                    buf = static_cast<char*>(buf) + size;
+                }
+                return length;
+            }
+            return -1;
+        }
+
+        /// Read once, returning as soon as some data is available.
+        ssize_t
+        ReceiveSome(void* buf, size_t count) const
+        {
+            if (IsFileId()) {
+                DWORD size;
+                return ReadFile(_id, buf, count, &size, NULL) ? static_cast<ssize_t>(size) : 0;
+            } else if (IsFILE()) {
+                return fread(buf, 1, count, _file);
+            } else if (IsFileDescriptor()) {
+                return _read(_fd, buf, count);
+            }
+            return -1;
+        }
+#else
+        ssize_t
+        Receive(void* buf, size_t count) const
+        {
+            if (IsFileId()) {
+                ssize_t size, length = 0;
+                while (count > 0 and (size = read(_id, buf, count)) > 0) {
+                    length += size;
+                    count -= static_cast<size_t>(size);
+                    buf = static_cast<char*>(buf) + size;
+                }
+                return length;
+            } else if (IsFILE()) {
+                size_t size, length = 0;
+                while (count > 0 and (size = fread(buf, 1, count, _file)) > 0) {
+                    length += size;
+                    count -= size;
+                    buf = static_cast<char*>(buf) + size;
+                }
+                return static_cast<ssize_t>(length);
+            }
+            return -1;
+        }
+
+        /// Read once, returning as soon as some data is available.
+        ssize_t
+        ReceiveSome(void* buf, size_t count) const
+        {
+            if (IsFileId()) {
+                ssize_t size;
+                while ((size = read(_id, buf, count)) == -1 and errno == EINTR) {
+                }
+                return size;
+            } else if (IsFILE()) {
+                return static_cast<ssize_t>(fread(buf, 1, count, _file));
+            }
+            return -1;
+        }
+#endif
+        Bytes
+        Receive() const
+        {
+            Bytes bytes;
+            ssize_t size;
+            size_t length = 0;
+            bytes.resize(4096);
+            while ((size = Receive(const_cast<byte*>(bytes.data()) + length, 4096)) > 0) {
+                length += static_cast<size_t>(size);
+                bytes.resize(length + 4096);
+            }
+            bytes.resize(length);
+            return bytes;
+        }
+    };
+
+    class Sender : public FileHandler
+    {
+    public:
+        using FileHandler::FileHandler;
+#ifdef _WIN32
+        ssize_t
+        Send(const void* buf, size_t count) const
+        {
+            if (IsFileId()) {
+                DWORD size;
+                WriteFile(_id, buf, count, &size, NULL);
+                return size;
+            } else if (IsFILE()) {
+                return fwrite(buf, 1, count, _file);
+            } else if (IsFileDescriptor()) {
+                return _write(_fd, buf, count);
+            }
+            return -1;
+        }
+#else
+        ssize_t
+        Send(const void* buf, size_t count) const
+        {
+            if (IsFileId()) {
+                return write(_id, buf, count);
+            } else if (IsFILE()) {
+                return static_cast<ssize_t>(fwrite(buf, 1, count, _file));
+            }
+            return -1;
+        }
+#endif
+        ssize_t
+        Send(const Bytes& v) const
+        { return Send(v.data(), v.size()); }
+
+        ssize_t
+        Send(const std::string& s) const
+        { return Send(s.c_str(), s.size()); }
+    };
+
+    /// Opens a pipe into existing handlers, with both ends admitted by the FdBudget already.
+    void
+    Open(Receiver& receiver, Sender& sender, size_t& admitted)
+    {
+#ifdef _WIN32
+        HANDLE fh[2];
+        // make the handles inheritable
+        SECURITY_ATTRIBUTES sa;
+        sa.nLength = sizeof sa;
+        sa.bInheritHandle = TRUE;
+        sa.lpSecurityDescriptor = NULL;
+        //
+        CreatePipe(fh, fh + 1, &sa, 0) or _throw(OSError("CreatePipe"));
+        receiver.Id(fh[0]);
+        sender.Id(fh[1]);
+#else
+        int fd[2];
+#   ifdef _GNU_SOURCE
+        pipe2(fd, O_CLOEXEC) == 0 or _throw(OSError("pipe2(2)"));
+        receiver.Id(fd[0]);
+        sender.Id(fd[1]);
+#   else
+        // no child may be spawned before both ends are marked
+        std::unique_lock<std::shared_mutex> lock(_CloseOnExecLock());
+        pipe(fd) == 0 or _throw(OSError("pipe(2)"));
+        receiver.Id(fd[0]);
+        sender.Id(fd[1]);
+        receiver.CloseOnExec(true);
+        sender.CloseOnExec(true);
+#   endif
+#endif
+        receiver.IsSelfClosing(true);
+        sender.IsSelfClosing(true);
+        // the slots now belong to the two ends
+        receiver.IsBudgeted(true);
+        sender.IsBudgeted(true);
+        admitted -= 2;
+    }
+
+    /// Opens a pipe into existing handlers, admitting both ends before creating anything.
+    void
+    Open(Receiver& receiver, Sender& sender)
+    {
+        size_t admitted = 2;
+        FdBudget::Default().Acquire(admitted);
+        try {
+            Open(receiver, sender, admitted);
+        } catch (...) {
+            FdBudget::Default().Release(admitted);
+            throw;
+        }
+    }
+
+    std::pair<Receiver*, Sender*>
+    Pipe()
+    {
+        std::unique_ptr<Receiver> receiver(new Receiver);
+        std::unique_ptr<Sender> sender(new Sender);
+        Open(*receiver, *sender);
+        return {receiver.release(), sender.release()};
+    }
+};
+
+class _PIPE
+{};
+class _STDOUT
+{};
+class _DEVNUL
+{};
+class _INFINITE_TIME
+{};
+static const _PIPE PIPE;
+static const _STDOUT STDOUT;
+static const _DEVNUL DEVNUL;
+static const _INFINITE_TIME INFINITE_TIME;
+
+struct SubprocessError : std::exception
+{
+    Bytes output;
+    Bytes error;
+    retcode returncode;
+    std::vector<std::string> args;
+
+    SubprocessError
+    (   std::vector<std::string> args_
+    ,   retcode returncode_
+    ,   Bytes output_ = {}
+    ,   Bytes error_ = {}
+    )
+    :   output(std::move(output_))
+    ,   error(std::move(error_))
+    ,   returncode(returncode_)
+    ,   args(std::move(args_))
+    {}
+
+    SubprocessError(const SubprocessError& o)
+    :   output(o.output)
+    ,   error(o.error)
+    ,   returncode(o.returncode)
+    ,   args(o.args)
+    ,   _what(std::atomic_load(&o._what))
+    {}
+
+    SubprocessError&
+    operator=(const SubprocessError& o)
+    {
+        output = o.output;
+        error = o.error;
+        returncode = o.returncode;
+        args = o.args;
+        std::atomic_store(&_what, std::atomic_load(&o._what));
+        return *this;
+    }
+
+    /// Thread-safe, e.g. on an exception shared through a std::shared_future.
+    const char*
+    what() const noexcept
+    {
+        // built on first use only, as most of these are caught without asking
+        auto what = std::atomic_load(&_what);
+        if (what != nullptr) {
+            return what->c_str();
+        }
+        try {
+            std::string a;
+            for (const auto& i : args) {
+                if (i.empty()) {
+                    a += " \"\"";
+                } else {
+                    a += " " + i;
+                }
+            }
+            auto built = std::make_shared<const std::string>("SubprocessError\n"
+                "Arguments:" + a + "\n"
+                "Return code: " + std::to_string(returncode) + "\n"
+                "Output: " + (output.size() <= 10 ? output.string() : output.string().substr(0, 10) + "[...]") + "\n"
+                "Error: " + (error.size() <= 10 ? error.string() : error.string().substr(0, 10) + "[...]"));
+            // the first one published wins, so every caller sees the same string
+            std::shared_ptr<const std::string> none;
+            std::atomic_compare_exchange_strong(&_what, &none, built);
+            return (none != nullptr ? none : built)->c_str();
+        } catch (...) {
+            return "SubprocessError";
+        }
+    }
+
+private:
+    mutable std::shared_ptr<const std::string> _what;
+};
+
+struct CalledProcessError : public SubprocessError
+{
+    using SubprocessError::SubprocessError;
+};
+
+struct TimeoutExpired : public SubprocessError
+{
+    using SubprocessError::SubprocessError;
+};
+
+struct ProcessStillActive : public SubprocessError
+{
+    using SubprocessError::SubprocessError;
+};
+
+struct WaitLockMissed : public SubprocessError
+{
+    using SubprocessError::SubprocessError;
+};
+
+/// Output overflowed a FixedBuffer with the oFail policy; the child was killed.
+struct OutputOverflow : public SubprocessError
+{
+    using SubprocessError::SubprocessError;
+};
+
+/**
+ * @brief Hashed timer wheel shared by many deadlines.
+ *
+ * A single worker thread advances the wheel, so thousands of deadlines cost
+ * one thread and one sleeper. Schedule() and Cancel() are O(1): timers are
+ * intrusive list nodes taken from a recycled pool, hashed into a slot by
+ * their expiry tick, with a round counter for deadlines beyond one turn.
+ *
+ * A callback may return a non-zero delay in milliseconds to re-arm the same
+ * timer (the handle stays valid), which is how multi-phase expiry actions
+ * (SIGTERM, grace period, SIGKILL) are chained. Once Cancel() returns, the
+ * callback is guaranteed not to be running and not to run again.
+ */
+class TimerWheel
+{
+public:
+    typedef std::function<duration()> Callback;
+
+    struct Handle
+    {
+        uint32_t index = ~0u;
+        uint32_t generation = 0;
+
+        bool
+        IsValid() const
+        { return index != ~0u; }
+    };
+
+private:
+    struct Node
+    {
+        Node* prev = nullptr;
+        Node* next = nullptr;
+        uint64_t rounds = 0;
+        uint32_t index = 0;
+        uint32_t generation = 0;
+        size_t slot = 0;
+        bool armed = false;
+        Callback callback;
+    };
+
+    std::mutex _mutex;
+    std::condition_variable _wakeup;
+    std::condition_variable _fired;
+    std::vector<Node*> _slots;
+    std::deque<Node> _nodes;
+    std::vector<uint32_t> _free;
+    std::vector<std::pair<Node*, uint32_t>> _due;
+    std::chrono::milliseconds _tick;
+    clock::time_point _start;
+    uint64_t _current = 0;
+    size_t _armed = 0;
+    const Node* _firing = nullptr;
+    std::thread::id _worker_id;
+    bool _stop = false;
+    std::thread _worker;
+
+public:
+    explicit TimerWheel(duration tick_ms = 10, size_t slots = 512)
+    :   _slots(std::max<size_t>(slots, 1), nullptr)
+    ,   _tick(std::max<duration>(tick_ms, 1))
+    ,   _start(clock::now())
+    {
+        _worker = std::thread([this] { _Run(); });
+        _worker_id = _worker.get_id();
+    }
+
+    TimerWheel(TimerWheel&) = delete;
+
+    TimerWheel&
+    operator=(TimerWheel&) = delete;
+
+    ~TimerWheel()
+    {
+        {
+            const std::lock_guard<std::mutex> lock (_mutex);
+            _stop = true;
+        }
+        _wakeup.notify_one();
+        _worker.join();
+    }
+
+    /// The process-wide wheel used by Popen::Deadline().
+    static TimerWheel&
+    Default()
+    {
+        static TimerWheel wheel;
+        return wheel;
+    }
+
+    Handle
+    Schedule(duration timeout_ms, Callback callback)
+    {
+        const std::lock_guard<std::mutex> lock (_mutex);
+        Node* node;
+        if (_free.empty()) {
+            _nodes.emplace_back();
+            node = &_nodes.back();
+            node->index = static_cast<uint32_t>(_nodes.size() - 1);
+        } else {
+            node = &_nodes[_free.back()];
+            _free.pop_back();
+        }
+        node->callback = std::move(callback);
+        _Link(node, timeout_ms);
+        _wakeup.notify_one();
+        return {node->index, node->generation};
+    }
+
+    /**
+     * @brief Cancel a timer. Blocks while its callback is running on the worker thread.
+     * @return true if the timer was still pending.
+     */
+    bool
+    Cancel(Handle& h)
+    {
+        if (not h.IsValid()) {
+            return false;
+        }
+        std::unique_lock<std::mutex> lock (_mutex);
+        Node* node = &_nodes[h.index];
+        if (std::this_thread::get_id() != _worker_id) {
+            _fired.wait(lock, [&] { return _firing != node; });
+        }
+        bool pending = node->generation == h.generation and node->armed;
+        if (node->generation == h.generation and node == _firing) {
+            // from its own callback, still running: _Run() releases the node afterwards
+            ++node->generation;
+        } else if (node->generation == h.generation) {
+            if (node->armed) {
+                _Unlink(node);
+            }
+            _Release(node);
+        }
+        h = {};
+        return pending;
+    }
+
+    size_t
+    Size()
+    {
+        const std::lock_guard<std::mutex> lock (_mutex);
+        return _armed;
+    }
+
+private:
+    uint64_t
+    _Now() const
+    { return static_cast<uint64_t>((clock::now() - _start) / _tick); }
+
+    void
+    _Link(Node* node, duration timeout_ms)
+    {
+        if (_armed == 0) {
+            // the wheel was idle; skip the ticks that elapsed meanwhile
+            _current = std::max(_current, _Now());
+        }
+        // round up, so that a timer never fires early
+        uint64_t ticks = (timeout_ms + _tick.count() - 1) / _tick.count();
+        uint64_t expiry = std::max(_Now(), _current) + std::max<uint64_t>(ticks, 1);
+        node->slot = expiry % _slots.size();
+        node->rounds = (expiry - _current - 1) / _slots.size();
+        node->prev = nullptr;
+        node->next = _slots[node->slot];
+        if (node->next != nullptr) {
+            node->next->prev = node;
+        }
+        _slots[node->slot] = node;
+        node->armed = true;
+        ++_armed;
+    }
+
+    void
+    _Unlink(Node* node)
+    {
+        if (node->prev != nullptr) {
+            node->prev->next = node->next;
+        } else {
+            _slots[node->slot] = node->next;
+        }
+        if (node->next != nullptr) {
+            node->next->prev = node->prev;
+        }
+        node->armed = false;
+        --_armed;
+    }
+
+    void
+    _Release(Node* node)
+    {
+        node->callback = nullptr;
+        ++node->generation;
+        _free.push_back(node->index);
+    }
+
+    void
+    _Run()
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        while (not _stop) {
+            if (_armed == 0) {
+                _wakeup.wait(lock, [this] { return _stop or _armed != 0; });
+                continue;
+            }
+            auto now = _Now();
+            if (_current >= now) {
+                _wakeup.wait_until(lock, _start + _tick * (_current + 1));
+                continue;
+            }
+            ++_current;
+            // collect the expired timers first, as callbacks run unlocked
+            Node* node = _slots[_current % _slots.size()];
+            while (node != nullptr) {
+                Node* next = node->next;
+                if (node->rounds > 0) {
+                    --node->rounds;
+                } else {
+                    _Unlink(node);
+                    _due.emplace_back(node, node->generation);
+                }
+                node = next;
+            }
+            for (size_t i = 0; i < _due.size(); ++i) {
+                node = _due[i].first;
+                auto generation = _due[i].second;
+                if (node->generation != generation or node->armed) {
+                    // cancelled (and possibly reused) meanwhile
+                    continue;
+                }
+                _firing = node;
+                lock.unlock();
+                duration rearm = node->callback();
+                lock.lock();
+                _firing = nullptr;
+                _fired.notify_all();
+                if (node->generation != generation) {
+                    // cancelled by the callback itself
+                    _Release(node);
+                } else if (not node->armed) {
+                    if (rearm > 0) {
+                        _Link(node, rearm);
+                    } else {
+                        _Release(node);
+                    }
+                }
+            }
+            _due.clear();
+        }
+    }
+};
+
+/**
+ * @brief Lifecycle events of the children, for telemetry.
+ *
+ * The observer is a compile-time policy: a type with the static member
+ * functions of NullObserver, selected by defining SUBPROCESS_OBSERVER before
+ * including this header. The default NullObserver has empty inline members,
+ * so the hooks compile to nothing. Define SUBPROCESS_OBSERVER as
+ * subprocess::RuntimeObserver to register Observer instances at run time.
+ *
+ * A custom policy can be declared ahead of the header, using forward
+ * declarations for its parameters:
+ * \code
+ * namespace subprocess { struct ProcessStats; }
+ * struct MyObserver
+ * {
+ *     static void OnSpawn(long pid, const std::vector<std::string>& args);
+ *     // ... all the other members of NullObserver
+ * };
+ * #define SUBPROCESS_OBSERVER MyObserver
+ * #include "subprocess.h"
+ * \endcode
+ *
+ * `stream` is 1 for the standard output and 2 for the standard error.
+ */
+struct NullObserver
+{
+    static void
+    OnSpawn(long /*pid*/, const std::vector<std::string>& /*args*/)
+    {}
+
+    static void
+    OnFirstOutput(long /*pid*/, int /*stream*/)
+    {}
+
+    static void
+    OnEof(long /*pid*/, int /*stream*/, size_t /*bytes*/)
+    {}
+
+    static void
+    OnExit(long /*pid*/, retcode /*returncode*/, const ProcessStats& /*stats*/)
+    {}
+
+    static void
+    OnTimeout(long /*pid*/, duration /*timeout_ms*/)
+    {}
+
+    static void
+    OnKill(long /*pid*/, int /*sig*/)
+    {}
+};
+
+/// Dynamic observer, registered with RuntimeObserver::Register().
+class Observer
+{
+public:
+    virtual
+    ~Observer() = default;
+
+    virtual void
+    OnSpawn(long /*pid*/, const std::vector<std::string>& /*args*/)
+    {}
+
+    virtual void
+    OnFirstOutput(long /*pid*/, int /*stream*/)
+    {}
+
+    virtual void
+    OnEof(long /*pid*/, int /*stream*/, size_t /*bytes*/)
+    {}
+
+    virtual void
+    OnExit(long /*pid*/, retcode /*returncode*/, const ProcessStats& /*stats*/)
+    {}
+
+    virtual void
+    OnTimeout(long /*pid*/, duration /*timeout_ms*/)
+    {}
+
+    virtual void
+    OnKill(long /*pid*/, int /*sig*/)
+    {}
+};
+
+/**
+ * @brief Observer policy forwarding the events to the registered Observer instances.
+ *
+ * The list is copied on write, so dispatching never waits for a callback
+ * or a registration: it only copies the current list's pointer with
+ * std::atomic_load(), which libstdc++ guards with a pool of mutexes held
+ * just for that copy.
+ */
+class RuntimeObserver
+{
+private:
+    typedef std::vector<Observer*> _List;
+
+    inline static std::mutex _mutex;
+    inline static std::shared_ptr<const _List> _observers = std::make_shared<const _List>();
+
+    template<class F>
+    static void
+    _Dispatch(F f)
+    {
+        auto observers = std::atomic_load(&_observers);
+        for (auto o : *observers) {
+            f(o);
+        }
+    }
+
+public:
+    /// The observer must outlive its registration.
+    static void
+    Register(Observer* observer)
+    {
+        const std::lock_guard<std::mutex> lock (_mutex);
+        auto observers = std::make_shared<_List>(*_observers);
+        observers->push_back(observer);
+        std::atomic_store(&_observers, std::shared_ptr<const _List>(std::move(observers)));
+    }
+
+    static void
+    Unregister(Observer* observer)
+    {
+        const std::lock_guard<std::mutex> lock (_mutex);
+        auto observers = std::make_shared<_List>(*_observers);
+        observers->erase(std::remove(observers->begin(), observers->end(), observer), observers->end());
+        std::atomic_store(&_observers, std::shared_ptr<const _List>(std::move(observers)));
+    }
+
+    static void
+    OnSpawn(long pid, const std::vector<std::string>& args)
+    { _Dispatch([&](Observer* o) { o->OnSpawn(pid, args); }); }
+
+    static void
+    OnFirstOutput(long pid, int stream)
+    { _Dispatch([&](Observer* o) { o->OnFirstOutput(pid, stream); }); }
+
+    static void
+    OnEof(long pid, int stream, size_t bytes)
+    { _Dispatch([&](Observer* o) { o->OnEof(pid, stream, bytes); }); }
+
+    static void
+    OnExit(long pid, retcode returncode, const ProcessStats& stats)
+    { _Dispatch([&](Observer* o) { o->OnExit(pid, returncode, stats); }); }
+
+    static void
+    OnTimeout(long pid, duration timeout_ms)
+    { _Dispatch([&](Observer* o) { o->OnTimeout(pid, timeout_ms); }); }
+
+    static void
+    OnKill(long pid, int sig)
+    { _Dispatch([&](Observer* o) { o->OnKill(pid, sig); }); }
+};
+
+#ifndef SUBPROCESS_OBSERVER
+#   define SUBPROCESS_OBSERVER ::subprocess::NullObserver
+#endif
+typedef SUBPROCESS_OBSERVER ObserverPolicy;
+
+#ifndef _WIN32
+/**
+ * @brief What to do when a child outlives its deadline.
+ *
+ * `signal` is sent first; if the child is still there after `grace_ms`,
+ * `final_signal` is sent. `notify` is then called on the wheel's thread.
+ * A zero signal skips that phase.
+ */
+struct ExpiryAction
+{
+    int signal = SIGTERM;
+    duration grace_ms = 1000;
+    int final_signal = SIGKILL;
+    std::function<void()> notify;
+};
+
+/// Shared between a Popen_impl and the timer callback driving its deadline.
+struct _Deadline
+{
+    pid_t pid;
+    ExpiryAction action;
+    duration timeout_ms;
+    std::atomic<bool> expired {false};
+    int phase = 0;
+    // the whole group is signaled when the child leads its own
+    pid_t pgid = 0;
+
+    int
+    Signal(int sig)
+    { return kill(pgid > 0 ? -pgid : pid, sig); }
+
+    duration
+    operator()()
+    {
+        expired = true;
+        if (phase == 0) {
+            phase = 1;
+            ObserverPolicy::OnTimeout(pid, timeout_ms);
+            if (action.signal != 0) {
+                ObserverPolicy::OnKill(pid, action.signal);
+                Signal(action.signal);
+                if (action.final_signal != 0) {
+                    return std::max<duration>(action.grace_ms, 1);
+                }
+            }
+        }
+        if (phase == 1) {
+            phase = 2;
+            if (action.final_signal != 0) {
+                ObserverPolicy::OnKill(pid, action.final_signal);
+                Signal(action.final_signal);
+            }
+            if (action.notify) {
+                action.notify();
+            }
+        }
+        return 0;
+    }
+};
+
+/// Return code of a waitpid() status: the exit code, the signal, or minus the stop signal.
+retcode
+_ReturnCode(int status)
+{
+    if (WIFSTOPPED(status)) {
+        return -WSTOPSIG(status);
+    } else if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    return WTERMSIG(status);
+}
+
+/// A descriptor polling readable once pid exited, or -1 where unavailable or over the FdBudget.
+int
+_PidFd(pid_t pid)
+{
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    if (not FdBudget::Default().TryAcquire(1)) {
+        return -1;
+    }
+    auto pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+    if (pidfd == -1) {
+        FdBudget::Default().Release(1);
+    }
+    return pidfd;
+#else
+    return -1;
+#endif
+}
+
+void
+_ClosePidFd(int pidfd)
+{
+    close(pidfd);
+    FdBudget::Default().Release(1);
+}
+
+/**
+ * @brief Background thread reaping children that nobody waits for anymore.
+ *
+ * Popen destructors and Popen::Detach() hand their unreaped pids over, so
+ * that zombies are still collected while the caller returns immediately.
+ * The thread is started on first use and polls its pids with a backoff.
+ */
+class Reaper
+{
+private:
+    struct Child
+    {
+        pid_t pid;
+        TimerWheel* wheel;
+        TimerWheel::Handle timer;
+    };
+
+    std::mutex _mutex;
+    std::condition_variable _wakeup;
+    std::vector<Child> _children;
+    std::atomic<size_t> _reaped {0};
+    bool _stop = false;
+    std::thread _worker;
+
+public:
+    Reaper() = default;
+
+    Reaper(Reaper&) = delete;
+
+    Reaper&
+    operator=(Reaper&) = delete;
+
+    ~Reaper()
+    {
+        {
+            const std::lock_guard<std::mutex> lock (_mutex);
+            _stop = true;
+        }
+        _wakeup.notify_one();
+        if (_worker.joinable()) {
+            _worker.join();
+        }
+    }
+
+    static Reaper&
+    Default()
+    {
+        static Reaper reaper;
+        return reaper;
+    }
+
+    /// Take over the reaping of pid, and of its deadline timer if any.
+    void
+    Adopt(pid_t pid, TimerWheel* wheel = nullptr, TimerWheel::Handle timer = {})
+    {
+        {
+            const std::lock_guard<std::mutex> lock (_mutex);
+            _children.push_back({pid, wheel, timer});
+            if (not _worker.joinable()) {
+                _worker = std::thread([this] { _Run(); });
+            }
+        }
+        _wakeup.notify_one();
+    }
+
+    /// Number of adopted children not reaped yet.
+    size_t
+    Pending()
+    {
+        const std::lock_guard<std::mutex> lock (_mutex);
+        return _children.size();
+    }
+
+    /// Number of adopted children reaped so far.
+    size_t
+    Reaped() const
+    { return _reaped; }
+
+private:
+    static bool
+    _TryReap(Child& c)
+    {
+        if (c.timer.IsValid()) {
+            siginfo_t info;
+            info.si_pid = 0;
+            if (waitid(P_PID, c.pid, &info, WEXITED | WNOWAIT | WNOHANG) == 0 and info.si_pid == 0) {
+                return false;
+            }
+            c.wheel->Cancel(c.timer);
+        }
+        // ECHILD means somebody else reaped it, or SIGCHLD is ignored
+        return waitpid(c.pid, nullptr, WNOHANG) != 0;
+    }
+
+    void
+    _Run()
+    {
+        auto delay = std::chrono::milliseconds(1);
+        auto bound = std::chrono::milliseconds(100);
+        std::vector<Child> children;
+        std::unique_lock<std::mutex> lock (_mutex);
+        while (not _stop) {
+            if (_children.empty()) {
+                _wakeup.wait(lock, [this] { return _stop or not _children.empty(); });
+                delay = std::chrono::milliseconds(1);
+                continue;
+            }
+            children.swap(_children);
+            lock.unlock();
+            auto end = std::remove_if(children.begin(), children.end(), _TryReap);
+            _reaped += static_cast<size_t>(children.end() - end);
+            FdBudget::Default().ChildReaped(static_cast<size_t>(children.end() - end));
+            children.erase(end, children.end());
+            lock.lock();
+            _children.insert(_children.end(), children.begin(), children.end());
+            children.clear();
+            if (not _children.empty()) {
+                _wakeup.wait_for(lock, delay);
+                delay = std::min(2 * delay, bound);
+            }
+        }
+    }
+};
+
+#ifdef __linux__
+/**
+ * @brief Opt-in child subreaper: the orphaned descendants of our children are
+ * reparented to this process instead of init, and reaped here.
+ *
+ * Only the children started by Popen are told apart from orphans: enable it
+ * only if nothing else in the process starts children and waits for them.
+ */
+class Subreaper
+{
+private:
+    // held shared while spawning and tracking, exclusively while sweeping
+    std::shared_mutex _spawning;
+    std::mutex _mutex;
+    std::vector<pid_t> _known;
+    std::atomic<bool> _enabled {false};
+    std::atomic<size_t> _reaped {0};
+    std::condition_variable _wakeup;
+    bool _stop = false;
+    std::thread _worker;
+
+public:
+    Subreaper() = default;
+
+    Subreaper(Subreaper&) = delete;
+
+    Subreaper&
+    operator=(Subreaper&) = delete;
+
+    ~Subreaper()
+    {
+        {
+            const std::lock_guard<std::mutex> lock (_mutex);
+            _stop = true;
+        }
+        _wakeup.notify_one();
+        if (_worker.joinable()) {
+            _worker.join();
+        }
+    }
+
+    static Subreaper&
+    Default()
+    {
+        static Subreaper subreaper;
+        return subreaper;
+    }
+
+    /**
+     * @brief Become the subreaper, and sweep orphans every interval_ms on a background thread.
+     * @return false if prctl(2) failed.
+     */
+    bool
+    Enable(duration interval_ms = 100)
+    {
+        if (prctl(PR_SET_CHILD_SUBREAPER, 1) != 0) {
+            return false;
+        }
+        const std::lock_guard<std::mutex> lock (_mutex);
+        _enabled = true;
+        if (not _worker.joinable()) {
+            _worker = std::thread([this, interval_ms] { _Run(interval_ms); });
+        }
+        return true;
+    }
+
+    bool
+    Enabled() const
+    { return _enabled; }
+
+    /**
+     * @brief Reap the orphans which exited.
+     * @return The number of orphans reaped by this call.
+     */
+    size_t
+    Reap()
+    {
+        std::unique_lock<std::shared_mutex> sweeping (_spawning);
+        auto children = _Children();
+        const std::lock_guard<std::mutex> lock (_mutex);
+        // forget the children reaped by their Popen since
+        _known.erase(std::remove_if(_known.begin(), _known.end(), [&children](pid_t pid) {
+            return std::find(children.begin(), children.end(), pid) == children.end();
+        }), _known.end());
+        size_t reaped = 0;
+        for (auto pid : children) {
+            if (std::find(_known.begin(), _known.end(), pid) == _known.end() and waitpid(pid, nullptr, WNOHANG) > 0) {
+                ++reaped;
+            }
+        }
+        _reaped += reaped;
+        return reaped;
+    }
+
+    /// Number of orphans reaped so far.
+    size_t
+    Reaped() const
+    { return _reaped; }
+
+    /// Held by Popen while starting a child, until _Track().
+    std::shared_lock<std::shared_mutex>
+    _Spawning()
+    {
+        if (not _enabled) {
+            return std::shared_lock<std::shared_mutex>(_spawning, std::defer_lock);
+        }
+        return std::shared_lock<std::shared_mutex>(_spawning);
+    }
+
+    void
+    _Track(pid_t pid)
+    {
+        if (_enabled) {
+            const std::lock_guard<std::mutex> lock (_mutex);
+            _known.push_back(pid);
+        }
+    }
+
+private:
+    /// Our children, as listed by each of our threads.
+    static std::vector<pid_t>
+    _Children()
+    {
+        std::vector<pid_t> children;
+        auto tasks = opendir("/proc/self/task");
+        if (tasks == nullptr) {
+            return children;
+        }
+        while (auto task = readdir(tasks)) {
+            if (task->d_name[0] == '.') {
+                continue;
+            }
+            auto path = std::string("/proc/self/task/") + task->d_name + "/children";
+            if (auto f = fopen(path.c_str(), "r")) {
+                long pid;
+                while (fscanf(f, "%ld", &pid) == 1) {
+                    children.push_back(static_cast<pid_t>(pid));
+                }
+                fclose(f);
+            }
+        }
+        closedir(tasks);
+        return children;
+    }
+
+    void
+    _Run(duration interval_ms)
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        while (not _stop) {
+            lock.unlock();
+            Reap();
+            lock.lock();
+            _wakeup.wait_for(lock, std::chrono::milliseconds(interval_ms), [this] { return _stop; });
+        }
+    }
+};
+#endif
+#endif
+
+/**
+ * @brief Phases of Popen::Start() and Popen::Communicate() measured when
+ * SUBPROCESS_PROFILE_SPAWN is defined before including this header.
+ */
+enum SpawnPhase
+{
+    pPipes,         ///< argument copy and stream setup
+    pFileActions,   ///< posix_spawn file actions, or STARTUPINFO
+    pAttributes,    ///< posix_spawn attributes
+    pArguments,     ///< argv, or the command line
+    pEnvironment,   ///< envp, or the environment block
+    pSpawn,         ///< posix_spawnp(), fork(), or CreateProcess()
+    pCleanup,       ///< closing the child's ends
+    pSend,          ///< Communicate(): writing the input
+    pReceive,       ///< Communicate(): reading the outputs
+    pWait,          ///< Communicate(): reaping the child
+    pCount
+};
+
+const char*
+SpawnPhaseName(SpawnPhase phase)
+{
+    static const char* names[pCount] = {
+        "pipes", "file_actions", "attributes", "arguments", "environment",
+        "spawn", "cleanup", "send", "receive", "wait"
+    };
+    return phase < pCount ? names[phase] : "";
+}
+
+#ifdef SUBPROCESS_PROFILE_SPAWN
+/// Time spent in each phase by one Popen.
+struct SpawnProfile
+{
+    clock::duration phases[pCount] = {};
+};
+
+/**
+ * @brief Process-wide aggregate of the spawn phases, in relaxed atomic counters.
+ *
+ * Bucket i of a histogram counts the samples below 2^i ns (the last one is unbounded).
+ */
+class SpawnMetrics
+{
+public:
+    static const size_t buckets = 40;
+
+    struct Phase
+    {
+        uint64_t count = 0;
+        uint64_t sum_ns = 0;
+        uint64_t histogram[buckets] = {};
+    };
+
+private:
+    struct _Phase
+    {
+        std::atomic<uint64_t> count {0};
+        std::atomic<uint64_t> sum_ns {0};
+        std::atomic<uint64_t> histogram[buckets] = {};
+    };
+
+    _Phase _phases[pCount];
+
+public:
+    static SpawnMetrics&
+    Global()
+    {
+        static SpawnMetrics metrics;
+        return metrics;
+    }
+
+    void
+    Record(SpawnPhase phase, clock::duration d)
+    {
+        auto ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+        size_t bucket = 0;
+        while (bucket + 1 < buckets and (ns >> bucket) != 0) {
+            ++bucket;
+        }
+        auto& p = _phases[phase];
+        p.count.fetch_add(1, std::memory_order_relaxed);
+        p.sum_ns.fetch_add(ns, std::memory_order_relaxed);
+        p.histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Phase
+    Snapshot(SpawnPhase phase) const
+    {
+        Phase r;
+        const auto& p = _phases[phase];
+        r.count = p.count.load(std::memory_order_relaxed);
+        r.sum_ns = p.sum_ns.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < buckets; ++i) {
+            r.histogram[i] = p.histogram[i].load(std::memory_order_relaxed);
+        }
+        return r;
+    }
+
+    /// Write all phases in the Prometheus text format.
+    void
+    Dump(std::ostream& os) const
+    {
+        for (int i = 0; i < pCount; ++i) {
+            auto phase = static_cast<SpawnPhase>(i);
+            auto p = Snapshot(phase);
+            uint64_t cumulative = 0;
+            for (size_t b = 0; b < buckets; ++b) {
+                cumulative += p.histogram[b];
+                os << "subprocess_spawn_phase_ns_bucket{phase=\"" << SpawnPhaseName(phase) << "\",le=\"";
+                if (b + 1 < buckets) {
+                    os << (uint64_t(1) << b);
+                } else {
+                    os << "+Inf";
+                }
+                os << "\"} " << cumulative << '\n';
+            }
+            os << "subprocess_spawn_phase_ns_sum{phase=\"" << SpawnPhaseName(phase) << "\"} " << p.sum_ns << '\n';
+            os << "subprocess_spawn_phase_ns_count{phase=\"" << SpawnPhaseName(phase) << "\"} " << p.count << '\n';
+        }
+    }
+
+    void
+    Reset()
+    {
+        for (auto& p : _phases) {
+            p.count = 0;
+            p.sum_ns = 0;
+            for (auto& h : p.histogram) {
+                h = 0;
+            }
+        }
+    }
+};
+
+class _PhaseTimer
+{
+private:
+    SpawnProfile& _profile;
+    clock::time_point _last;
+
+public:
+    explicit _PhaseTimer(SpawnProfile& profile)
+    :   _profile(profile)
+    ,   _last(clock::now())
+    {}
+
+    void
+    Mark(SpawnPhase phase)
+    {
+        auto now = clock::now();
+        _profile.phases[phase] += now - _last;
+        SpawnMetrics::Global().Record(phase, now - _last);
+        _last = now;
+    }
+};
+#else
+struct SpawnProfile
+{};
+
+// compiled out: no clock reads, no stores
+struct _PhaseTimer
+{
+    explicit _PhaseTimer(SpawnProfile&)
+    {}
+
+    void
+    Mark(SpawnPhase)
+    {}
+};
+#endif
+
+class Stream
+{
+protected:
+    inline static FileHandler _devnull;
+
+    /// PIPE and DEVNUL only take kernel resources when Materialize()d by Start().
+    enum {
+        dNone,
+        dPipe,
+        dDevNull
+    } _deferred = dNone;
+
+    static std::mutex&
+    _DevNullMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    /// Opens the shared /dev/null on first use, taking its slot from the admitted ones.
+    static FileHandler&
+    _GetDevNull(size_t& admitted)
+    {
+        // Start() may run on many threads at once
+        const std::lock_guard<std::mutex> lock (_DevNullMutex());
+        if (_devnull.IsValid()) {
+            return _devnull;
+        }
+#ifdef _WIN32
+        SECURITY_ATTRIBUTES sa;
+        sa.nLength = sizeof sa;
+        sa.lpSecurityDescriptor = NULL;
+        sa.bInheritHandle = TRUE;
+        _devnull.Id(CreateFileA("nul", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+            &sa, OPEN_EXISTING, 0, NULL));
+        _devnull.IsValid() or _throw(OSError("CreateFileA"));
+#else
+        _devnull.Id(open("/dev/null", O_RDWR | O_CLOEXEC));
+        _devnull.IsValid() or _throw(OSError("open(2)"));
+#endif
+        _devnull.IsSelfClosing(true);
+        // held for the life of the program
+        --admitted;
+        return _devnull;
+    }
+
+public:
+    /// Descriptors Materialize() will create, to be admitted by the FdBudget all at once.
+    size_t
+    Demand() const
+    {
+        if (_deferred == dPipe) {
+            return 2;
+        } else if (_deferred == dDevNull) {
+            const std::lock_guard<std::mutex> lock (_DevNullMutex());
+            return _devnull.IsValid() ? 0 : 1;
+        }
+        return 0;
+    }
+};
+
+class InputStream : Stream
+{
+public:
+    using Stream::Demand;
+
+private:
+    std::unique_ptr<Pipe::Receiver> _receiver;
+    std::unique_ptr<Pipe::Sender> _sender;
+
+public:
+    const std::unique_ptr<Pipe::Receiver>&
+    Receiver() const
+    { return _receiver; }
+
+    const std::unique_ptr<Pipe::Sender>&
+    Sender() const
+    { return _sender; }
+
+    InputStream()
+    {}
+
+    InputStream(InputStream&) = delete;
+
+    InputStream(InputStream&& o)
+    {
+        _receiver = std::move(o._receiver);
+        _sender = std::move(o._sender);
+        _deferred = o._deferred;
+        o._deferred = dNone;
+    }
+    InputStream(file_id id, bool self_closing = false)
+    :   _receiver(new Pipe::Receiver(id, self_closing))
+    {}
+
+    InputStream(FILE* file, bool self_closing = false)
+    :   _receiver(new Pipe::Receiver(file, self_closing))
+    {}
+#ifdef _WIN32
+    InputStream(int fd, bool self_closing = false)
+    :   _receiver(new Pipe::Receiver(fd, self_closing))
+    {}
+#endif
+    InputStream(decltype (nullptr))
+    {}
+
+    /// Takes over the read end of a Pipe::Pipe(), e.g. to chain two children.
+    explicit InputStream(Pipe::Receiver* receiver)
+    :   _receiver(receiver)
+    {}
+
+    InputStream(const _PIPE&)
+    :   _receiver(new Pipe::Receiver)
+    ,   _sender(new Pipe::Sender)
+    {
+        _deferred = dPipe;
+    }
+    InputStream(const _DEVNUL&)
+    :   _receiver(new Pipe::Receiver)
+    {
+        _deferred = dDevNull;
+    }
+
+    /// Creates the deferred descriptors, taking their slots from the admitted ones.
+    void
+    Materialize(size_t& admitted)
+    {
+        if (_deferred == dPipe) {
+            Pipe::Open(*_receiver, *_sender, admitted);
+#ifdef _WIN32
+            // disable inheritance of _sender by child process
+            _sender->MakeInheritable(false);
+#endif
+        } else if (_deferred == dDevNull) {
+            _receiver->Id(_GetDevNull(admitted).Id());
+        }
+        _deferred = dNone;
+    }
+
+    void
+    DestroyReceiver()
+    { _receiver.reset(); }
+
+    void
+    DestroySender()
+    { _sender.reset(); }
+
+    InputStream&
+    operator=(InputStream&) = delete;
+
+    InputStream&
+    operator=(InputStream&& o)
+    {
+        _receiver = std::move(o._receiver);
+        _sender = std::move(o._sender);
+        _deferred = o._deferred;
+        o._deferred = dNone;
+        return *this;
+    }
+};
+
+class OutputStream : Stream
+{
+public:
+    using Stream::Demand;
+
+private:
+    std::unique_ptr<Pipe::Receiver> _receiver;
+    std::unique_ptr<Pipe::Sender> _sender;
+
+public:
+    const std::unique_ptr<Pipe::Receiver>&
+    Receiver() const
+    { return _receiver; }
+
+    const std::unique_ptr<Pipe::Sender>&
+    Sender() const
+    { return _sender; }
+
+    OutputStream()
+    {}
+
+    OutputStream(OutputStream&) = delete;
+
+    OutputStream(OutputStream&& o)
+    {
+        _receiver = std::move(o._receiver);
+        _sender = std::move(o._sender);
+        _deferred = o._deferred;
+        o._deferred = dNone;
+        o._receiver = nullptr;
+        o._sender = nullptr;
+    }
+
+    OutputStream(file_id id, bool self_closing = false)
+    :   _sender(new Pipe::Sender(id, self_closing))
+    {}
+
+    OutputStream(FILE* file, bool self_closing = false)
+    :   _sender(new Pipe::Sender(file, self_closing))
+    {}
+#ifdef _WIN32
+    OutputStream(int fd, bool self_closing = false)
+    :   _sender(new Pipe::Sender(fd, self_closing))
+    {}
+#endif
+    OutputStream(decltype (nullptr))
+    {}
+
+    /// Takes over the write end of a Pipe::Pipe(), e.g. to chain two children.
+    explicit OutputStream(Pipe::Sender* sender)
+    :   _sender(sender)
+    {}
+
+    OutputStream(const _PIPE&)
+    :   _receiver(new Pipe::Receiver)
+    ,   _sender(new Pipe::Sender)
+    {
+        _deferred = dPipe;
+    }
+    OutputStream(const _DEVNUL&)
+    :   _sender(new Pipe::Sender)
+    {
+        _deferred = dDevNull;
+    }
+
+    /// Creates the deferred descriptors, taking their slots from the admitted ones.
+    void
+    Materialize(size_t& admitted)
+    {
+        if (_deferred == dPipe) {
+            Pipe::Open(*_receiver, *_sender, admitted);
+#ifdef _WIN32
+            // disable inheritance of _receiver by child process
+            _receiver->MakeInheritable(false);
+#endif
+        } else if (_deferred == dDevNull) {
+            _sender->Id(_GetDevNull(admitted).Id());
+        }
+        _deferred = dNone;
+    }
+
+    void
+    DestroySender()
+    { _sender.reset(); }
+
+    void
+    DestroyReceiver()
+    { _receiver.reset(); }
+
+    OutputStream&
+    operator=(OutputStream&) = delete;
+
+    OutputStream&
+    operator=(OutputStream&& o)
+    {
+        _receiver = std::move(o._receiver);
+        _sender = std::move(o._sender);
+        _deferred = o._deferred;
+        o._deferred = dNone;
+        return *this;
+    }
+};
+
+class ErrorStream : Stream
+{
+public:
+    using Stream::Demand;
+
+private:
+    std::unique_ptr<Pipe::Receiver> _receiver;
+    std::unique_ptr<Pipe::Sender> _sender;
+    bool _stdout = false;
+
+public:
+    const std::unique_ptr<Pipe::Receiver>&
+    Receiver() const
+    { return _receiver; }
+
+    const std::unique_ptr<Pipe::Sender>&
+    Sender() const
+    { return _sender; }
+
+    bool
+    IsStdOut() const
+    { return _stdout; }
+
+    ErrorStream()
+    {}
+
+    ErrorStream(ErrorStream&) = delete;
+
+    ErrorStream(ErrorStream&& o)
+    {
+        _receiver = std::move(o._receiver);
+        _sender = std::move(o._sender);
+        _deferred = o._deferred;
+        o._deferred = dNone;
+        _stdout = o._stdout;
+        o._stdout = false;
+    }
+
+    ErrorStream(file_id id, bool self_closing = false)
+    :   _sender(new Pipe::Sender(id, self_closing))
+    {}
+
+    ErrorStream(FILE* file, bool self_closing = false)
+    :   _sender(new Pipe::Sender(file, self_closing))
+    {}
+#ifdef _WIN32
+    ErrorStream(int fd, bool self_closing = false)
+    :   _sender(new Pipe::Sender(fd, self_closing))
+    {}
+#endif
+    ErrorStream(decltype (nullptr))
+    {}
+
+    ErrorStream(const _PIPE&)
+    :   _receiver(new Pipe::Receiver)
+    ,   _sender(new Pipe::Sender)
+    {
+        _deferred = dPipe;
+    }
+
+    /// Takes over the write end of a Pipe::Pipe(), e.g. to merge the outputs of children.
+    explicit ErrorStream(Pipe::Sender* sender)
+    :   _sender(sender)
+    {}
+
+    ErrorStream(const _STDOUT&)
+    :   _stdout(true)
+    {}
+
+    ErrorStream(const _DEVNUL&)
+    :   _sender(new Pipe::Sender)
+    {
+        _deferred = dDevNull;
+    }
+
+    /// Creates the deferred descriptors, taking their slots from the admitted ones.
+    void
+    Materialize(size_t& admitted)
+    {
+        if (_deferred == dPipe) {
+            Pipe::Open(*_receiver, *_sender, admitted);
+#ifdef _WIN32
+            // disable inheritance of _receiver by child process
+            _receiver->MakeInheritable(false);
+#endif
+        } else if (_deferred == dDevNull) {
+            _sender->Id(_GetDevNull(admitted).Id());
+        }
+        _deferred = dNone;
+    }
+
+#ifdef _WIN32
+    void
+    OutputStream(const OutputStream& stream)
+    { _sender.reset(new Pipe::Sender(stream.Sender() != nullptr and stream.Sender()->IsValid() ? stream.Sender()->Id() : GetStdHandle(STD_OUTPUT_HANDLE))); }
+#else
+    void
+    OutputStream(const OutputStream& stream)
+    { _sender.reset(new Pipe::Sender(stream.Sender() != nullptr and stream.Sender()->IsValid() ? stream.Sender()->Id() : STDOUT_FILENO)); }
+#endif
+
+    void
+    DestroySender()
+    { _sender.reset(); }
+
+    void
+    DestroyReceiver()
+    { _receiver.reset(); }
+
+    ErrorStream&
+    operator=(ErrorStream&) = delete;
+
+    ErrorStream&
+    operator=(ErrorStream&& o)
+    {
+        _receiver = std::move(o._receiver);
+        _sender = std::move(o._sender);
+        _deferred = o._deferred;
+        o._deferred = dNone;
+        _stdout = o._stdout;
+        return *this;
+    }
+};
+
+/**
+ * @brief Immutable environment, stored as one contiguous block plus the
+ * NULL-terminated envp pointing into it, shared by every spawn using it.
+ */
+class EnvBlock
+{
+private:
+    std::unique_ptr<char[]> _data;
+    std::vector<char*> _envp;
+
+    static size_t
+    _KeySize(const std::string& entry)
+    { return std::min(entry.find('='), entry.size()); }
+
+    static bool
+    _HasKey(const char* entry, const std::string& key, size_t size)
+    {
+#ifdef _WIN32
+        return _strnicmp(entry, key.c_str(), size) == 0 and entry[size] == '=';
+#else
+        return strncmp(entry, key.c_str(), size) == 0 and entry[size] == '=';
+#endif
+    }
+
+public:
+    /**
+     * @param envp NULL-terminated "key=value" strings, e.g. environ; may be null.
+     * @param delta "key=value" entries set key, bare "key" entries unset it.
+     */
+    explicit EnvBlock(char* const* envp, const std::vector<std::string>& delta = {})
+    {
+        auto overridden = [&delta](const char* entry) {
+            for (const auto& d : delta) {
+                if (_HasKey(entry, d, _KeySize(d))) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        // Windows wants the block terminated by an empty string
+        size_t size = 2;
+        size_t count = 0;
+        for (auto e = envp; e != nullptr and *e != nullptr; ++e) {
+            if (not overridden(*e)) {
+                size += strlen(*e) + 1;
+                ++count;
+            }
+        }
+        for (const auto& d : delta) {
+            if (_KeySize(d) < d.size()) {
+                size += d.size() + 1;
+                ++count;
+            }
+        }
+        _data.reset(new char[size]);
+        _envp.reserve(count + 1);
+        auto ptr = _data.get();
+        auto add = [this, &ptr](const char* entry, size_t length) {
+            memcpy(ptr, entry, length + 1);
+            _envp.push_back(ptr);
+            ptr += length + 1;
+        };
+        for (auto e = envp; e != nullptr and *e != nullptr; ++e) {
+            if (not overridden(*e)) {
+                add(*e, strlen(*e));
+            }
+        }
+        for (const auto& d : delta) {
+            if (_KeySize(d) < d.size()) {
+                add(d.c_str(), d.size());
+            }
+        }
+        ptr[0] = ptr[1] = '\0';
+        _envp.push_back(nullptr);
+    }
+
+    EnvBlock(EnvBlock&) = delete;
+
+    EnvBlock&
+    operator=(EnvBlock&) = delete;
+
+    /// NULL-terminated array, for posix_spawn() and exec*().
+    char**
+    Envp() const
+    { return const_cast<char**>(_envp.data()); }
+
+    /// Block of null-terminated strings ending with an empty one, for CreateProcess().
+    char*
+    Data() const
+    { return _data.get(); }
+
+    size_t
+    Size() const
+    { return _envp.size() - 1; }
+
+    /// @return The value of key, or nullptr if it is not set.
+    const char*
+    Get(const std::string& key) const
+    {
+        for (size_t i = 0; i + 1 < _envp.size(); ++i) {
+            if (_HasKey(_envp[i], key, key.size())) {
+                return _envp[i] + key.size() + 1;
+            }
+        }
+        return nullptr;
+    }
+};
+
+/**
+ * @brief Environment builder for Popen::Environment(): a base (the
+ * parent's environment, snapshotted once per process, or nothing) plus a
+ * small delta of overrides and unsets.
+ *
+ * The resulting EnvBlock is built once and cached process-wide, so every
+ * spawn with an identical environment shares the same block.
+ */
+class Environ
+{
+private:
+    std::shared_ptr<const EnvBlock> _base;
+    std::vector<std::string> _delta;
+    mutable std::shared_ptr<const EnvBlock> _block;
+
+    struct _CacheEntry
+    {
+        std::weak_ptr<const EnvBlock> base;
+        std::weak_ptr<const EnvBlock> block;
+    };
+
+    static std::mutex&
+    _Mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::shared_ptr<const EnvBlock>&
+    _Parent()
+    {
+        static std::shared_ptr<const EnvBlock> parent;
+        return parent;
+    }
+
+    static std::shared_ptr<const EnvBlock>
+    _Snapshot()
+    {
+#ifdef _WIN32
+        auto strings = GetEnvironmentStringsA();
+        std::vector<char*> envp;
+        for (auto e = strings; e != nullptr and *e != '\0'; e += strlen(e) + 1) {
+            envp.push_back(e);
+        }
+        envp.push_back(nullptr);
+        auto block = std::make_shared<const EnvBlock>(envp.data());
+        FreeEnvironmentStringsA(strings);
+        return block;
+#else
+        return std::make_shared<const EnvBlock>(environ);
+#endif
+    }
+
+    Environ&
+    _Change(const std::string& key, std::string entry)
+    {
+        _delta.erase(std::remove_if(_delta.begin(), _delta.end(), [&key](const std::string& d) {
+            return d.compare(0, std::min(d.find('='), d.size()), key) == 0;
+        }), _delta.end());
+        // sorted, so that equal deltas hit the same cache entry
+        _delta.insert(std::upper_bound(_delta.begin(), _delta.end(), entry), std::move(entry));
+        _block.reset();
+        return *this;
+    }
+
+    explicit Environ(std::shared_ptr<const EnvBlock> base)
+    :   _base(std::move(base))
+    {}
+
+public:
+    /// Start from the parent's environment.
+    Environ()
+    {
+        const std::lock_guard<std::mutex> lock (_Mutex());
+        if (_Parent() == nullptr) {
+            _Parent() = _Snapshot();
+        }
+        _base = _Parent();
+    }
+
+    /// Start from an empty environment.
+    static Environ
+    Empty()
+    {
+        static auto empty = std::make_shared<const EnvBlock>(nullptr);
+        return Environ(empty);
+    }
+
+    /// Take a new snapshot of the parent's environment, e.g. after setenv().
+    static void
+    Refresh()
+    {
+        auto snapshot = _Snapshot();
+        const std::lock_guard<std::mutex> lock (_Mutex());
+        _Parent() = std::move(snapshot);
+    }
+
+    Environ&
+    Set(const std::string& key, const std::string& value)
+    { return _Change(key, key + "=" + value); }
+
+    Environ&
+    Unset(const std::string& key)
+    { return _Change(key, key); }
+
+    Environ(const Environ& o)
+    :   _base(o._base)
+    ,   _delta(o._delta)
+    ,   _block(std::atomic_load(&o._block))
+    {}
+
+    Environ&
+    operator=(const Environ& o)
+    {
+        _base = o._base;
+        _delta = o._delta;
+        _block = std::atomic_load(&o._block);
+        return *this;
+    }
+
+    /// The final environment, shared with every Environ of the same content.
+    /// Safe to call from several threads sharing one const Environ.
+    std::shared_ptr<const EnvBlock>
+    Block() const
+    {
+        auto block = std::atomic_load(&_block);
+        if (block != nullptr) {
+            return block;
+        }
+        if (_delta.empty()) {
+            std::atomic_store(&_block, _base);
+            return _base;
+        }
+        auto key = std::to_string(reinterpret_cast<uintptr_t>(_base.get()));
+        for (const auto& d : _delta) {
+            key += '\0' + d;
+        }
+        static std::unordered_map<std::string, _CacheEntry> cache;
+        const std::lock_guard<std::mutex> lock (_Mutex());
+        auto& entry = cache[key];
+        if (entry.base.lock() != _base or (block = entry.block.lock()) == nullptr) {
+            block = std::make_shared<const EnvBlock>(_base->Envp(), _delta);
+            entry = {_base, block};
+            if (cache.size() > 64) {
+                // forget the environments nobody uses any more
+                for (auto i = cache.begin(); i != cache.end();) {
+                    i = i->second.block.expired() ? cache.erase(i) : std::next(i);
+                }
+            }
+        }
+        std::atomic_store(&_block, block);
+        return block;
+    }
+};
+
+struct Popen;
+class Popen_impl
+{
+protected:
+    std::vector<std::string> _args;
+    bool _args_is_seq;
+    InputStream  _std_in;
+    OutputStream _std_out;
+    ErrorStream  _std_err;
+#ifndef _WIN32
+    bool _restore_signals;
+    pid_t _process_group = -1;
+    bool _new_session = false;
+    pid_t _pgid = 0;
+    bool _exit_grace = false;
+    duration _exit_grace_ms = 0;
+#endif
+    bool _close_fds;
+    bool _reap_in_background = true;
+    bool _detached = false;
+
+#ifdef _WIN32
+    process_id _ph = nullptr;
+    DWORD _pid = 0;
+#else
+    process_id _pid = 0;
+    std::mutex _waitpid_lock;
+    std::shared_ptr<_Deadline> _deadline;
+    TimerWheel* _wheel = nullptr;
+    TimerWheel::Handle _deadline_timer;
+#endif
+    retcode _returncode;
+    ProcessStats _stats;
+    CaptureLimit _std_out_limit;
+    CaptureLimit _std_err_limit;
+    Digest* _std_out_digest = nullptr;
+    Digest* _std_err_digest = nullptr;
+#ifdef SUBPROCESS_PROFILE_SPAWN
+    SpawnProfile _profile;
+#else
+    inline static SpawnProfile _profile;
+#endif
+    enum {
+        sInitial,
+        sProcessStarted,
+        sEnd
+    } _state = sInitial;
+
+    // hands the first stdin over to the last stage
+    friend class Pipeline;
+
+public:
+    Popen_impl() = default;
+
+    Popen_impl(Popen_impl&) = delete;
+
+    Popen_impl&
+    operator=(Popen_impl&) = delete;
+
+    Popen_impl(Popen_impl&& o)
+    { *this = std::move(o); }
+
+    Popen_impl&
+    operator=(Popen_impl&& o)
+    {
+        if (_state == sInitial and o._state == sInitial) {
+            return *this;
+        }
+        _state = o._state;
+        // avoid closing the handle in the destructor
+        o._state = sInitial;
+        _pid = o._pid;
+#ifdef _WIN32
+        _ph = o._ph;
+#else
+        _deadline = std::move(o._deadline);
+        _pgid = o._pgid;
+        _exit_grace = o._exit_grace;
+        _exit_grace_ms = o._exit_grace_ms;
+        _wheel = o._wheel;
+        _deadline_timer = o._deadline_timer;
+        o._deadline_timer = {};
+#endif
+        _returncode = o._returncode;
+        _stats = o._stats;
+        _std_out_limit = o._std_out_limit;
+        _std_err_limit = o._std_err_limit;
+        _std_out_digest = o._std_out_digest;
+        _std_err_digest = o._std_err_digest;
+#ifdef SUBPROCESS_PROFILE_SPAWN
+        _profile = o._profile;
+#endif
+        _reap_in_background = o._reap_in_background;
+        _detached = o._detached;
+        return *this;
+    }
+
+    ~Popen_impl()
+    {
+#ifdef _WIN32
+        if (_state != sInitial and not _detached) {
+            // Windows has no zombies; waiting is only needed to keep the old behavior.
+            if (_state == sProcessStarted and not _reap_in_background) {
+                WaitForSingleObject(_ph, INFINITE);
+            }
+            if (_state == sProcessStarted) {
+                FdBudget::Default().ChildReaped();
+            }
+            CloseHandle(_ph);
+        }
+#else
+        if (_state != sProcessStarted) {
+            return;
+        }
+        if (_reap_in_background) {
+            if (not _deadline_timer.IsValid() and waitpid(_pid, nullptr, WNOHANG) != 0) {
+                FdBudget::Default().ChildReaped();
+                return;
+            }
+            // Leave the child to the reaper instead of blocking until it exits.
+            Reaper::Default().Adopt(_pid, _wheel, _deadline_timer);
+            return;
+        }
+        // Wait for the process to terminate, to avoid zombies.
+        if (_deadline_timer.IsValid()) {
+            siginfo_t info;
+            waitid(P_PID, _pid, &info, WEXITED | WNOWAIT);
+            _wheel->Cancel(_deadline_timer);
+        }
+        waitpid(_pid, nullptr, 0);
+        FdBudget::Default().ChildReaped();
+#endif
+    }
+
+    void
+    Start(Popen& p) noexcept(false);
+
+#ifdef _WIN32
+    retcode
+    Wait(Popen& p, const _INFINITE_TIME& = INFINITE_TIME) noexcept(false)
+    { return Wait(p, INFINITE); }
+#else
+    retcode
+    Wait(Popen& p, const _INFINITE_TIME& = INFINITE_TIME) noexcept(false)
+    {
+        _TryWait(p);
+        return _returncode;
+    }
+#endif
+
+    retcode
+    Wait(Popen& p, duration timeout_ms) noexcept(false)
+    {
+        _TryWait(p, timeout_ms) == Error::eNone or _Timeout(timeout_ms);
+        return _returncode;
+    }
+
+#ifdef _WIN32
+    Error::Code
+    _TryWait(Popen& p, duration timeout_ms = INFINITE) noexcept(false)
+    {
+        if (_state == sEnd) {
+            return Error::eNone;
+        }
+        Start(p);
+        auto ret = WaitForSingleObject(_ph, timeout_ms);
+        if (ret == WAIT_TIMEOUT) {
+            return _TimedOut(timeout_ms);
+        }
+        ret == WAIT_OBJECT_0 or _throw(OSError("WaitForSingleObject"));
+        _state = sEnd;
+        GetExitCodeProcess(_ph, &_returncode);
+        _HandleExitStats();
+        return Error::eNone;
+    }
+#else
+    Error::Code
+    _TryWait(Popen& p) noexcept(false)
+    {
+        if (_state == sEnd) {
+            return Error::eNone;
+        }
+        Start(p);
+        while (_state != sEnd) {
+            // make sure the mutex is unlocked when going out of scope
+            const std::lock_guard<std::mutex> lock (_waitpid_lock);
+            if (_state == sEnd) {
+                // Another thread waited.
+                break;
+            }
+            int status;
+            auto ret = _Wait(status, 0);
+            // Check the pid and loop as waitpid has been known to
+            // return 0 even without WNOHANG in odd situations.
+            if (ret == _pid) {
+                _HandleExitStatus(status);
+                _state = sEnd;
+            }
+        }
+        return Error::eNone;
+    }
+
+    Error::Code
+    _TryWait(Popen& p, duration timeout_ms) noexcept(false)
+    {
+        if (_state == sEnd) {
+            return Error::eNone;
+        }
+        Start(p);
+        auto end_time = clock::now() + std::chrono::milliseconds(timeout_ms);
+        auto delay = std::chrono::microseconds(500);
+        auto bound = std::chrono::microseconds(50000);
+        // make sure the mutex is unlocked when going out of scope
+        std::unique_lock<std::mutex> lock (_waitpid_lock, std::defer_lock);
+        while (true) {
+            if (lock.try_lock()) {
+                if (_state == sEnd) {
+                    // Another thread waited.
+                    return Error::eNone;
+                }
+                int status;
+                if (_Wait(status, WNOHANG) == _pid) {
+                    _HandleExitStatus(status);
+                    _state = sEnd;
+                    return Error::eNone;
+                }
+                lock.unlock();
+            }
+            auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(end_time - clock::now());
+            if (remaining.count() <= 0) {
+                return _TimedOut(timeout_ms);
+            }
+            delay = std::min(std::min(2 * delay, remaining), bound);
+            std::this_thread::sleep_for(delay);
+        }
+    }
+#endif
+
+    Return
+    Communicate
+    (                    Popen& p
+    ,              const Bytes& input = {}
+    ,   const _INFINITE_TIME& = INFINITE_TIME
+    ) noexcept(false)
+    {
+        Return ret;
+        if (CommunicateInto(p, ret.output, ret.error, input)) {
+            ret.stats = _stats;
+        }
+        return ret;
+    }
+
+    Return
+    Communicate
+    (         Popen& p
+    ,   const Bytes& input
+    ,       duration timeout_ms
+    ) noexcept(false)
+    {
+        Return ret;
+        if (CommunicateInto(p, ret.output, ret.error, input, timeout_ms)) {
+            ret.stats = _stats;
+        }
+        return ret;
+    }
+
+    /**
+     * @brief Communicate() capturing into caller-provided buffers of any type supported by BufferTraits.
+     * @return false if the process had already been waited for.
+     */
+    template<class O, class E>
+    bool
+    CommunicateInto
+    (                    Popen& p
+    ,                       O& output_
+    ,                       E& error_
+    ,              const Bytes& input = {}
+    ,   const _INFINITE_TIME& = INFINITE_TIME
+    ) noexcept(false)
+    {
+        if (_state == sEnd) {
+            return false;
+        }
+        Start(p);
+        _PhaseTimer timer(_profile);
+        _BoundedBuffer<O> bounded_output (output_, _std_out_limit, _stats.output);
+        Digested<_BoundedBuffer<O>> output (bounded_output, _std_out_digest);
+        _BoundedBuffer<E> bounded_error (error_, _std_err_limit, _stats.error);
+        Digested<_BoundedBuffer<E>> error (bounded_error, _std_err_digest);
+#ifdef _WIN32
+        if ((_std_in.Sender() == nullptr and (_std_out.Receiver() == nullptr or _std_err.Receiver() == nullptr))
+            or (_std_out.Receiver() == nullptr and _std_err.Receiver() == nullptr)) {
+            if (_std_in.Sender() != nullptr) {
+                if (not input.empty()) {
+                    _std_in.Sender()->Send(input);
+                }
+                _std_in.DestroySender();
+                timer.Mark(pSend);
+            } else if (_std_out.Receiver() != nullptr) {
+                _Receive(*_std_out.Receiver(), output, _stats.output, 1);
+                _std_out.DestroyReceiver();
+                timer.Mark(pReceive);
+            } else if (_std_err.Receiver() != nullptr) {
+                _Receive(*_std_err.Receiver(), error, _stats.error, 2);
+                _std_err.DestroyReceiver();
+                timer.Mark(pReceive);
+            }
+            Wait(p);
+            timer.Mark(pWait);
+            return true;
+        } else {
+            // send input data
+            if (_std_in.Sender() != nullptr and not input.empty()) {
+                _std_in.Sender()->Send(input);
+                _std_in.DestroySender();
+            }
+            timer.Mark(pSend);
+            std::future<void> _output_future;
+            std::future<void> _error_future;
+            // start receiver threads
+            if (_std_out.Receiver() != nullptr) {
+                auto& stats = _stats.output;
+                auto receiver = _std_out.Receiver().get();
+                _output_future = std::async(std::launch::async, [this, &output, &stats, receiver] { _Receive(*receiver, output, stats, 1); });
+            }
+            if (_std_err.Receiver() != nullptr) {
+                auto& stats = _stats.error;
+                auto receiver = _std_err.Receiver().get();
+                _error_future = std::async(std::launch::async, [this, &error, &stats, receiver] { _Receive(*receiver, error, stats, 2); });
+            }
+            // wait for threads
+            if (_std_out.Receiver() != nullptr) {
+                _output_future.wait();
+            }
+            if (_std_err.Receiver() != nullptr) {
+                _error_future.wait();
+            }
+            timer.Mark(pReceive);
+            Wait(p);
+            timer.Mark(pWait);
+            return true;
+        }
+#else
+        _Communicate(output, error, input, clock::time_point::max(), timer);
+        Wait(p);
+        timer.Mark(pWait);
+        return true;
+#endif
+    }
+
+    template<class O, class E>
+    bool
+    CommunicateInto
+    (         Popen& p
+    ,            O& output
+    ,            E& error
+    ,   const Bytes& input
+    ,       duration timeout_ms
+    ) noexcept(false)
+    {
+        if (_state == sEnd) {
+            return false;
+        }
+        _TryCommunicateInto(p, output, error, input, timeout_ms) == Error::eNone or _Timeout(timeout_ms);
+        return true;
+    }
+
+    /// CommunicateInto() reporting an expired timeout instead of throwing.
+    template<class O, class E>
+    Error::Code
+    _TryCommunicateInto
+    (         Popen& p
+    ,            O& output_
+    ,            E& error_
+    ,   const Bytes& input
+    ,       duration timeout_ms
+    ) noexcept(false)
+    {
+        Start(p);
+        _PhaseTimer timer(_profile);
+        _BoundedBuffer<O> bounded_output (output_, _std_out_limit, _stats.output);
+        Digested<_BoundedBuffer<O>> output (bounded_output, _std_out_digest);
+        _BoundedBuffer<E> bounded_error (error_, _std_err_limit, _stats.error);
+        Digested<_BoundedBuffer<E>> error (bounded_error, _std_err_digest);
+        auto end_time = clock::now() + std::chrono::milliseconds(timeout_ms);
+#ifdef _WIN32
+        // send input data
+        if (_std_in.Sender() != nullptr and not input.empty()) {
+            _std_in.Sender()->Send(input);
+            _std_in.DestroySender();
+        }
+        timer.Mark(pSend);
+        std::future<void> _output_future;
+        std::future<void> _error_future;
+        // start receiver threads
+        if (_std_out.Receiver() != nullptr) {
+            auto& stats = _stats.output;
+            auto receiver = _std_out.Receiver().get();
+            _output_future = std::async(std::launch::async, [this, &output, &stats, receiver] { _Receive(*receiver, output, stats, 1); });
+        }
+        if (_std_err.Receiver() != nullptr) {
+            auto& stats = _stats.error;
+            auto receiver = _std_err.Receiver().get();
+            _error_future = std::async(std::launch::async, [this, &error, &stats, receiver] { _Receive(*receiver, error, stats, 2); });
+        }
+        // wait for threads
+        if (_std_out.Receiver() != nullptr and _output_future.wait_until(end_time) != std::future_status::ready) {
+            return _TimedOut(timeout_ms);
+        }
+        if (_std_err.Receiver() != nullptr and _error_future.wait_until(end_time) != std::future_status::ready) {
+            return _TimedOut(timeout_ms);
+        }
+        timer.Mark(pReceive);
+#else
+        if (not _Communicate(output, error, input, end_time, timer)) {
+            return _TimedOut(timeout_ms);
+        }
+#endif
+        auto remaining = end_time - clock::now();
+        if (remaining.count() <= 0) {
+            return _TimedOut(timeout_ms);
+        }
+        auto code = _TryWait(p, std::chrono::duration_cast<std::chrono::milliseconds>(remaining).count());
+        timer.Mark(pWait);
+        return code;
+    }
+
+    /**
+     * @brief Communicate() into fixed buffers, without any heap allocation on POSIX.
+     * @return The number of bytes written to output and error.
+     */
+    std::pair<size_t, size_t>
+    Communicate
+    (                    Popen& p
+    ,              FixedBuffer& output
+    ,              FixedBuffer& error
+    ,              const Bytes& input = {}
+    ,   const _INFINITE_TIME& = INFINITE_TIME
+    ) noexcept(false)
+    {
+        CommunicateInto(p, output, error, input);
+        return _CheckOverflow(output, error);
+    }
+
+    std::pair<size_t, size_t>
+    Communicate
+    (         Popen& p
+    ,   FixedBuffer& output
+    ,   FixedBuffer& error
+    ,   const Bytes& input
+    ,       duration timeout_ms
+    ) noexcept(false)
+    {
+        CommunicateInto(p, output, error, input, timeout_ms);
+        return _CheckOverflow(output, error);
+    }
+
+    retcode
+    Poll(Popen& p) noexcept(false)
+    {
+        switch (_TryPoll(p)) {
+            case Error::eStillActive: _throw(ProcessStillActive(_args, 0)); break;
+            case Error::eLockMissed: _throw(WaitLockMissed(_args, 0)); break;
+            default: break;
+        }
+        return _returncode;
+    }
+
+#ifdef _WIN32
+    Error::Code
+    _TryPoll(Popen& p) noexcept(false)
+    {
+        if (_state == sEnd) {
+            return Error::eNone;
+        }
+        Start(p);
+        auto ret = WaitForSingleObject(_ph, 0);
+        if (ret == WAIT_TIMEOUT) {
+            return Error::eStillActive;
+        }
+        ret == WAIT_OBJECT_0 or _throw(OSError("WaitForSingleObject"));
+        _state = sEnd;
+        GetExitCodeProcess(_ph, &_returncode);
+        _HandleExitStats();
+        return Error::eNone;
+    }
+#else
+    Error::Code
+    _TryPoll(Popen& p) noexcept(false)
+    {
+        if (_state == sEnd) {
+            return Error::eNone;
+        }
+        Start(p);
+        // make sure the mutex is unlocked when going out of scope
+        std::unique_lock<std::mutex> lock (_waitpid_lock, std::defer_lock);
+        if (not lock.try_lock()) {
+            return Error::eLockMissed;
+        }
+        if (_state == sEnd) {
+            // Another thread waited.
+            return Error::eNone;
+        }
+        int status;
+        auto ret = _Wait(status, WNOHANG);
+        if (ret == 0) {
+            return Error::eStillActive;
+        } else if (ret == _pid) {
+            _HandleExitStatus(status);
+        } else {
+            _returncode = status;
+        }
+        _state = sEnd;
+        return Error::eNone;
+    }
+#endif
+
+#ifdef _WIN32
+    int
+    SendSignal(int sig)
+    {
+        if (_state != sProcessStarted) {
+            return 0;
+        }
+        if (sig == SIGTERM) {
+            return Terminate();
+        } else if (sig == CTRL_C_EVENT) {
+            return GenerateConsoleCtrlEvent(CTRL_C_EVENT, _pid) != 0;
+        } else if (sig == CTRL_BREAK_EVENT) {
+            return GenerateConsoleCtrlEvent(CTRL_BREAK_EVENT, _pid) != 0;
+        }
+        return 1;
+    }
+#else
+    int
+    SendSignal(int sig)
+    {
+        // nothing to signal before a successful Start(), nor once waited for
+        if (_state != sProcessStarted) {
+            return 0;
+        }
+        ObserverPolicy::OnKill(_pid, sig);
+        return kill(_pid, sig);
+    }
+#endif
+
+#ifdef _WIN32
+    int
+    Terminate()
+    {
+        if (_state != sProcessStarted) {
+            return 0;
+        }
+        ObserverPolicy::OnKill(static_cast<long>(_pid), SIGTERM);
+        int ret = TerminateProcess(_ph, 1);
+        if (ret != 0) {
+            return 0;
+        }
+        _state = sEnd;
+        GetExitCodeProcess(_ph, &_returncode);
+        return _returncode == STILL_ACTIVE;
+    }
+#else
+    int
+    Terminate()
+    {
+        if (_state != sProcessStarted) {
+            return 0;
+        }
+        ObserverPolicy::OnKill(_pid, SIGTERM);
+        return kill(_pid, SIGTERM);
+    }
+#endif
+
+#ifdef _WIN32
+    int
+    Kill()
+    { return Terminate(); }
+#else
+    int
+    Kill()
+    {
+        if (_state != sProcessStarted) {
+            return 0;
+        }
+        ObserverPolicy::OnKill(_pid, SIGKILL);
+        return kill(_pid, SIGKILL);
+    }
+#endif
+
+#ifdef _WIN32
+    int
+    SignalTree(int sig)
+    { return SendSignal(sig); }
+#else
+    int
+    SignalTree(int sig)
+    {
+        if (_pgid <= 0) {
+            return SendSignal(sig);
+        }
+        if (_state == sInitial) {
+            return 0;
+        }
+        // even once the leader is reaped, as its descendants may still be running
+        ObserverPolicy::OnKill(_pid, sig);
+        return kill(-_pgid, sig);
+    }
+
+    pid_t
+    ProcessGroupId() const
+    { return _pgid; }
+#endif
+
+#ifdef _WIN32
+    DWORD
+    Pid() const
+    { return _pid; }
+#else
+    pid_t
+    Pid() const
+    { return _pid; }
+#endif
+    retcode
+    ReturnCode() const
+    { return _returncode; }
+
+    /**
+     * @brief Give up the child: it keeps running and is reaped in the background.
+     *
+     * Afterwards the handle behaves as if the process ended; Wait() and Poll()
+     * return at once and the return code is unknown (-1, or STILL_ACTIVE on Windows).
+     */
+    void
+    Detach()
+    {
+        if (_state == sInitial or _detached) {
+            return;
+        }
+#ifdef _WIN32
+        CloseHandle(_ph);
+        if (_state == sProcessStarted) {
+            FdBudget::Default().ChildReaped();
+            _returncode = STILL_ACTIVE;
+        }
+#else
+        if (_state == sProcessStarted) {
+            Reaper::Default().Adopt(_pid, _wheel, _deadline_timer);
+            _deadline_timer = {};
+            _returncode = -1;
+        }
+#endif
+        _state = sEnd;
+        _detached = true;
+    }
+
+    bool
+    Detached() const
+    { return _detached; }
+
+    bool
+    Started() const
+    { return _state != sInitial; }
+#ifndef _WIN32
+    /**
+     * Give up the running child, e.g. to a ProcessSet, which then has to
+     * reap it. A pending Deadline() is cancelled.
+     */
+    pid_t
+    Release()
+    {
+        _state == sProcessStarted or _throw(Exception("Release() requires a running process"));
+        if (_deadline_timer.IsValid()) {
+            _wheel->Cancel(_deadline_timer);
+        }
+        _returncode = -1;
+        _state = sEnd;
+        _detached = true;
+        return _pid;
+    }
+#endif
+
+    /// Resource usage and timing; complete once the child has been waited for.
+    const ProcessStats&
+    Stats() const
+    { return _stats; }
+#ifdef SUBPROCESS_PROFILE_SPAWN
+    const SpawnProfile&
+    Profile() const
+    { return _profile; }
+#endif
+
+    std::vector<std::string>
+    Arguments() const
+    { return _args; }
+#ifndef _WIN32
+    /// Whether the deadline set with Popen::Deadline() expired.
+    bool
+    Expired() const
+    { return _deadline != nullptr and _deadline->expired; }
+#endif
+
+protected:
+    /**
+     * Capture a stream into buffer until EOF. If the buffer refuses more
+     * data, the child is killed rather than left blocked on a full pipe.
+     */
+    template<class T>
+    void
+    _Receive(const Pipe::Receiver& receiver, T& buffer, StreamStats& stats, int stream)
+    {
+        while (_ReceiveSome(receiver, buffer, stats, stream)) {
+        }
+    }
+
+    /// Read once into buffer; false at EOF or once the child was killed.
+    template<class T>
+    bool
+    _ReceiveSome(const Pipe::Receiver& receiver, T& buffer, StreamStats& stats, int stream)
+    {
+        typedef BufferTraits<T> traits;
+        size_t room = 4096;
+        byte* data = traits::Prepare(buffer, room);
+        auto size = room > 0 ? receiver.ReceiveSome(data, room) : 0;
+        bool more = traits::Commit(buffer, room, size > 0 ? static_cast<size_t>(size) : 0);
+        if (size > 0) {
+            auto now = clock::now();
+            if (stats.bytes == 0) {
+                stats.first_byte = now;
+                ObserverPolicy::OnFirstOutput(static_cast<long>(_pid), stream);
+            }
+            stats.last_byte = now;
+            stats.bytes += static_cast<size_t>(size);
+            if (more) {
+                return true;
+            }
+            Kill();
+        }
+        ObserverPolicy::OnEof(static_cast<long>(_pid), stream, stats.bytes);
+        return false;
+    }
+#ifndef _WIN32
+    /**
+     * Feed input and drain stdout/stderr from the calling thread with
+     * poll(2): no helper threads, so nothing is allocated besides what the
+     * buffers themselves need, and the timeout applies while reading.
+     * @return false if end_time passed first.
+     */
+    template<class O, class E>
+    bool
+    _Communicate(O& output, E& error, const Bytes& input, clock::time_point end_time, _PhaseTimer& timer) noexcept(false)
+    {
+        size_t sent = 0;
+        if (_std_in.Sender() != nullptr and input.empty()) {
+            _std_in.DestroySender();
+        }
+        if (_std_in.Sender() != nullptr) {
+            // the pipe is ours only; never block on a child that stopped reading
+            auto id = _std_in.Sender()->Id();
+            fcntl(id, F_SETFL, fcntl(id, F_GETFL) | O_NONBLOCK);
+        } else {
+            timer.Mark(pSend);
+        }
+        // with an exit grace, the child's exit starts the countdown to giving up on the outputs
+        _ExitWatch watch(_exit_grace ? _pid : 0);
+        auto grace_end = clock::time_point::max();
+        while (_std_in.Sender() != nullptr or _std_out.Receiver() != nullptr or _std_err.Receiver() != nullptr) {
+            struct pollfd fds[4] = {
+                {_std_in .Sender  () != nullptr ? _std_in .Sender  ()->Id() : -1, POLLOUT, 0},
+                {_std_out.Receiver() != nullptr ? _std_out.Receiver()->Id() : -1, POLLIN, 0},
+                {_std_err.Receiver() != nullptr ? _std_err.Receiver()->Id() : -1, POLLIN, 0},
+                {watch.pidfd, POLLIN, 0},
+            };
+            auto now = clock::now();
+            if (now >= grace_end) {
+                break;
+            }
+            int wait = -1;
+            if (end_time != clock::time_point::max()) {
+                auto remaining = std::chrono::ceil<std::chrono::milliseconds>(end_time - now).count();
+                if (remaining <= 0) {
+                    return false;
+                }
+                wait = static_cast<int>(std::min<decltype (remaining)>(remaining, INT_MAX));
+            }
+            if (grace_end != clock::time_point::max() or watch.polling) {
+                auto remaining = watch.polling ? 10 : std::chrono::ceil<std::chrono::milliseconds>(grace_end - now).count();
+                wait = wait < 0 ? static_cast<int>(remaining) : std::min(wait, static_cast<int>(remaining));
+            }
+            if (poll(fds, 4, wait) == -1) {
+                errno == EINTR or _throw(OSError("poll(2)"));
+                continue;
+            }
+            if (watch.Exited(fds[3].revents != 0)) {
+                grace_end = clock::now() + std::chrono::milliseconds(_exit_grace_ms);
+            }
+            if (fds[0].revents != 0) {
+                // the child closing its stdin ends the input, like EPIPE
+                bool closed = (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) != 0;
+                if (fds[0].revents & POLLOUT) {
+                    auto size = _std_in.Sender()->Send(input.data() + sent, input.size() - sent);
+                    if (size > 0) {
+                        sent += static_cast<size_t>(size);
+                    } else if (size == -1 and errno != EAGAIN and errno != EINTR) {
+                        closed = true;
+                    }
+                }
+                if (closed or sent == input.size()) {
+                    _std_in.DestroySender();
+                    timer.Mark(pSend);
+                }
+            }
+            if (fds[1].revents != 0 and not _ReceiveSome(*_std_out.Receiver(), output, _stats.output, 1)) {
+                _std_out.DestroyReceiver();
+            }
+            if (fds[2].revents != 0 and not _ReceiveSome(*_std_err.Receiver(), error, _stats.error, 2)) {
+                _std_err.DestroyReceiver();
+            }
+        }
+        // past the grace period, whatever still holds the pipes gets EPIPE
+        _std_in.DestroySender();
+        _std_out.DestroyReceiver();
+        _std_err.DestroyReceiver();
+        timer.Mark(pReceive);
+        return true;
+    }
+
+    /// Notices the exit of a child without reaping it, through a pidfd or by polling.
+    struct _ExitWatch
+    {
+        pid_t pid;
+        int pidfd = -1;
+        bool polling = false;
+
+        explicit _ExitWatch(pid_t pid_)
+        :   pid(pid_)
+        {
+            if (pid > 0) {
+                pidfd = _PidFd(pid);
+                polling = pidfd == -1;
+            }
+        }
+
+        ~_ExitWatch()
+        { _Close(); }
+
+        /// Whether the child just exited, once.
+        bool
+        Exited(bool readable)
+        {
+            if (not readable and polling) {
+                siginfo_t info;
+                info.si_pid = 0;
+                readable = waitid(P_PID, pid, &info, WEXITED | WNOWAIT | WNOHANG) != 0 or info.si_pid != 0;
+            }
+            if (readable and (pidfd != -1 or polling)) {
+                _Close();
+                polling = false;
+                return true;
+            }
+            return false;
+        }
+
+        void
+        _Close()
+        {
+            if (pidfd != -1) {
+                _ClosePidFd(pidfd);
+                pidfd = -1;
+            }
+        }
+    };
+#endif
+
+    std::pair<size_t, size_t>
+    _CheckOverflow(const FixedBuffer& output, const FixedBuffer& error) noexcept(false)
+    {
+        if ((output.overflow == oFail and output.overflowed > 0) or (error.overflow == oFail and error.overflowed > 0)) {
+            _throw(OutputOverflow(_args, _returncode, _ToBytes(output), _ToBytes(error)));
+        }
+        return {output.size, error.size};
+    }
+
+    Error::Code
+    _TimedOut(duration timeout_ms)
+    {
+        ObserverPolicy::OnTimeout(static_cast<long>(_pid), timeout_ms);
+        return Error::eTimeout;
+    }
+
+    bool
+    _Timeout(duration timeout_ms) noexcept(false)
+    { return _throw(TimeoutExpired(_args, timeout_ms)); }
+
+    /// Creates the deferred pipes, all of them admitted by the FdBudget at once.
+    void
+    _Materialize() noexcept(false)
+    {
+        // Admitting stream by stream would let concurrent spawns each hold
+        // a part of what they need while waiting for the rest, forever.
+        size_t admitted = _std_in.Demand() + _std_out.Demand() + _std_err.Demand();
+        FdBudget::Default().Acquire(admitted);
+        try {
+            _std_in.Materialize(admitted);
+            _std_out.Materialize(admitted);
+            _std_err.Materialize(admitted);
+        } catch (...) {
+            // the pipes already created give their slots back when destroyed
+            FdBudget::Default().Release(admitted);
+            throw;
+        }
+        // e.g. /dev/null opened by another thread in the meantime
+        FdBudget::Default().Release(admitted);
+    }
+
+#ifdef _WIN32
+    std::unique_ptr<STARTUPINFO>
+    _GetStartupInfo()
+    {
+        bool v0 = _std_in .Receiver() != nullptr and _std_in .Receiver()->IsValid();
+        bool v1 = _std_out.Sender  () != nullptr and _std_out.Sender  ()->IsValid();
+        bool v2 = _std_err.Sender  () != nullptr and _std_err.Sender  ()->IsValid();
+        auto si = new STARTUPINFO();
+        si->cb = sizeof (STARTUPINFO);
+        if (v0 or v1 or v2) {
+            si->dwFlags = STARTF_USESTDHANDLES;
+            si->hStdInput  = v0 ? _std_in .Receiver()->Id() : GetStdHandle(STD_INPUT_HANDLE);
+            si->hStdOutput = v1 ? _std_out.Sender  ()->Id() : GetStdHandle(STD_OUTPUT_HANDLE);
+            si->hStdError  = v2 ? _std_err.Sender  ()->Id() : GetStdHandle(STD_ERROR_HANDLE);
+            _close_fds = false;
+        }
+        return std::unique_ptr<STARTUPINFO>(si);
+    }
+
+    std::unique_ptr<std::string, void (*)(std::string*)>
+    _GetCommand()
+    {
+        if (not _args_is_seq) {
+            return {&_args.front(), _noopDelete};
+        }
+        auto s = new std::string(shellEscaped(_args.front()));
+        auto i = _args.cbegin() + 1, e = _args.cend();
+        for (; i != e; ++i) {
+            s->append(" " + shellEscaped(*i));
+        }
+        return {s, _delete};
+    }
+
+    std::unique_ptr<char[]>
+    _GetEnvironment(Popen& p) const;
+
+    void
+    _HandleExitStats()
+    {
+        _stats.exited = clock::now();
+        FdBudget::Default().ChildReaped();
+        FILETIME creation, exit, kernel, user;
+        if (GetProcessTimes(_ph, &creation, &exit, &kernel, &user)) {
+            // FILETIME counts 100 ns intervals
+            auto us = [](const FILETIME& t) {
+                return std::chrono::microseconds(((static_cast<uint64_t>(t.dwHighDateTime) << 32) | t.dwLowDateTime) / 10);
+            };
+            _stats.user_time = us(user);
+            _stats.system_time = us(kernel);
+        }
+        ObserverPolicy::OnExit(static_cast<long>(_pid), _returncode, _stats);
+    }
+#else
+    posix_spawn_file_actions_t*
+    _GetFileActions(_PosixSpawnFileActions& file_actions)
+    {
+        bool v0 = _std_in .Sender  () != nullptr and _std_in .Sender  ()->IsValid();
+        bool v1 = _std_out.Receiver() != nullptr and _std_out.Receiver()->IsValid();
+        bool v2 = _std_err.Receiver() != nullptr and _std_err.Receiver()->IsValid();
+        bool v3 = _std_in .Receiver() != nullptr and _std_in .Receiver()->IsValid();
+        bool v4 = _std_out.Sender  () != nullptr and _std_out.Sender  ()->IsValid();
+        bool v5 = _std_err.Sender  () != nullptr and _std_err.Sender  ()->IsValid();
+        if (not (v0 or v1 or v2 or v3 or v4 or v5 or _close_fds)) {
+            return nullptr;
+        }
+        auto actions = file_actions.Init();
+        v0 and posix_spawn_file_actions_addclose(actions, _std_in .Sender  ()->Id());
+        v1 and posix_spawn_file_actions_addclose(actions, _std_out.Receiver()->Id());
+        v2 and posix_spawn_file_actions_addclose(actions, _std_err.Receiver()->Id());
+        v3 and posix_spawn_file_actions_adddup2 (actions, _std_in .Receiver()->Id(), STDIN_FILENO );
+        v4 and posix_spawn_file_actions_adddup2 (actions, _std_out.Sender  ()->Id(), STDOUT_FILENO);
+        v5 and posix_spawn_file_actions_adddup2 (actions, _std_err.Sender  ()->Id(), STDERR_FILENO);
+        // the originals are closed in the child only: flipping FD_CLOEXEC on them here
+        // would race with other threads spawning at the same time
+        int fds[3] = {v3 ? _std_in.Receiver()->Id() : -1, v4 ? _std_out.Sender()->Id() : -1, v5 ? _std_err.Sender()->Id() : -1};
+        for (int i = 0; i < 3; ++i) {
+            if (fds[i] > STDERR_FILENO and std::find(fds, fds + i, fds[i]) == fds + i) {
+                posix_spawn_file_actions_addclose(actions, fds[i]);
+            }
+        }
+        if (_close_fds) {
+            _AddCloseFrom(actions);
+        }
+        return actions;
+    }
+
+    static void
+    _AddCloseFrom(posix_spawn_file_actions_t* actions)
+    {
+#   if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#       if __GLIBC_PREREQ(2, 34)
+        // a single action instead of one per possible descriptor
+        if (posix_spawn_file_actions_addclosefrom_np(actions, STDERR_FILENO + 1) == 0) {
+            return;
+        }
+#       endif
+#   endif
+        int max_fd = sysconf(_SC_OPEN_MAX);
+        max_fd != -1 or _throw(OSError("sysconf(3)"));
+        for (int i = STDERR_FILENO + 1; i < max_fd; ++i) {
+            posix_spawn_file_actions_addclose(actions, i);
+        }
+    }
+
+    posix_spawnattr_t*
+    _GetAttributes(_PosixSpawnattr& attributes)
+    {
+        if (not _restore_signals and _process_group < 0 and not _new_session) {
+            return nullptr;
+        }
+        auto attr = attributes.Init();
+        short flags = 0;
+#   ifdef POSIX_SPAWN_SETSID
+        if (_new_session) {
+            flags |= POSIX_SPAWN_SETSID;
+        }
+#   endif
+        if (_process_group >= 0 and not _new_session) {
+            flags |= POSIX_SPAWN_SETPGROUP;
+            posix_spawnattr_setpgroup(attr, _process_group);
+        }
+        if (not _restore_signals) {
+            posix_spawnattr_setflags(attr, flags);
+            return attr;
+        }
+        posix_spawnattr_setflags(attr, flags | POSIX_SPAWN_SETSIGDEF);
+        sigset_t set;
+        sigemptyset(&set);
+#   ifdef SIGPIPE
+        sigaddset(&set, SIGPIPE);
+#   endif
+#   ifdef SIGXFZ
+        sigaddset(&set, SIGXFZ );
+#   endif
+#   ifdef SIGXFSZ
+        sigaddset(&set, SIGXFSZ);
+#   endif
+        posix_spawnattr_setsigdefault(attr, &set);
+        return attr;
+    }
+
+    char**
+    _GetArguments(_Arena& arena)
+    {
+        // the size check is already done in Start()
+        if (not _args_is_seq) {
+            return shellSplitted(_args.front().c_str(), arena);
+        }
+        auto argv = arena.Allocate<char*>(_args.size() + 1);
+        auto p = argv;
+        for (const auto& arg : _args) {
+            *p = const_cast<char*>(arg.c_str());
+            ++p;
+        }
+        *p = nullptr;
+        return argv;
+    }
+
+    char**
+    _GetEnvironment(Popen& p, _Arena& arena);
+
+    void
+    _Exec(Popen& p);
+
+    pid_t
+    _Wait(int& status, int options) noexcept(false)
+    {
+        if (_deadline_timer.IsValid()) {
+            // Disarm the deadline before reaping, so that its signals can
+            // never reach another process reusing the pid.
+            siginfo_t info;
+            info.si_pid = 0;
+            if (waitid(P_PID, _pid, &info, WEXITED | WNOWAIT | (options & WNOHANG)) == 0 and info.si_pid == 0) {
+                return 0;
+            }
+            _wheel->Cancel(_deadline_timer);
+        }
+        struct rusage usage;
+        auto ret = wait4(_pid, &status, options, &usage);
+        if (ret == _pid) {
+            _HandleUsage(usage);
+            FdBudget::Default().ChildReaped();
+        }
+        if (ret != -1) {
+            return ret;
+        }
+        errno == ECHILD or _throw(OSError("waitpid(3)"));
+        // This happens if SIGCLD is set to be ignored or waiting for child processes
+        // has otherwise been disabled for our process.  This child is dead, we can't
+        // get the status.
+        FdBudget::Default().ChildReaped();
+        status = 0;
+        _stats.exited = clock::now();
+        return _pid;
+    }
+
+    void
+    _HandleUsage(const struct rusage& usage)
+    {
+        _stats.exited = clock::now();
+        _stats.user_time = std::chrono::seconds(usage.ru_utime.tv_sec) + std::chrono::microseconds(usage.ru_utime.tv_usec);
+        _stats.system_time = std::chrono::seconds(usage.ru_stime.tv_sec) + std::chrono::microseconds(usage.ru_stime.tv_usec);
+#   ifdef __APPLE__
+        // bytes on macOS
+        _stats.max_rss_kb = usage.ru_maxrss / 1024;
+#   else
+        _stats.max_rss_kb = usage.ru_maxrss;
+#   endif
+        _stats.minor_faults = usage.ru_minflt;
+        _stats.major_faults = usage.ru_majflt;
+        _stats.voluntary_switches = usage.ru_nvcsw;
+        _stats.involuntary_switches = usage.ru_nivcsw;
+    }
+
+    void
+    _HandleExitStatus(int status)
+    {
+        _returncode = _ReturnCode(status);
+        ObserverPolicy::OnExit(_pid, _returncode, _stats);
+    }
+#endif
+};
+
+/**
+ * \example subprocess.h
+ * \code
+ * sp::Popen{{"cmd.exe /c echo Hello world!"}}.Wait();
+ *
+ * sp::Popen{{"cmd.exe", "/c", "echo", "Hello world!"}, true}.Wait();
+ *
+ * sp::Popen().Command("cmd.exe /c echo Hello world!").Wait();
+ *
+ * sp::Popen().Arguments({"cmd.exe", "/c", "echo", "Hello world!"}).Wait();
+ *
+ * auto p1 = sp::Popen().Command("cmd.exe /c echo Hello world!").Start()();
+ * // ...
+ * p1.Wait();
+ *
+ * FILE* f = fopen("tmp.txt", "r");
+ * sp::Popen().Arguments("a.exe").StdIn(f).Wait();
+ * fclose(f);
+ * // alternatively
+ * sp::Popen().Arguments("a.exe").StdIn({fopen("tmp.txt", "r"), true}).Wait();
+ *
+ * sp::Popen p2;
+ * p2.Command("ping -n 10 127.0.0.1").StdErr(sp::DEVNUL);
+ * try {
+ *     p2.Wait(100);
+ * } catch (const sp::TimeoutExpired&) {
+ *     p2.Terminate();
+ * }
+ * \endcode
+ *
+ * \todo add some of the remaining parameters; see python doc
+ */
+struct Popen
+{
+    std::vector<std::string> args;
+    bool args_is_seq;
+    InputStream  std_in;
+    OutputStream std_out;
+    ErrorStream  std_err;
+    std::string cwd;
+    std::vector<std::string> env;
+#ifdef _WIN32
+    unsigned creation_flags = 0;
+#else
+    bool restore_signals = true;
+    pid_t process_group = -1;
+    bool new_session = false;
+#endif
+    bool close_fds = true;
+    bool reap_in_background = true;
+#ifndef _WIN32
+    duration deadline_ms = 0;
+    ExpiryAction expiry_action;
+    TimerWheel* wheel = nullptr;
+    bool exit_grace = false;
+    duration exit_grace_ms = 0;
+#endif
+    CaptureLimit std_out_limit;
+    CaptureLimit std_err_limit;
+    Digest* std_out_digest = nullptr;
+    Digest* std_err_digest = nullptr;
+    std::shared_ptr<const EnvBlock> env_block;
+
+    std::unique_ptr<Popen_impl> _impl;
+
+    Popen() = default;
+
+    Popen(Popen&) = delete;
+
+    Popen(Popen&& o) = default;
+
+    Popen&
+    operator=(Popen&) = delete;
+
+    Popen&
+    operator=(Popen&& o) = default;
+
+    Popen
+    Self()
+    { return std::move(*this); }
+
+    Popen
+    operator()()
+    { return std::move(*this); }
+
+    Popen&
+    Arguments(const std::string& cmd)
+    {
+        args.clear();
+        args.push_back(cmd);
+        args_is_seq = false;
+        return *this;
+    }
+
+    Popen&
+    Arguments(const std::vector<std::string>& args)
+    {
+        this->args = args;
+        args_is_seq = true;
+        return *this;
+    }
+
+    Popen&
+    Arguments(std::initializer_list<const char*> args)
+    {
+        this->args.clear();
+        this->args.assign(args.begin(), args.end());
+        args_is_seq = true;
+        return *this;
+    }
+
+    Popen&
+    Command(const std::string& cmd)
+    { return Arguments(cmd); }
+
+    Popen&
+    Command(const std::vector<std::string>& args)
+    { return Arguments(args); }
+
+    Popen&
+    Command(std::initializer_list<const char*> args)
+    { return Arguments(args); }
+
+    Popen&
+    StdIn(InputStream&& std_in)
+    {
+        this->std_in = std::move(std_in);
+        return *this;
+    }
+
+    Popen&
+    StdOut(OutputStream&& std_out)
+    {
+        this->std_out = std::move(std_out);
+        return *this;
+    }
+
+    Popen&
+    StdErr(ErrorStream&& std_err)
+    {
+        this->std_err = std::move(std_err);
+        return *this;
+    }
+
+    Popen&
+    Directory(const std::string& cwd)
+    {
+        this->cwd = cwd;
+        return *this;
+    }
+
+    /**
+     * @param env An array of key=values strings.
+     */
+    Popen&
+    Environment(const std::vector<std::string>& env)
+    {
+        this->env = env;
+        env_block.reset();
+        return *this;
+    }
+
+    /**
+     * @brief Use a shared, cached environment, e.g. Environ().Set("LANG", "C").
+     */
+    Popen&
+    Environment(const Environ& env)
+    {
+        this->env.clear();
+        env_block = env.Block();
+        return *this;
+    }
+#ifdef _WIN32
+    Popen&
+    CreationFlags(unsigned flags)
+    {
+        this->creation_flags = flags;
+        return *this;
+    }
+#else
+    Popen&
+    RestoreSignals(bool restore_signals_)
+    {
+        restore_signals = restore_signals_;
+        return *this;
+    }
+
+    /**
+     * @brief Start the child in a process group: a new one it leads (pgid 0), or that of pgid.
+     * KillTree() and TerminateTree() then reach the descendants which stayed in the group.
+     */
+    Popen&
+    ProcessGroup(pid_t pgid = 0)
+    {
+        process_group = pgid;
+        return *this;
+    }
+
+    /// @brief Start the child in a new session, so in a new group too, without a controlling terminal.
+    Popen&
+    NewSession(bool new_session_ = true)
+    {
+        new_session = new_session_;
+        return *this;
+    }
+#endif
+    Popen&
+    CloseFileDescriptors(bool close_fds)
+    {
+        this->close_fds = close_fds;
+        return *this;
+    }
+
+    Popen&
+    InheritHandles(bool inherit)
+    { return CloseFileDescriptors(not inherit); }
+
+    /**
+     * @brief Whether the destructor leaves a still running child to the background Reaper (default)
+     * instead of blocking until it exits.
+     */
+    Popen&
+    ReapInBackground(bool reap_in_background)
+    {
+        this->reap_in_background = reap_in_background;
+        return *this;
+    }
+
+    /**
+     * @brief Bound what Communicate() keeps of stdout: the first limit.head
+     * and the last limit.tail bytes; StreamStats::dropped counts the rest.
+     */
+    Popen&
+    StdOutLimit(CaptureLimit limit)
+    {
+        std_out_limit = limit;
+        return *this;
+    }
+
+    /// @brief Bound what Communicate() keeps of stderr, see StdOutLimit().
+    Popen&
+    StdErrLimit(CaptureLimit limit)
+    {
+        std_err_limit = limit;
+        return *this;
+    }
+
+    /**
+     * @brief Update digest with stdout as Communicate() reads it, all of it
+     * whatever StdOutLimit() keeps; digest must outlive the communication.
+     */
+    Popen&
+    StdOutDigest(Digest& digest)
+    {
+        std_out_digest = &digest;
+        return *this;
+    }
+
+    /// @brief Update digest with stderr as Communicate() reads it, see StdOutDigest().
+    Popen&
+    StdErrDigest(Digest& digest)
+    {
+        std_err_digest = &digest;
+        return *this;
+    }
+#ifndef _WIN32
+    /**
+     * @brief Supervise the child with a deadline on a shared TimerWheel.
+     *
+     * Unlike Wait(timeout_ms), no thread is parked: when the deadline expires,
+     * the wheel applies `action` (SIGTERM, grace period, SIGKILL, notify) and
+     * any blocking Wait() returns as soon as the child dies.
+     * @param timeout_ms Deadline in milliseconds, counted from Start().
+     */
+    Popen&
+    Deadline(duration timeout_ms, ExpiryAction action = {}, TimerWheel& wheel = TimerWheel::Default())
+    {
+        deadline_ms = timeout_ms;
+        expiry_action = std::move(action);
+        this->wheel = &wheel;
+        return *this;
+    }
+
+    /**
+     * @brief Let Communicate() return grace_ms after the child exited, instead of
+     * waiting for the end of its outputs, which background grandchildren may hold open.
+     * What is written past the grace period is lost.
+     */
+    Popen&
+    ExitGrace(duration grace_ms)
+    {
+        exit_grace = true;
+        exit_grace_ms = grace_ms;
+        return *this;
+    }
+#endif
+
+    Popen&
+    Start() noexcept(false)
+    {
+        Impl()->Start(*this);
+        return *this;
+    }
+
+    /**
+     * @brief Wait for child process to terminate. Set and return the returncode.
+     * @return retcode.
+     */
+    retcode
+    Wait(const _INFINITE_TIME& = INFINITE_TIME) noexcept(false)
+    { return Impl()->Wait(*this); }
+
+    /**
+     * @brief Wait for child process to terminate in timeout_ms milliseconds. Set and return the returncode.
+     * @param timeout_ms Timeout in milliseconds.
+     * @return retcode.
+     */
+    retcode
+    Wait(duration timeout_ms) noexcept(false)
+    { return Impl()->Wait(*this, timeout_ms); }
+
+    /**
+     * @brief Send input, capture the outputs and wait for the child.
+     * @tparam T Type of the captured outputs, see BufferTraits; e.g. std::string to avoid a conversion copy.
+     */
+    template<class T = Bytes>
+    BasicReturn<T>
+    Communicate(const Bytes& input = {}, const _INFINITE_TIME& = INFINITE_TIME) noexcept(false)
+    {
+        BasicReturn<T> ret;
+        if (Impl()->CommunicateInto(*this, ret.output, ret.error, input)) {
+            ret.stats = Stats();
+        }
+        return ret;
+    }
+
+    template<class T = Bytes>
+    BasicReturn<T>
+    Communicate(const Bytes& input, duration timeout_ms) noexcept(false)
+    {
+        BasicReturn<T> ret;
+        if (Impl()->CommunicateInto(*this, ret.output, ret.error, input, timeout_ms)) {
+            ret.stats = Stats();
+        }
+        return ret;
+    }
+
+    template<class T = Bytes>
+    BasicReturn<T>
+    Communicate(duration timeout_ms, const Bytes& input = {}) noexcept(false)
+    { return Communicate<T>(input, timeout_ms); }
+
+    template<class T = Bytes>
+    BasicReturn<T>
+    Communicate(const _INFINITE_TIME&, const Bytes& input = {}) noexcept(false)
+    { return Communicate<T>(input); }
+
+    /**
+     * @brief Communicate() appending the outputs straight to the caller's containers,
+     * e.g. std::pmr::string objects bound to the caller's memory resource.
+     * @return false if the process had already been waited for.
+     */
+    template<class O, class E>
+    bool
+    CommunicateInto(O& output, E& error, const Bytes& input = {}, const _INFINITE_TIME& = INFINITE_TIME) noexcept(false)
+    { return Impl()->CommunicateInto(*this, output, error, input); }
+
+    template<class O, class E>
+    bool
+    CommunicateInto(O& output, E& error, const Bytes& input, duration timeout_ms) noexcept(false)
+    { return Impl()->CommunicateInto(*this, output, error, input, timeout_ms); }
+
+    /**
+     * @brief Communicate() into fixed buffers, allocating nothing unless a buffer spills.
+     * @return The number of bytes captured in output and error.
+     * @throw OutputOverflow if a buffer with the oFail policy overflowed.
+     */
+    std::pair<size_t, size_t>
+    Communicate(FixedBuffer& output, FixedBuffer& error, const Bytes& input = {}, const _INFINITE_TIME& = INFINITE_TIME) noexcept(false)
+    { return Impl()->Communicate(*this, output, error, input); }
+
+    std::pair<size_t, size_t>
+    Communicate(FixedBuffer& output, FixedBuffer& error, const Bytes& input, duration timeout_ms) noexcept(false)
+    { return Impl()->Communicate(*this, output, error, input, timeout_ms); }
+
+    retcode
+    Poll() noexcept(false)
+    { return Impl()->Poll(*this); }
+
+    /// Wait() without throwing; the Error is eOSError if the child could not be started.
+    Expected<retcode>
+    TryWait(const _INFINITE_TIME& = INFINITE_TIME) noexcept
+    { return _Try([this] { return Impl()->_TryWait(*this); }); }
+
+    /// Wait() reporting an expired timeout as eTimeout instead of throwing.
+    Expected<retcode>
+    TryWait(duration timeout_ms) noexcept
+    { return _Try([this, timeout_ms] { return Impl()->_TryWait(*this, timeout_ms); }); }
+
+    /// Poll() reporting a running child as eStillActive instead of throwing.
+    Expected<retcode>
+    TryPoll() noexcept
+    { return _Try([this] { return Impl()->_TryPoll(*this); }); }
+
+    int
+    SendSignal(int sig)
+    { return Impl()->SendSignal(sig); }
+
+    int
+    Terminate()
+    { return Impl()->Terminate(); }
+
+    int
+    Kill()
+    { return Impl()->Kill(); }
+
+    /// Signal the child's whole process group, or only the child if it has none of its own.
+    int
+    SignalTree(int sig)
+    { return Impl()->SignalTree(sig); }
+
+    int
+    TerminateTree()
+#ifdef _WIN32
+    { return Terminate(); }
+#else
+    { return SignalTree(SIGTERM); }
+#endif
+
+    int
+    KillTree()
+#ifdef _WIN32
+    { return Kill(); }
+#else
+    { return SignalTree(SIGKILL); }
+
+    /// The group signaled by SignalTree(), 0 if the child has none of its own.
+    pid_t
+    ProcessGroupId() const
+    { return _impl != nullptr ? _impl->ProcessGroupId() : 0; }
+#endif
+
+    void
+    Detach()
+    { Impl()->Detach(); }
+
+    bool
+    Detached() const
+    { return _impl != nullptr and _impl->Detached(); }
+
+    /// Whether Start() spawned the child, e.g. to tell an OutputCache hit from a miss.
+    bool
+    Started() const
+    { return _impl != nullptr and _impl->Started(); }
+#ifndef _WIN32
+    pid_t
+    Release()
+    { return Impl()->Release(); }
+#endif
+
+#ifdef _WIN32
+    DWORD
+#else
+    pid_t
+#endif
+    Pid() const
+    { return _impl->Pid(); }
+
+    retcode
+    ReturnCode() const
+    { return _impl->ReturnCode(); }
+
+    std::vector<std::string>
+    Arguments() const
+    { return _impl->Arguments(); }
+
+    const ProcessStats&
+    Stats() const
+    { return _impl->Stats(); }
+#ifdef SUBPROCESS_PROFILE_SPAWN
+    const SpawnProfile&
+    Profile() const
+    { return _impl->Profile(); }
+#endif
+#ifndef _WIN32
+    bool
+    Expired() const
+    { return _impl->Expired(); }
+#endif
+
+    Popen_impl*
+    Impl()
+    {
+        if (not _impl) {
+            _impl.reset(new Popen_impl);
+        }
+        return _impl.get();
+    }
+
+private:
+    template<class F>
+    Expected<retcode>
+    _Try(F f) noexcept
+    {
+        try {
+            auto code = f();
+            if (code == Error::eNone) {
+                return ReturnCode();
+            }
+            return Error{code, {}};
+        } catch (const std::exception& e) {
+            return Error{Error::eOSError, e.what()};
+        }
+    }
+};
+
+#ifdef _WIN32
+void
+Popen_impl::
+Start(Popen& p) noexcept(false)
+{
+    if (_state != sInitial) {
+        return;
+    }
+    _PhaseTimer timer(_profile);
+    (not p.args.empty() and not p.args.front().empty()) or _throw(std::invalid_argument("Invalid or no arguments provided"));
+    _args = std::move(p.args);
+    _args_is_seq = p.args_is_seq;
+    _close_fds = p.close_fds;
+    _reap_in_background = p.reap_in_background;
+    _std_out_limit = p.std_out_limit;
+    _std_err_limit = p.std_err_limit;
+    _std_out_digest = p.std_out_digest;
+    _std_err_digest = p.std_err_digest;
+    _std_in = std::move(p.std_in);
+    _std_out = std::move(p.std_out);
+    _std_err = std::move(p.std_err);
+    // the pipes exist from here on, admitted by the FdBudget
+    _Materialize();
+    if (_std_err.IsStdOut()) {
+        _std_err.OutputStream(_std_out);
+    }
+    timer.Mark(pPipes);
+    // setup
+    auto si = _GetStartupInfo();
+    auto pi = std::unique_ptr<PROCESS_INFORMATION>(new PROCESS_INFORMATION());
+    timer.Mark(pFileActions);
+    auto cmd = _GetCommand();
+    timer.Mark(pArguments);
+    auto env = _GetEnvironment(p);
+    auto cwd = p.cwd.empty() ? nullptr : p.cwd.c_str();
+    timer.Mark(pEnvironment);
+    // run
+    CreateProcessA(nullptr, cmd->data(), nullptr, nullptr, not _close_fds, p.creation_flags, p.env_block != nullptr ? p.env_block->Data() : env.get(), cwd, si.get(), pi.get())
+    or _throw(OSError("CreateProcessA"));
+    _ph = pi->hProcess;
+    _pid = pi->dwProcessId;
+    _stats.spawned = clock::now();
+    _state = sProcessStarted;
+    timer.Mark(pSpawn);
+    ObserverPolicy::OnSpawn(static_cast<long>(_pid), _args);
+    FdBudget::Default().ChildStarted();
+    // cleanup
+    CloseHandle(pi->hThread);
+    _std_in.DestroyReceiver();
+    _std_out.DestroySender();
+    _std_err.DestroySender();
+    timer.Mark(pCleanup);
+}
+
+std::unique_ptr<char[]>
+Popen_impl::
+_GetEnvironment(Popen& p) const
+{
+    size_t size = 1u;
+    for (const auto& s : p.env) {
+        size += s.size() + 1;
+    }
+    if (size == 1) {
+        return nullptr;
+    }
+    auto env = new char[size];
+    auto ptr = env;
+    for (const auto& s : p.env) {
+        size = s.size() + 1;
+        memcpy(ptr, s.data(), size);
+        ptr += size;
+    }
+    *ptr = '\0';
+    return std::unique_ptr<char[]>(env);
+}
+#else
+void
+Popen_impl::
+Start(Popen& p) noexcept(false)
+{
+    if (_state != sInitial) {
+        return;
+    }
+    _PhaseTimer timer(_profile);
+    (not p.args.empty() and not p.args.front().empty()) or _throw(std::invalid_argument("Invalid or no arguments provided"));
+    _args = std::move(p.args);
+    _args_is_seq = p.args_is_seq;
+    _close_fds = p.close_fds;
+    _reap_in_background = p.reap_in_background;
+    _std_out_limit = p.std_out_limit;
+    _std_err_limit = p.std_err_limit;
+    _std_out_digest = p.std_out_digest;
+    _std_err_digest = p.std_err_digest;
+    _restore_signals = p.restore_signals;
+    _process_group = p.process_group;
+    _new_session = p.new_session;
+    _exit_grace = p.exit_grace;
+    _exit_grace_ms = p.exit_grace_ms;
+    _std_in = std::move(p.std_in);
+    _std_out = std::move(p.std_out);
+    _std_err = std::move(p.std_err);
+    // the pipes exist from here on, admitted by the FdBudget
+    _Materialize();
+    if (_std_err.IsStdOut()) {
+        _std_err.OutputStream(_std_out);
+    }
+    timer.Mark(pPipes);
+#   ifndef _GNU_SOURCE
+    std::shared_lock<std::shared_mutex> lock(_CloseOnExecLock());
+#   endif
+#   ifdef __linux__
+    auto tracking = Subreaper::Default()._Spawning();
+#   endif
+#   ifdef POSIX_SPAWN_SETSID
+    bool spawn = p.cwd.empty();
+#   else
+    // setsid() needs the fork() path
+    bool spawn = p.cwd.empty() and not _new_session;
+#   endif
+    if (spawn) {
+        // setup, with everything transient on the stack
+        _Arena arena;
+        _PosixSpawnFileActions file_actions;
+        _PosixSpawnattr attributes;
+        auto actions = _GetFileActions(file_actions);
+        timer.Mark(pFileActions);
+        auto attrp = _GetAttributes(attributes);
+        timer.Mark(pAttributes);
+        auto argv = _GetArguments(arena);
+        timer.Mark(pArguments);
+        auto env = _GetEnvironment(p, arena);
+        timer.Mark(pEnvironment);
+        // run
+        posix_spawnp(&_pid, argv[0], actions, attrp, argv, env) == 0
+        or _throw(OSError("posix_spawnp(3p)"));
+    } else {
+        _pid = fork();
+        _pid >= 0 or _throw(OSError("fork(2)"));
+        _Exec(p);
+        if (_process_group >= 0 and not _new_session) {
+            // as the child does, so that the group exists whichever runs first
+            setpgid(_pid, _process_group != 0 ? _process_group : _pid);
+        }
+    }
+    _pgid = _new_session or _process_group == 0 ? _pid : std::max<pid_t>(_process_group, 0);
+#   ifdef __linux__
+    Subreaper::Default()._Track(_pid);
+    tracking = {};
+#   endif
+    _stats.spawned = clock::now();
+    _state = sProcessStarted;
+    timer.Mark(pSpawn);
+    ObserverPolicy::OnSpawn(static_cast<long>(_pid), _args);
+    FdBudget::Default().ChildStarted();
+    // cleanup
+    _std_in.DestroyReceiver();
+    _std_out.DestroySender();
+    _std_err.DestroySender();
+    timer.Mark(pCleanup);
+    if (p.deadline_ms > 0) {
+        _wheel = p.wheel != nullptr ? p.wheel : &TimerWheel::Default();
+        _deadline.reset(new _Deadline{_pid, p.expiry_action, p.deadline_ms});
+        _deadline->pgid = _pgid;
+        auto deadline = _deadline;
+        _deadline_timer = _wheel->Schedule(p.deadline_ms, [deadline] { return (*deadline)(); });
+    }
+}
+
+char**
+Popen_impl::
+_GetEnvironment(Popen& p, _Arena& arena)
+{
+    if (p.env_block != nullptr) {
+        return p.env_block->Envp();
+    }
+    if (p.env.empty()) {
+        // inherit, as posix_spawn() would pass an empty environment for nullptr
+        return environ;
+    }
+    auto env = arena.Allocate<char*>(p.env.size() + 1);
+    auto ptr = env;
+    for (const auto& e : p.env) {
+        *ptr = const_cast<char*>(e.c_str());
+        ++ptr;
+    }
+    *ptr = nullptr;
+    return env;
+}
+
+void
+Popen_impl::
+_Exec(Popen& p)
+{
+    if (_pid != 0) {
+        // parents are not allowed here
+        return;
+    }
+    try {
+        bool v0 = _std_in .Sender  () != nullptr and _std_in .Sender  ()->IsValid();
+        bool v1 = _std_out.Receiver() != nullptr and _std_out.Receiver()->IsValid();
+        bool v2 = _std_err.Receiver() != nullptr and _std_err.Receiver()->IsValid();
+        bool v3 = _std_in .Receiver() != nullptr and _std_in .Receiver()->IsValid();
+        bool v4 = _std_out.Sender  () != nullptr and _std_out.Sender  ()->IsValid();
+        bool v5 = _std_err.Sender  () != nullptr and _std_err.Sender  ()->IsValid();
+        if (v0 or v1 or v2 or v3 or v4 or v5) {
+            if (v3 and _std_in .Receiver()->Id() > STDERR_FILENO) {
+                _std_in .Receiver()->CloseOnExec(true);
+            }
+            if (v4 and _std_out.Sender  ()->Id() > STDERR_FILENO) {
+                _std_out.Sender  ()->CloseOnExec(true);
+            }
+            if (v5 and _std_err.Sender  ()->Id() > STDERR_FILENO) {
+                _std_err.Sender  ()->CloseOnExec(true);
+            }
+            v0 and _std_in .Sender  ()->Close();
+            v1 and _std_out.Receiver()->Close();
+            v2 and _std_err.Receiver()->Close();
+            v3 and (dup2(_std_in .Receiver()->Id(), STDIN_FILENO ) != -1 or _throw(OSError("dup2(2)")));
+            v4 and (dup2(_std_out.Sender  ()->Id(), STDOUT_FILENO) != -1 or _throw(OSError("dup2(2)")));
+            v5 and (dup2(_std_err.Sender  ()->Id(), STDERR_FILENO) != -1 or _throw(OSError("dup2(2)")));
+        }
+        if (_close_fds) {
+            int max_fd = sysconf(_SC_OPEN_MAX);
             max_fd != -1 or _throw(OSError("sysconf(3)"));
+            for (int i = STDERR_FILENO + 1; i < max_fd; ++i) {
+                close(i);
+            }
+        }
+        if (_restore_signals) {
+#   ifdef SIGPIPE
+            sigset(SIGPIPE, SIG_DFL);
+#   endif
+#   ifdef SIGXFZ
+            sigset(SIGXFZ , SIG_DFL);
+#   endif
+#   ifdef SIGXFSZ
+            sigset(SIGXFSZ, SIG_DFL);
+#   endif
+        }
+        if (_new_session) {
+            setsid() != -1 or _throw(OSError("setsid(2)"));
+        } else if (_process_group >= 0) {
+            setpgid(0, _process_group) == 0 or _throw(OSError("setpgid(2)"));
+        }
+        if (not p.cwd.empty()) {
+            chdir(p.cwd.c_str()) == 0 or _throw(OSError("chdir(2)"));
+        }
+        // no heap allocation in the forked child
+        _Arena arena;
+        auto argv = _GetArguments(arena);
+        if (p.env.empty() and p.env_block == nullptr) {
+            execvp(argv[0], argv) or _throw(OSError("execvp(2)"));
+        } else {
+            auto env1 = _GetEnvironment(p, arena);
+            execvpe(argv[0], argv, env1) or _throw(OSError("execvpe(2)"));
+        }
+    } catch (...) {
+        // ignored for now
+    }
+    _exit(0x7F);
+}
+#endif
+
+#ifndef _WIN32
+/**
+ * @brief Dense set of children supervised together.
+ *
+ * The data touched by the bulk operations (pids, pidfds, states, return
+ * codes) lives in parallel arrays, a couple of dozen bytes per child, so
+ * watching 100k children walks contiguous memory; the arguments are kept
+ * apart and only read when a child is collected. Children still running
+ * when the set is destroyed are left to the Reaper.
+ */
+class ProcessSet
+{
+public:
+    typedef uint64_t Id;
+
+private:
+    enum State : unsigned char
+    {
+        sRunning,
+        sExited
+    };
+
+    std::vector<pid_t> _pids;
+    std::vector<int> _pidfds;
+    std::vector<State> _states;
+    std::vector<retcode> _returncodes;
+    std::vector<Id> _ids;
+    std::vector<std::vector<std::string>> _args;
+    std::vector<struct pollfd> _pollfds;
+    Id _next = 0;
+    size_t _running = 0;
+    size_t _without_pidfd = 0;
+
+public:
+    ProcessSet() = default;
+
+    ProcessSet(ProcessSet&) = delete;
+
+    ProcessSet&
+    operator=(ProcessSet&) = delete;
+
+    ~ProcessSet()
+    {
+        for (size_t i = 0; i < _pids.size(); ++i) {
+            if (_states[i] == sRunning) {
+                Reaper::Default().Adopt(_pids[i]);
+            }
+            if (_pidfds[i] != -1) {
+                _ClosePidFd(_pidfds[i]);
+            }
+        }
+    }
+
+    void
+    Reserve(size_t size)
+    {
+        _pids.reserve(size);
+        _pidfds.reserve(size);
+        _states.reserve(size);
+        _returncodes.reserve(size);
+        _ids.reserve(size);
+        _args.reserve(size);
+    }
+
+    /**
+     * @brief Start process if needed and take its child over; the Popen
+     * is left detached and, with its pipes, can be dropped.
+     * @return The id passed back by CollectFinished().
+     */
+    Id
+    Add(Popen& process) noexcept(false)
+    {
+        process.Start();
+        _args.push_back(process.Arguments());
+        auto pid = process.Release();
+        auto pidfd = _PidFd(pid);
+        _pids.push_back(pid);
+        _pidfds.push_back(pidfd);
+        _states.push_back(sRunning);
+        _returncodes.push_back(-1);
+        _ids.push_back(_next);
+        ++_running;
+        if (pidfd == -1) {
+            ++_without_pidfd;
+        }
+        return _next++;
+    }
+
+    size_t
+    Size() const
+    { return _pids.size(); }
+
+    size_t
+    Running() const
+    { return _running; }
+
+    /**
+     * @brief Reap the children that exited, waiting up to timeout_ms for at least one.
+     * @return The number of children reaped by this call.
+     */
+    size_t
+    PollAll(duration timeout_ms = 0) noexcept(false)
+    { return _PollAll(clock::now() + std::chrono::milliseconds(timeout_ms)); }
+
+    size_t
+    PollAll(const _INFINITE_TIME&) noexcept(false)
+    { return _PollAll(clock::time_point::max()); }
+
+    /// @return The number of running children sig was sent to.
+    size_t
+    SignalAll(int sig)
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < _pids.size(); ++i) {
+            // unreaped, so the pid cannot have been recycled
+            if (_states[i] == sRunning and kill(_pids[i], sig) == 0) {
+                ++count;
+            }
+        }
+        return count;
+    }
+
+    /**
+     * @brief Remove the reaped children, calling f(id, returncode, args) for each.
+     * @return The number of children removed.
+     */
+    template<class F>
+    size_t
+    CollectFinished(F&& f)
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < _pids.size(); ++i) {
+            if (_states[i] == sExited) {
+                f(_ids[i], _returncodes[i], static_cast<const std::vector<std::string>&>(_args[i]));
+                continue;
+            }
+            if (kept != i) {
+                _pids[kept] = _pids[i];
+                _pidfds[kept] = _pidfds[i];
+                _states[kept] = _states[i];
+                _returncodes[kept] = _returncodes[i];
+                _ids[kept] = _ids[i];
+                _args[kept] = std::move(_args[i]);
+            }
+            ++kept;
+        }
+        auto count = _pids.size() - kept;
+        _pids.resize(kept);
+        _pidfds.resize(kept);
+        _states.resize(kept);
+        _returncodes.resize(kept);
+        _ids.resize(kept);
+        _args.resize(kept);
+        return count;
+    }
+
+    size_t
+    CollectFinished()
+    { return CollectFinished([](Id, retcode, const std::vector<std::string>&) {}); }
+
+private:
+    bool
+    _Reap(size_t i)
+    {
+        int status;
+        auto ret = waitpid(_pids[i], &status, WNOHANG);
+        if (ret == 0) {
+            return false;
+        }
+        // ECHILD means somebody else reaped it, or SIGCHLD is ignored
+        _returncodes[i] = ret == _pids[i] ? _ReturnCode(status) : -1;
+        _states[i] = sExited;
+        if (_pidfds[i] == -1) {
+            --_without_pidfd;
+        } else {
+            _ClosePidFd(_pidfds[i]);
+            _pidfds[i] = -1;
+        }
+        --_running;
+        FdBudget::Default().ChildReaped();
+        return true;
+    }
+
+    size_t
+    _PollAll(clock::time_point end_time) noexcept(false)
+    {
+        auto delay = std::chrono::microseconds(500);
+        auto bound = std::chrono::microseconds(50000);
+        while (true) {
+            auto remaining = std::chrono::ceil<std::chrono::milliseconds>(end_time - clock::now()).count();
+            size_t count = 0;
+            if (_without_pidfd == 0) {
+                // a single poll(2) over every pidfd, readable once its child exited
+                _pollfds.resize(_pids.size());
+                for (size_t i = 0; i < _pids.size(); ++i) {
+                    _pollfds[i] = {_states[i] == sRunning ? _pidfds[i] : -1, POLLIN, 0};
+                }
+                int wait = static_cast<int>(std::max<decltype (remaining)>(0, std::min<decltype (remaining)>(remaining, INT_MAX)));
+                int ready = _running > 0 ? poll(_pollfds.data(), _pollfds.size(), wait) : 0;
+                ready != -1 or errno == EINTR or _throw(OSError("poll(2)"));
+                for (size_t i = 0; i < _pids.size() and ready > 0; ++i) {
+                    if (_pollfds[i].revents != 0) {
+                        --ready;
+                        count += _Reap(i);
+                    }
+                }
+            } else {
+                for (size_t i = 0; i < _pids.size(); ++i) {
+                    if (_states[i] == sRunning) {
+                        count += _Reap(i);
+                    }
+                }
+            }
+            if (count > 0 or _running == 0 or remaining <= 0) {
+                return count;
+            }
+            if (_without_pidfd != 0) {
+                delay = std::min(std::min(2 * delay, std::chrono::duration_cast<std::chrono::microseconds>(end_time - clock::now())), bound);
+                std::this_thread::sleep_for(delay);
+            }
+        }
+    }
+};
+#endif
+
+template<class T>
+void
+_poll(Popen& process, BasicReturn<T>& ret) noexcept(false)
+{
+    while (true) {
+        auto code = process.TryPoll();
+        if (code and *code == 0) {
+            return;
+        }
+        if (code or code.Error().code != Error::eLockMissed) {
+            _throw(CalledProcessError(process.Arguments(), process.ReturnCode(), _ToBytes(std::move(ret.output)), _ToBytes(std::move(ret.error))));
+        }
+        std::this_thread::sleep_for(std::chrono::nanoseconds(50));
+    }
+}
+
+template<class T>
+T
+_check_output(Popen& process, duration timeout_ms, const Bytes& input = {}) noexcept(false)
+{
+    BasicReturn<T> ret;
+    try {
+        process.CommunicateInto(ret.output, ret.error, input, timeout_ms);
+    } catch (TimeoutExpired& e) {
+        process.KillTree();
+#ifdef _WIN32
+        // Windows accumulates the output in a single blocking
+        // Receive() call run on child threads, with the timeout
+        // being done in a wait_until() on those threads.
+        // Communicate() _after_ Kill() is required to collect
+        // that and add it to the exception.
+        ret = process.Communicate<T>();
+#else
+        // POSIX _Communicate() captured the output so far into ret
+        process.Wait();
+#endif
+        e.output = _ToBytes(std::move(ret.output));
+        e.error = _ToBytes(std::move(ret.error));
+        throw;
+    } catch (...) {
+        process.Kill();
+        throw;
+    }
+    _poll(process, ret);
+    return std::move(ret.output);
+}
+
+template<class T>
+T
+_check_output(Popen& process, const _INFINITE_TIME& = INFINITE_TIME, const Bytes& input = {})
+{
+    BasicReturn<T> ret;
+    try {
+        ret = process.Communicate<T>(input);
+    } catch (...) {
+        process.Kill();
+        throw;
+    }
+    _poll(process, ret);
+    return std::move(ret.output);
+}
+
+template<class T, class... Args>
+T
+_check_output(Popen&& process, Args&&... args) noexcept(false)
+{ return _check_output<T>(process, std::forward<Args>(args)...); }
+
+/**
+ * @brief Run a command and return its output; throw CalledProcessError on a non-zero exit code.
+ * @tparam T Type of the returned output, see BufferTraits; e.g. check_output<std::string>(...).
+ */
+template<class T = Bytes>
+T
+check_output
+(   const std::string& cmd
+,             duration timeout_ms
+,        InputStream&& std_in = {}
+,        ErrorStream&& std_err = {}
+,   const std::string& cwd = {}
+)
+{
+    return _check_output<T>(
+        Popen{
+            .args = {cmd},
+            .std_in = std::move(std_in),
+            .std_out = PIPE,
+            .std_err = std::move(std_err),
+            .cwd = cwd,
+        },
+        timeout_ms
+    );
+}
+
+template<class T = Bytes>
+T
+check_output
+(        const std::string& cmd
+,   const _INFINITE_TIME& = INFINITE_TIME
+,             InputStream&& std_in = {}
+,             ErrorStream&& std_err = {}
+,        const std::string& cwd = {}
+)
+{
+    return _check_output<T>(
+        Popen{
+            .args = {cmd},
+            .args_is_seq = false,
+            .std_in = std::move(std_in),
+            .std_out = PIPE,
+            .std_err = std::move(std_err),
+            .cwd = cwd,
+        }
+    );
+}
+
+template<class T = Bytes>
+T
+check_output
+(   const std::vector<std::string>& args
+,                          duration timeout_ms
+,                     InputStream&& std_in = {}
+,                     ErrorStream&& std_err = {}
+,                const std::string& cwd = {}
+)
+{
+    return _check_output<T>(
+        Popen{
+            .args = args,
+            .args_is_seq = true,
+            .std_in = std::move(std_in),
+            .std_out = PIPE,
+            .std_err = std::move(std_err),
+            .cwd = cwd,
+        },
+        timeout_ms
+    );
+}
+
+template<class T = Bytes>
+T
+check_output
+(   const std::vector<std::string>& args
+,           const _INFINITE_TIME& = INFINITE_TIME
+,                     InputStream&& std_in = {}
+,                     ErrorStream&& std_err = {}
+,                const std::string& cwd = {}
+)
+{
+    return _check_output<T>(
+        Popen{
+            .args = args,
+            .args_is_seq = true,
+            .std_in = std::move(std_in),
+            .std_out = PIPE,
+            .std_err = std::move(std_err),
+            .cwd = cwd,
+        }
+    );
+}
+
+template<class T = Bytes>
+T
+check_output
+(   std::initializer_list<const char*> args
+,                             duration timeout_ms
+,                        InputStream&& std_in = {}
+,                        ErrorStream&& std_err = {}
+,                   const std::string& cwd = {}
+)
+{
+    return _check_output<T>(
+        Popen{
+            .args = std::vector<std::string>(args.begin(), args.end()),
+            .args_is_seq = true,
+            .std_in = std::move(std_in),
+            .std_out = PIPE,
+            .std_err = std::move(std_err),
+            .cwd = cwd,
+        },
+        timeout_ms
+    );
+}
+
+template<class T = Bytes>
+T
+check_output
+(   std::initializer_list<const char*> args
+,              const _INFINITE_TIME& = INFINITE_TIME
+,                        InputStream&& std_in = {}
+,                        ErrorStream&& std_err = {}
+,                   const std::string& cwd = {}
+)
+
+{
+    return _check_output<T>(
+        Popen{
+            .args = std::vector<std::string>(args.begin(), args.end()),
+            .args_is_seq = true,
+            .std_in = std::move(std_in),
+            .std_out = PIPE,
+            .std_err = std::move(std_err),
+            .cwd = cwd,
+        }
+    );
+}
+
+/**
+ * @brief check_output() for a Popen configured by the caller, e.g. with
+ * StdOut(PIPE).StdErr(PIPE).StdErrLimit(...): the error report then carries
+ * the head and tail of stderr. The child runs in process itself, whose
+ * ReturnCode(), Pid() and Stats() stay available.
+ */
+template<class T = Bytes>
+T
+check_output(Popen& process, duration timeout_ms) noexcept(false)
+{ return _check_output<T>(process, timeout_ms); }
+
+template<class T = Bytes>
+T
+check_output(Popen& process, const _INFINITE_TIME& = INFINITE_TIME) noexcept(false)
+{ return _check_output<T>(process); }
+
+template<class... Timeout>
+std::pair<size_t, size_t>
+_check_output(Popen&& process, FixedBuffer& output, FixedBuffer& error, Timeout... timeout_ms) noexcept(false)
+{
+    std::pair<size_t, size_t> ret;
+    try {
+        ret = process.Communicate(output, error, {}, timeout_ms...);
+    } catch (TimeoutExpired&) {
+        process.KillTree();
+        process.Wait();
+        throw;
+    } catch (...) {
+        process.Kill();
+        throw;
+    }
+    process.ReturnCode() == 0
+    or _throw(CalledProcessError(process.Arguments(), process.ReturnCode(), _ToBytes(output), _ToBytes(error)));
+    return ret;
+}
+
+/**
+ * @brief check_output() into fixed buffers, with stderr captured into error.
+ * @return The number of bytes captured in output and error.
+ */
+std::pair<size_t, size_t>
+check_output
+(   const std::vector<std::string>& args
+,                      FixedBuffer& output
+,                      FixedBuffer& error
+,                          duration timeout_ms
+,                     InputStream&& std_in = {}
+,                const std::string& cwd = {}
+)
+{
+    return _check_output(
+        Popen{
+            .args = args,
+            .args_is_seq = true,
+            .std_in = std::move(std_in),
+            .std_out = PIPE,
+            .std_err = PIPE,
+            .cwd = cwd,
+        },
+        output, error, timeout_ms
+    );
+}
+
+std::pair<size_t, size_t>
+check_output
+(   const std::vector<std::string>& args
+,                      FixedBuffer& output
+,                      FixedBuffer& error
+,           const _INFINITE_TIME& = INFINITE_TIME
+,                     InputStream&& std_in = {}
+,                const std::string& cwd = {}
+)
+{
+    return _check_output(
+        Popen{
+            .args = args,
+            .args_is_seq = true,
+            .std_in = std::move(std_in),
+            .std_out = PIPE,
+            .std_err = PIPE,
+            .cwd = cwd,
+        },
+        output, error
+    );
+}
+
+/// Modification time of path in nanoseconds, -1 if it does not exist.
+int64_t
+_MTime(const std::string& path)
+{
+#ifdef _WIN32
+    struct _stat64 s;
+    if (_stat64(path.c_str(), &s) != 0) {
+        return -1;
+    }
+    return static_cast<int64_t>(s.st_mtime) * 1000000000;
+#else
+    struct stat s;
+    if (stat(path.c_str(), &s) != 0) {
+        return -1;
+    }
+#   ifdef __APPLE__
+    return static_cast<int64_t>(s.st_mtimespec.tv_sec) * 1000000000 + s.st_mtimespec.tv_nsec;
+#   else
+    return static_cast<int64_t>(s.st_mtim.tv_sec) * 1000000000 + s.st_mtim.tv_nsec;
+#   endif
+#endif
+}
+
+/// Build a T from data through its BufferTraits.
+template<class T>
+T
+_FromBytes(const byte* data, size_t size)
+{
+    T buffer {};
+    while (size > 0) {
+        size_t room = size;
+        byte* p = BufferTraits<T>::Prepare(buffer, room);
+        if (room == 0) {
+            break;
+        }
+        memcpy(p, data, room);
+        BufferTraits<T>::Commit(buffer, room, room);
+        data += room;
+        size -= room;
+    }
+    return buffer;
+}
+
+/**
+ * @brief Opt-in memo of check_output() results, for commands that are
+ * effectively pure: git rev-parse, uname, version probes.
+ *
+ * Results are keyed by a hash of the arguments, the environment, the
+ * working directory and the input, and a hit spawns nothing. Only
+ * successful runs are kept. What else the output depends on is up to the
+ * caller: a TTL, files whose modification time invalidates the result, or
+ * Clear(). The process' own streams (e.g. a file as stdin) are not part of
+ * the key.
+ *
+ * \code
+ * static subprocess::OutputCache cache;
+ * cache.Ttl(60000).MaxBytes(1 << 20);
+ * subprocess::Popen p;
+ * p.Arguments({"git", "rev-parse", "HEAD"}).StdOut(subprocess::PIPE);
+ * auto head = cache.CheckOutput<std::string>(p, {}, {".git/HEAD"});
+ * \endcode
+ */
+class OutputCache
+{
+public:
+    /// 128-bit hash of what a run depends on.
+    struct Key
+    {
+        uint64_t low;
+        uint64_t high;
+
+        bool
+        operator==(const Key& o) const
+        { return low == o.low and high == o.high; }
+    };
+
+private:
+    typedef std::vector<std::pair<std::string, int64_t>> _Stamps;
+
+    struct _KeyHash
+    {
+        size_t
+        operator()(const Key& key) const
+        { return static_cast<size_t>(key.low); }
+    };
+
+    struct _Entry
+    {
+        Key key;
+        Bytes output;
+        clock::time_point expires;
+        _Stamps depends;
+    };
+
+#ifndef _WIN32
+    /**
+     * Append-only log of entries in a shared mapping, indexed on the fly.
+     * Several processes may share it: appends take an exclusive flock(), and
+     * a full log starts over under a new generation.
+     */
+    class _File
+    {
+    private:
+        static constexpr uint32_t _magic = 0x434F5053;  // "SPOC"
+        static constexpr size_t _header = 32;           // magic, version, used, generation, reserved
+
+        int _fd = -1;
+        byte* _map = nullptr;
+        size_t _size = 0;
+        size_t _scanned = _header;
+        uint64_t _generation = 0;
+        std::unordered_map<Key, size_t, _KeyHash> _offsets;
+
+        template<class V>
+        V
+        _Get(size_t offset) const
+        {
+            V v;
+            memcpy(&v, _map + offset, sizeof v);
+            return v;
+        }
+
+        template<class V>
+        void
+        _Put(size_t offset, V v)
+        { memcpy(_map + offset, &v, sizeof v); }
+
+        /// Index what other processes (or we) appended since the last scan.
+        void
+        _Scan()
+        {
+            auto generation = _Get<uint64_t>(16);
+            if (generation != _generation) {
+                _generation = generation;
+                _offsets.clear();
+                _scanned = _header;
+            }
+            auto used = std::min<size_t>(_Get<uint64_t>(8), _size);
+            while (_scanned + 56 <= used) {
+                auto length = _Get<uint64_t>(_scanned);
+                if (length < 56 or length > used - _scanned) {
+                    break;
+                }
+                _offsets[{_Get<uint64_t>(_scanned + 8), _Get<uint64_t>(_scanned + 16)}] = _scanned;
+                _scanned += length;
+            }
+        }
+
+        struct _Lock
+        {
+            int fd;
+
+            _Lock(int fd_, int operation)
+            :   fd(fd_)
+            {
+                while (flock(fd, operation) != 0 and errno == EINTR) {
+                }
+            }
+
+            ~_Lock()
+            { flock(fd, LOCK_UN); }
+        };
+
+    public:
+        _File(const std::string& path, size_t size)
+        {
+            _fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+            _fd >= 0 or _throw(OSError("open"));
+            try {
+                _Lock lock (_fd, LOCK_EX);
+                struct stat s;
+                fstat(_fd, &s) == 0 or _throw(OSError("fstat"));
+                _size = std::max(static_cast<size_t>(s.st_size), std::max(size, _header));
+                if (static_cast<size_t>(s.st_size) < _size) {
+                    ftruncate(_fd, static_cast<off_t>(_size)) == 0 or _throw(OSError("ftruncate"));
+                }
+                void* map = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+                map != MAP_FAILED or _throw(OSError("mmap"));
+                _map = static_cast<byte*>(map);
+                if (_Get<uint32_t>(0) != _magic or _Get<uint32_t>(4) != 1) {
+                    _Put<uint32_t>(0, _magic);
+                    _Put<uint32_t>(4, 1);
+                    _Put<uint64_t>(8, _header);
+                    _Put<uint64_t>(16, _Get<uint64_t>(16) + 1);
+                }
+            } catch (...) {
+                close(_fd);
+                throw;
+            }
+        }
+
+        ~_File()
+        {
+            if (_map != nullptr) {
+                munmap(_map, _size);
+            }
+            close(_fd);
+        }
+
+        _File(const _File&) = delete;
+
+        _File&
+        operator=(const _File&) = delete;
+
+        /// The stored output for key, with its wall clock expiry (0 for none) and dependencies.
+        bool
+        Find(const Key& key, Bytes& output, int64_t& expires, _Stamps& depends)
+        {
+            _Lock lock (_fd, LOCK_SH);
+            _Scan();
+            auto found = _offsets.find(key);
+            if (found == _offsets.end()) {
+                return false;
+            }
+            auto offset = found->second;
+            auto end = offset + _Get<uint64_t>(offset);
+            expires = _Get<int64_t>(offset + 24);
+            auto count = _Get<uint32_t>(offset + 32);
+            auto size = _Get<uint64_t>(offset + 40);
+            offset += 56;
+            depends.clear();
+            for (uint32_t i = 0; i < count; ++i) {
+                auto length = _Get<uint32_t>(offset);
+                if (offset + 4 + length + 8 > end) {
+                    return false;
+                }
+                depends.emplace_back(std::string(reinterpret_cast<const char*>(_map) + offset + 4, length), _Get<int64_t>(offset + 4 + length));
+                offset += 4 + length + 8;
+            }
+            if (offset + size > end) {
+                return false;
+            }
+            output.assign(_map + offset, size);
+            return true;
+        }
+
+        /// Append an entry, starting the log over if it is full.
+        void
+        Append(const Key& key, const Bytes& output, int64_t expires, const _Stamps& depends)
+        {
+            size_t length = 56 + output.size();
+            for (const auto& d : depends) {
+                length += 4 + d.first.size() + 8;
+            }
+            length = (length + 7) & ~size_t(7);
+            if (length > _size - _header) {
+                return;
+            }
+            _Lock lock (_fd, LOCK_EX);
+            _Scan();
+            auto offset = static_cast<size_t>(_Get<uint64_t>(8));
+            if (offset + length > _size) {
+                _Put<uint64_t>(16, _Get<uint64_t>(16) + 1);
+                _Scan();
+                offset = _header;
+            }
+            _Put<uint64_t>(offset, length);
+            _Put<uint64_t>(offset + 8, key.low);
+            _Put<uint64_t>(offset + 16, key.high);
+            _Put<int64_t>(offset + 24, expires);
+            _Put<uint32_t>(offset + 32, static_cast<uint32_t>(depends.size()));
+            _Put<uint64_t>(offset + 40, output.size());
+            auto p = offset + 56;
+            for (const auto& d : depends) {
+                _Put<uint32_t>(p, static_cast<uint32_t>(d.first.size()));
+                memcpy(_map + p + 4, d.first.data(), d.first.size());
+                _Put<int64_t>(p + 4 + d.first.size(), d.second);
+                p += 4 + d.first.size() + 8;
+            }
+            memcpy(_map + p, output.data(), output.size());
+            _Put<uint64_t>(8, offset + length);
+            _Scan();
+        }
+
+        void
+        Clear()
+        {
+            _Lock lock (_fd, LOCK_EX);
+            _Put<uint64_t>(8, _header);
+            _Put<uint64_t>(16, _Get<uint64_t>(16) + 1);
+            _Scan();
+        }
+    };
+
+    std::unique_ptr<_File> _file;
+#endif
+    mutable std::mutex _mutex;
+    std::list<_Entry> _lru;  // most recently used first
+    std::unordered_map<Key, std::list<_Entry>::iterator, _KeyHash> _index;
+    duration _ttl_ms = 0;
+    size_t _max_bytes = SIZE_MAX;
+    size_t _bytes = 0;
+    size_t _hits = 0;
+    size_t _misses = 0;
+
+    static int64_t
+    _WallNow()
+    { return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count(); }
+
+    static bool
+    _Unchanged(const _Stamps& depends)
+    {
+        for (const auto& d : depends) {
+            if (_MTime(d.first) != d.second) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void
+    _Erase(std::list<_Entry>::iterator entry)
+    {
+        _bytes -= entry->output.size();
+        _index.erase(entry->key);
+        _lru.erase(entry);
+    }
+
+    void
+    _Keep(const Key& key, Bytes output, clock::time_point expires, _Stamps depends)
+    {
+        auto found = _index.find(key);
+        if (found != _index.end()) {
+            _Erase(found->second);
+        }
+        _bytes += output.size();
+        _lru.push_front({key, std::move(output), expires, std::move(depends)});
+        _index[key] = _lru.begin();
+        while (_bytes > _max_bytes) {
+            _Erase(std::prev(_lru.end()));
+        }
+    }
+
+    bool
+    _Lookup(const Key& key, Bytes& output)
+    {
+        const std::lock_guard<std::mutex> lock (_mutex);
+        auto found = _index.find(key);
+        if (found != _index.end()) {
+            auto entry = found->second;
+            if (clock::now() < entry->expires and _Unchanged(entry->depends)) {
+                _lru.splice(_lru.begin(), _lru, entry);
+                output = entry->output;
+                ++_hits;
+                return true;
+            }
+            _Erase(entry);
+        }
+#ifndef _WIN32
+        int64_t expires;
+        _Stamps depends;
+        if (_file != nullptr and _file->Find(key, output, expires, depends)) {
+            auto now = _WallNow();
+            if ((expires == 0 or now < expires) and _Unchanged(depends)) {
+                auto local = expires == 0 ? clock::time_point::max() : clock::now() + std::chrono::nanoseconds(expires - now);
+                _Keep(key, output, local, std::move(depends));
+                ++_hits;
+                return true;
+            }
+        }
+#endif
+        ++_misses;
+        return false;
+    }
+
+    void
+    _Store(const Key& key, Bytes output, _Stamps depends)
+    {
+        const std::lock_guard<std::mutex> lock (_mutex);
+#ifndef _WIN32
+        if (_file != nullptr) {
+            _file->Append(key, output, _ttl_ms == 0 ? 0 : _WallNow() + static_cast<int64_t>(_ttl_ms) * 1000000, depends);
+        }
+#endif
+        auto expires = _ttl_ms == 0 ? clock::time_point::max() : clock::now() + std::chrono::milliseconds(_ttl_ms);
+        _Keep(key, std::move(output), expires, std::move(depends));
+    }
+
+    template<class T, class Run>
+    T
+    _CheckOutput(Popen& process, const Bytes& input, const std::vector<std::string>& depends, Run run)
+    {
+        auto key = KeyOf(process, input);
+        Bytes output;
+        if (_Lookup(key, output)) {
+            return _FromBytes<T>(output.data(), output.size());
+        }
+        // stamped before the run, so that a change during it invalidates the result
+        _Stamps stamps;
+        for (const auto& d : depends) {
+            stamps.emplace_back(d, _MTime(d));
+        }
+        T result = run();
+        _Store(key, _ToBytes(result), std::move(stamps));
+        return result;
+    }
+
+public:
+    /// Keep results for ttl_ms milliseconds; 0 (the default) keeps them until evicted.
+    OutputCache&
+    Ttl(duration ttl_ms)
+    {
+        const std::lock_guard<std::mutex> lock (_mutex);
+        _ttl_ms = ttl_ms;
+        return *this;
+    }
+
+    /// Evict the least recently used results beyond max_bytes of output.
+    OutputCache&
+    MaxBytes(size_t max_bytes)
+    {
+        const std::lock_guard<std::mutex> lock (_mutex);
+        _max_bytes = max_bytes;
+        while (_bytes > _max_bytes) {
+            _Erase(std::prev(_lru.end()));
+        }
+        return *this;
+    }
+#ifndef _WIN32
+    /**
+     * @brief Also keep results in a file of size bytes mapped in memory,
+     * shared with other processes using the same path.
+     *
+     * The file is a log that starts over once full; an existing file
+     * keeps its size if it is larger.
+     */
+    OutputCache&
+    Persist(const std::string& path, size_t size = 4 << 20)
+    {
+        std::unique_ptr<_File> file (new _File(path, size));
+        const std::lock_guard<std::mutex> lock (_mutex);
+        _file = std::move(file);
+        return *this;
+    }
+#endif
+    /**
+     * @brief check_output() for process, unless an equal run is cached.
+     *
+     * On a miss the child runs in process itself, like check_output(Popen&),
+     * whose ReturnCode() and Stats() stay available; on a hit process is left
+     * as configured and never started, see Popen::Started().
+     */
+    template<class T = Bytes>
+    T
+    CheckOutput(Popen& process, const Bytes& input = {}, const std::vector<std::string>& depends = {}) noexcept(false)
+    { return _CheckOutput<T>(process, input, depends, [&] { return _check_output<T>(process, INFINITE_TIME, input); }); }
+
+    template<class T = Bytes>
+    T
+    CheckOutput(Popen& process, duration timeout_ms, const Bytes& input = {}, const std::vector<std::string>& depends = {}) noexcept(false)
+    { return _CheckOutput<T>(process, input, depends, [&] { return _check_output<T>(process, timeout_ms, input); }); }
+
+    /// The key process and input are cached under.
+    static Key
+    KeyOf(const Popen& process, const Bytes& input)
+    {
+        Xxh64 low (0);
+        Xxh64 high (0x9E3779B97F4A7C15ULL);
+        auto add = [&](const void* data, size_t size) {
+            uint64_t length = size;
+            low.Update(reinterpret_cast<const byte*>(&length), sizeof length);
+            high.Update(reinterpret_cast<const byte*>(&length), sizeof length);
+            low.Update(static_cast<const byte*>(data), size);
+            high.Update(static_cast<const byte*>(data), size);
+        };
+        auto add_strings = [&](char* const* strings, size_t count) {
+            add(&count, sizeof count);
+            for (size_t i = 0; i < count; ++i) {
+                add(strings[i], strlen(strings[i]));
+            }
+        };
+        add(&process.args_is_seq, sizeof process.args_is_seq);
+        size_t count = process.args.size();
+        add(&count, sizeof count);
+        for (const auto& a : process.args) {
+            add(a.data(), a.size());
         }
-        auto actions = new posix_spawn_file_actions_t;
-        posix_spawn_file_actions_init(actions);
-        v0 and posix_spawn_file_actions_addclose(actions, _std_in .Sender  ()->Id());
-        v1 and posix_spawn_file_actions_addclose(actions, _std_out.Receiver()->Id());
-        v2 and posix_spawn_file_actions_addclose(actions, _std_err.Receiver()->Id());
-        v3 and posix_spawn_file_actions_adddup2 (actions, _std_in .Receiver()->Id(), STDIN_FILENO );
-        v4 and posix_spawn_file_actions_adddup2 (actions, _std_out.Sender  ()->Id(), STDOUT_FILENO);
-        v5 and posix_spawn_file_actions_adddup2 (actions, _std_err.Sender  ()->Id(), STDERR_FILENO);
-        if (_close_fds) {
-            for (int i = STDERR_FILENO + 1; i < max_fd; ++i) {
-                posix_spawn_file_actions_addclose(actions, i);
+        if (process.env_block != nullptr) {
+            add_strings(process.env_block->Envp(), process.env_block->Size());
+        } else if (not process.env.empty()) {
+            count = process.env.size();
+            add(&count, sizeof count);
+            for (const auto& e : process.env) {
+                add(e.data(), e.size());
+            }
+        } else {
+#ifdef _WIN32
+            auto block = Environ().Block();
+            add_strings(block->Envp(), block->Size());
+#else
+            count = 0;
+            for (auto e = environ; *e != nullptr; ++e) {
+                ++count;
+            }
+            add_strings(environ, count);
+#endif
+        }
+        std::string cwd = process.cwd;
+        if (cwd.empty()) {
+#ifdef _WIN32
+            char buffer[MAX_PATH];
+            auto length = GetCurrentDirectoryA(MAX_PATH, buffer);
+            cwd.assign(buffer, length <= MAX_PATH ? length : 0);
+#else
+            char buffer[PATH_MAX];
+            if (getcwd(buffer, sizeof buffer) != nullptr) {
+                cwd = buffer;
             }
+#endif
         }
-        return {actions, _deletePosixSpawnFileActions};
+        add(cwd.data(), cwd.size());
+        add(input.data(), input.size());
+        return {low.Value(), high.Value()};
     }
 
-    std::unique_ptr<posix_spawnattr_t, decltype (&_deletePosixSpawnattr)>
-    _GetAttributes()
+    /// Drop every result, including the persisted ones.
+    void
+    Clear()
     {
-        if (not _restore_signals) {
-            return {nullptr, nullptr};
+        const std::lock_guard<std::mutex> lock (_mutex);
+        _lru.clear();
+        _index.clear();
+        _bytes = 0;
+#ifndef _WIN32
+        if (_file != nullptr) {
+            _file->Clear();
         }
-        auto attr = new posix_spawnattr_t;
-        posix_spawnattr_init(attr);
-        posix_spawnattr_setflags(attr, POSIX_SPAWN_SETSIGDEF);
-        sigset_t set;
-        sigemptyset(&set);
-#   ifdef SIGPIPE
-        sigaddset(&set, SIGPIPE);
-#   endif
-#   ifdef SIGXFZ
-        sigaddset(&set, SIGXFZ );
-#   endif
-#   ifdef SIGXFSZ
-        sigaddset(&set, SIGXFSZ);
-#   endif
-        posix_spawnattr_setsigdefault(attr, &set);
-        return {attr, _deletePosixSpawnattr};
+#endif
+    }
+
+    /// Calls served from the cache.
+    size_t
+    Hits() const
+    {
+        const std::lock_guard<std::mutex> lock (_mutex);
+        return _hits;
+    }
+
+    /// Calls that ran the command.
+    size_t
+    Misses() const
+    {
+        const std::lock_guard<std::mutex> lock (_mutex);
+        return _misses;
+    }
+
+    /// Bytes of output held in memory.
+    size_t
+    Size() const
+    {
+        const std::lock_guard<std::mutex> lock (_mutex);
+        return _bytes;
+    }
+};
+
+/**
+ * @brief Run process to completion without throwing, even for a non-zero
+ * return code, which is part of the Result. Errors starting the child or
+ * an expired timeout, after which the child is killed, come back as an Error.
+ * @tparam T Type of the captured outputs, see BufferTraits.
+ */
+template<class T = Bytes>
+Expected<BasicResult<T>>
+run(Popen& process, const Bytes& input = {}, const _INFINITE_TIME& = INFINITE_TIME) noexcept
+{
+    BasicResult<T> ret;
+    try {
+        process.CommunicateInto(ret.output, ret.error, input);
+    } catch (const std::exception& e) {
+        process.Kill();
+        return Error{Error::eOSError, e.what()};
+    }
+    ret.returncode = process.ReturnCode();
+    ret.stats = process.Stats();
+    return ret;
+}
+
+template<class T = Bytes>
+Expected<BasicResult<T>>
+run(Popen& process, const Bytes& input, duration timeout_ms) noexcept
+{
+    BasicResult<T> ret;
+    try {
+        if (process.Impl()->_TryCommunicateInto(process, ret.output, ret.error, input, timeout_ms) != Error::eNone) {
+            process.KillTree();
+            process.Wait();
+            return Error{Error::eTimeout, {}};
+        }
+    } catch (const std::exception& e) {
+        process.Kill();
+        return Error{Error::eOSError, e.what()};
+    }
+    ret.returncode = process.ReturnCode();
+    ret.stats = process.Stats();
+    return ret;
+}
+
+template<class T = Bytes>
+Expected<BasicResult<T>>
+run(Popen&& process, const Bytes& input = {}, const _INFINITE_TIME& = INFINITE_TIME) noexcept
+{ return run<T>(process, input); }
+
+template<class T = Bytes>
+Expected<BasicResult<T>>
+run(Popen&& process, const Bytes& input, duration timeout_ms) noexcept
+{ return run<T>(process, input, timeout_ms); }
+
+/**
+ * @brief Coalesce concurrent identical runs: callers asking for a key
+ * already in flight wait for that one child and share its result.
+ *
+ * Coalescing is opt-in per call, by going through Run() or CheckOutput().
+ * The key defaults to OutputCache::KeyOf() (arguments, environment,
+ * working directory and input), see KeyBy(). A caller that joins a flight
+ * leaves its own Popen unstarted, and waits as long as the leader's
+ * timeout allows. Results are not kept once the flight lands; put an
+ * OutputCache in front for that.
+ */
+class SingleFlight
+{
+public:
+    typedef OutputCache::Key Key;
+    typedef std::function<Key(const Popen& process, const Bytes& input)> KeyFunction;
+
+private:
+    struct _KeyHash
+    {
+        size_t
+        operator()(const Key& key) const
+        { return static_cast<size_t>(key.low); }
+    };
+
+    struct _Flight
+    {
+        const std::type_info* type;
+        std::shared_ptr<void> future;
+    };
+
+    mutable std::mutex _mutex;
+    std::unordered_map<Key, _Flight, _KeyHash> _flights;
+    KeyFunction _key = OutputCache::KeyOf;
+    size_t _coalesced = 0;
+
+    template<class T, class Run>
+    std::shared_ptr<const Expected<BasicResult<T>>>
+    _Share(const Key& key, Run run)
+    {
+        typedef std::shared_ptr<const Expected<BasicResult<T>>> Shared;
+        std::unique_lock<std::mutex> lock (_mutex);
+        auto found = _flights.find(key);
+        if (found != _flights.end() and *found->second.type == typeid(T)) {
+            auto future = *std::static_pointer_cast<std::shared_future<Shared>>(found->second.future);
+            ++_coalesced;
+            lock.unlock();
+            return future.get();
+        }
+        // another output type under the same key runs on its own
+        bool leading = found == _flights.end();
+        std::promise<Shared> promise;
+        if (leading) {
+            _flights[key] = {&typeid(T), std::make_shared<std::shared_future<Shared>>(promise.get_future().share())};
+        }
+        lock.unlock();
+        Shared result;
+        try {
+            result = std::make_shared<const Expected<BasicResult<T>>>(run());
+        } catch (...) {
+            if (leading) {
+                _Land(key);
+                promise.set_exception(std::current_exception());
+            }
+            throw;
+        }
+        if (leading) {
+            _Land(key);
+            promise.set_value(result);
+        }
+        return result;
+    }
+
+    Key
+    _KeyOf(const Popen& process, const Bytes& input)
+    {
+        KeyFunction key;
+        {
+            const std::lock_guard<std::mutex> lock (_mutex);
+            key = _key;
+        }
+        return key(process, input);
+    }
+
+    void
+    _Land(const Key& key)
+    {
+        const std::lock_guard<std::mutex> lock (_mutex);
+        _flights.erase(key);
+    }
+
+    template<class T>
+    static std::shared_ptr<const T>
+    _Check(const Popen& process, std::shared_ptr<const Expected<BasicResult<T>>> result, duration timeout_ms = 0)
+    {
+        if (not *result) {
+            if (result->Error().code == Error::eTimeout) {
+                _throw(TimeoutExpired(process.args, static_cast<retcode>(timeout_ms)));
+            }
+            _throw(Exception(result->Error().message));
+        }
+        const auto& ret = result->Value();
+        ret.returncode == 0 or _throw(CalledProcessError(process.args, ret.returncode, _ToBytes(ret.output), _ToBytes(ret.error)));
+        return std::shared_ptr<const T>(result, &ret.output);
+    }
+
+public:
+    /// Key runs with key(process, input) instead of OutputCache::KeyOf().
+    SingleFlight&
+    KeyBy(KeyFunction key)
+    {
+        const std::lock_guard<std::mutex> lock (_mutex);
+        _key = std::move(key);
+        return *this;
+    }
+
+    /// run() for process, or the result of the identical run in flight.
+    template<class T = Bytes>
+    std::shared_ptr<const Expected<BasicResult<T>>>
+    Run(Popen& process, const Bytes& input = {}, const _INFINITE_TIME& = INFINITE_TIME)
+    { return Run<T>(_KeyOf(process, input), process, input); }
+
+    template<class T = Bytes>
+    std::shared_ptr<const Expected<BasicResult<T>>>
+    Run(Popen& process, const Bytes& input, duration timeout_ms)
+    { return Run<T>(_KeyOf(process, input), process, input, timeout_ms); }
+
+    /// Run() under a key chosen by the caller.
+    template<class T = Bytes>
+    std::shared_ptr<const Expected<BasicResult<T>>>
+    Run(const Key& key, Popen& process, const Bytes& input = {}, const _INFINITE_TIME& = INFINITE_TIME)
+    { return _Share<T>(key, [&] { return run<T>(process, input); }); }
+
+    template<class T = Bytes>
+    std::shared_ptr<const Expected<BasicResult<T>>>
+    Run(const Key& key, Popen& process, const Bytes& input, duration timeout_ms)
+    { return _Share<T>(key, [&] { return run<T>(process, input, timeout_ms); }); }
+
+    /**
+     * @brief check_output() sharing the output of the identical run in flight.
+     * @throw CalledProcessError, TimeoutExpired or Exception, in every caller of the flight.
+     */
+    template<class T = Bytes>
+    std::shared_ptr<const T>
+    CheckOutput(Popen& process, const Bytes& input = {}, const _INFINITE_TIME& = INFINITE_TIME) noexcept(false)
+    { return _Check<T>(process, Run<T>(process, input)); }
+
+    template<class T = Bytes>
+    std::shared_ptr<const T>
+    CheckOutput(Popen& process, const Bytes& input, duration timeout_ms) noexcept(false)
+    { return _Check<T>(process, Run<T>(process, input, timeout_ms), timeout_ms); }
+
+    /// Calls that joined a flight instead of spawning.
+    size_t
+    Coalesced() const
+    {
+        const std::lock_guard<std::mutex> lock (_mutex);
+        return _coalesced;
+    }
+};
+
+/// Outcome of Pipeline::Communicate(): the last stage's outputs and every stage's return code.
+template<class T>
+struct BasicPipelineResult : BasicResult<T>
+{
+    std::vector<retcode> returncodes;
+};
+
+typedef BasicPipelineResult<Bytes> PipelineResult;
+
+/// Downstream end of an in-process Pipeline stage.
+class FilterSink
+{
+private:
+    const Pipe::Sender& _sender;
+    bool _closed = false;
+
+public:
+    explicit FilterSink(const Pipe::Sender& sender)
+    :   _sender(sender)
+    {}
+
+    /**
+     * @brief Write everything, straight from the caller's memory, blocking while the next stage is behind.
+     * @return false once the next stage stopped reading.
+     */
+    bool
+    Write(const void* data, size_t size)
+    {
+        auto p = static_cast<const char*>(data);
+        while (size > 0 and not _closed) {
+#ifdef _WIN32
+            DWORD n;
+            if (not WriteFile(_sender.Id(), p, static_cast<DWORD>(std::min<size_t>(size, MAXDWORD)), &n, NULL)) {
+                _closed = true;
+                break;
+            }
+#else
+            ssize_t n = write(_sender.Id(), p, size);
+            if (n < 0) {
+                _closed = errno != EINTR;
+                continue;
+            }
+#endif
+            p += n;
+            size -= static_cast<size_t>(n);
+        }
+        return not _closed;
+    }
+
+    bool
+    Write(const std::string& s)
+    { return Write(s.data(), s.size()); }
+
+    bool
+    Closed() const
+    { return _closed; }
+};
+
+#ifndef _WIN32
+/**
+ * Writes to a closed pipe from the calling worker thread fail with EPIPE
+ * instead of raising SIGPIPE for the whole process; a SIGPIPE left pending
+ * goes away with the thread.
+ */
+void
+_BlockSigpipe()
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+}
+#endif
+
+/**
+ * @brief In-process Pipeline stage, run on a worker thread.
+ *
+ * Called with each chunk read from the previous stage, in a buffer reused from
+ * one call to the next, then once with size 0 at the end of the input. Returning
+ * false ends the stage early, like `head` would.
+ */
+typedef std::function<bool(const byte* data, size_t size, FilterSink& out)> Filter;
+
+/**
+ * @brief Children chained stdout to stdin by kernel pipes, like `zcat | grep | sort`.
+ *
+ * The stages run concurrently and the data goes from one to the next without
+ * passing through this process: Communicate() only feeds the first stdin and
+ * reads the last stdout and stderr. The stdout of every stage but the last and
+ * the stdin of every stage but the first are replaced by the pipes.
+ * A stage between two children can also be a Filter, reading and writing these
+ * pipes from a thread; the pipes being blocking, a slow side holds the other back.
+ * The return code is the one of `set -o pipefail`: that of the last stage
+ * which failed, or 0. A Filter returns 0, 1 if it threw, or SIGPIPE if the next
+ * stage stopped reading. The destructor waits for the Filter stages to end.
+ * On POSIX, if the first stage asks for ProcessGroup(), the other children
+ * join its group, which KillTree() and TerminateTree() then signal at once.
+ * Such a group is in the background of an interactive shell, and a stage
+ * using the terminal stops on SIGTTIN or SIGTTOU; without it, the children
+ * stay in the caller's group and are signaled one by one.
+ * \code
+ * auto r = (sp::Popen().Arguments({"zcat", "log.gz"}) | sp::Popen().Arguments({"grep", "ERROR"})
+ *     | sp::Popen().Arguments({"sort"}).StdOut(sp::PIPE)).Communicate();
+ * \endcode
+ */
+class Pipeline
+{
+private:
+    struct _Stage
+    {
+        Popen process;
+        Filter filter;
+        std::unique_ptr<Pipe::Receiver> input;
+        std::unique_ptr<Pipe::Sender> output;
+        std::future<retcode> worker;
+        retcode returncode = 0;
+
+        bool
+        IsFilter() const
+        { return filter != nullptr; }
+    };
+
+    // a pipe's capacity on Linux
+    static constexpr size_t _chunk_size = 64 * 1024;
+
+    std::vector<_Stage> _stages;
+    std::vector<retcode> _returncodes;
+    bool _started = false;
+
+public:
+    Pipeline() = default;
+
+    template<class... P, class = std::enable_if_t<((std::is_same_v<std::decay_t<P>, Popen> or std::is_convertible_v<P, Filter>) and ...)>>
+    Pipeline(P&&... stages)
+    {
+        _stages.reserve(sizeof... (stages));
+        (Add(std::forward<P>(stages)), ...);
+    }
+
+    Pipeline&
+    Add(Popen& stage)
+    {
+        not _started or _throw(std::invalid_argument("Pipeline already started"));
+        _stages.emplace_back();
+        _stages.back().process = std::move(stage);
+        return *this;
+    }
+
+    Pipeline&
+    Add(Popen&& stage)
+    { return Add(stage); }
+
+    Pipeline&
+    Add(Filter filter)
+    {
+        not _started or _throw(std::invalid_argument("Pipeline already started"));
+        _stages.emplace_back();
+        _stages.back().filter = std::move(filter);
+        return *this;
+    }
+
+    size_t
+    Size() const
+    { return _stages.size(); }
+
+    /// The child of a stage; not meaningful for a Filter stage.
+    Popen&
+    operator[](size_t i)
+    { return _stages[i].process; }
+
+    Pipeline&
+    Start() noexcept(false)
+    {
+        if (_started) {
+            return *this;
+        }
+        not _stages.empty() or _throw(std::invalid_argument("Empty pipeline"));
+        (not _stages.front().IsFilter() and not _stages.back().IsFilter())
+        or _throw(std::invalid_argument("A Filter must be between two processes"));
+        _started = true;
+        // each stage is started before the next pipe exists, so no child holds a foreign end
+        for (size_t i = 0; i + 1 < _stages.size(); ++i) {
+            auto pipe = Pipe::Pipe();
+            auto& next = _stages[i + 1];
+            if (next.IsFilter()) {
+                next.input.reset(pipe.first);
+            } else {
+                next.process.StdIn(InputStream(pipe.first));
+            }
+            auto& stage = _stages[i];
+            if (stage.IsFilter()) {
+                stage.output.reset(pipe.second);
+                stage.worker = std::async(std::launch::async, [&stage] {
+                    auto code = _RunFilter(stage.filter, *stage.input, *stage.output);
+                    // end of the input for the next stage
+                    stage.output.reset();
+                    stage.input.reset();
+                    return code;
+                });
+            } else {
+                stage.process.StdOut(OutputStream(pipe.second));
+                _Start(stage.process);
+            }
+        }
+        _Start(_stages.back().process);
+        return *this;
+    }
+
+    /// Signal every child, through their shared process group if they have one.
+    int
+    SignalTree(int sig)
+    {
+#ifndef _WIN32
+        if (_started and _SharedGroup()) {
+            return _stages.front().process.SignalTree(sig);
+        }
+#endif
+        int ret = 0;
+        for (auto& stage : _stages) {
+            if (not stage.IsFilter()) {
+                ret |= stage.process.SignalTree(sig);
+            }
+        }
+        return ret;
+    }
+
+    int
+    TerminateTree()
+    { return SignalTree(SIGTERM); }
+
+    int
+    KillTree()
+#ifdef _WIN32
+    { return SignalTree(SIGTERM); }
+#else
+    { return SignalTree(SIGKILL); }
+#endif
+
+    /**
+     * @brief Wait for every stage.
+     * @return The pipefail return code; ReturnCodes() has all of them.
+     */
+    retcode
+    Wait(const _INFINITE_TIME& = INFINITE_TIME) noexcept(false)
+    {
+        Start();
+        for (auto& stage : _stages) {
+            if (not stage.IsFilter()) {
+                stage.process.Wait();
+            } else if (stage.worker.valid()) {
+                stage.returncode = stage.worker.get();
+            }
+        }
+        return _Collect();
+    }
+
+    /// @throw TimeoutExpired if the stages did not all exit within timeout_ms.
+    retcode
+    Wait(duration timeout_ms) noexcept(false)
+    {
+        Start();
+        auto end_time = clock::now() + std::chrono::milliseconds(timeout_ms);
+        for (auto& stage : _stages) {
+            if (not stage.IsFilter()) {
+                stage.process.Wait(_Remaining(end_time));
+            } else if (stage.worker.valid()) {
+                stage.worker.wait_until(end_time) == std::future_status::ready
+                or _throw(TimeoutExpired({"<filter>"}, timeout_ms));
+                stage.returncode = stage.worker.get();
+            }
+        }
+        return _Collect();
+    }
+
+    template<class T = Bytes>
+    BasicPipelineResult<T>
+    Communicate(const Bytes& input = {}, const _INFINITE_TIME& = INFINITE_TIME) noexcept(false)
+    {
+        BasicPipelineResult<T> ret;
+        _Last().CommunicateInto(ret.output, ret.error, input);
+        ret.returncode = Wait();
+        _Result(ret);
+        return ret;
+    }
+
+    template<class T = Bytes>
+    BasicPipelineResult<T>
+    Communicate(const Bytes& input, duration timeout_ms) noexcept(false)
+    {
+        BasicPipelineResult<T> ret;
+        auto end_time = clock::now() + std::chrono::milliseconds(timeout_ms);
+        _Last().CommunicateInto(ret.output, ret.error, input, timeout_ms);
+        ret.returncode = Wait(_Remaining(end_time));
+        _Result(ret);
+        return ret;
+    }
+
+    /// Return codes of the stages, in order, once waited for.
+    const std::vector<retcode>&
+    ReturnCodes() const
+    { return _returncodes; }
+
+    retcode
+    ReturnCode() const
+    {
+        // pipefail
+        for (auto i = _returncodes.rbegin(); i != _returncodes.rend(); ++i) {
+            if (*i != 0) {
+                return *i;
+            }
+        }
+        return 0;
+    }
+
+private:
+    /// The last stage, started, with the stdin of the first one, which it feeds.
+    Popen&
+    _Last()
+    {
+        Start();
+        auto& last = _stages.back().process;
+        if (_stages.size() > 1) {
+            last._impl->_std_in = std::move(_stages.front().process._impl->_std_in);
+        }
+        return last;
     }
 
-    std::unique_ptr<char*[], void (*)(char**)>
-    _GetArguments()
+    retcode
+    _Collect()
     {
-        // the size check is already done in Start()
-        if (not _args_is_seq) {
-            return shellSplitted(_args.front().c_str());
-        }
-        auto argv = new char*[_args.size() + 1];
-        auto p = argv;
-        for (const auto& arg : _args) {
-            *p = const_cast<char*>(arg.c_str());
-            ++p;
+        _returncodes.clear();
+        for (const auto& stage : _stages) {
+            _returncodes.push_back(stage.IsFilter() ? stage.returncode : stage.process.ReturnCode());
         }
-        *p = nullptr;
-        return {argv, _deleteOneArray};
+        return ReturnCode();
     }
 
-    std::unique_ptr<char*[]>
-    _GetEnvironment(Popen& p);
-
+    template<class T>
     void
-    _Exec(Popen& p);
+    _Result(BasicPipelineResult<T>& ret)
+    {
+        ret.returncodes = _returncodes;
+        ret.stats = _stages.back().process.Stats();
+    }
 
-    pid_t
-    _Wait(int& status, int options) const noexcept(false)
+    static duration
+    _Remaining(clock::time_point end_time)
     {
-        auto ret = waitpid(_pid, &status, options);
-        if (ret != -1) {
-            return ret;
-        }
-        errno == ECHILD or _throw(OSError("waitpid(3)"));
-        // This happens if SIGCLD is set to be ignored or waiting for child processes
-        // has otherwise been disabled for our process.  This child is dead, we can't
-        // get the status.
-        status = 0;
-        return _pid;
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - clock::now()).count();
+        return left > 0 ? static_cast<duration>(left) : 0;
+    }
+
+#ifndef _WIN32
+    /// Whether the first stage asked for a group of its own, which the others join.
+    bool
+    _SharedGroup() const
+    {
+        auto& leader = _stages.front().process;
+        // a group cannot be joined from another session
+        return leader.process_group >= 0 and not leader.new_session;
     }
+#endif
 
+    /// Start a child, in the group of the first one if it has its own.
     void
-    _HandleExitStatus(int status)
+    _Start(Popen& process)
     {
-        if (WIFSTOPPED(status)) {
-            _returncode = -WSTOPSIG(status);
-        } else if (WIFEXITED(status)) {
-            _returncode = WEXITSTATUS(status);
-        } else {
-            _returncode = WTERMSIG(status);
+#ifndef _WIN32
+        auto& leader = _stages.front().process;
+        if (&process != &leader and _SharedGroup()) {
+            process.ProcessGroup(leader.ProcessGroupId());
         }
+#endif
+        process.Start();
     }
+
+    static retcode
+    _RunFilter(const Filter& filter, const Pipe::Receiver& input, const Pipe::Sender& output)
+    {
+#ifdef _WIN32
+        const retcode broken_pipe = 1;
+#else
+        const retcode broken_pipe = SIGPIPE;
+        _BlockSigpipe();
 #endif
+        FilterSink sink(output);
+        std::unique_ptr<byte[]> chunk(new byte[_chunk_size]);
+        try {
+            for (;;) {
+#ifdef _WIN32
+                DWORD size;
+                if (not ReadFile(input.Id(), chunk.get(), _chunk_size, &size, NULL)) {
+                    size = 0;
+                }
+#else
+                ssize_t size = read(input.Id(), chunk.get(), _chunk_size);
+                if (size < 0 and errno == EINTR) {
+                    continue;
+                }
+#endif
+                if (size <= 0) {
+                    filter(chunk.get(), 0, sink);
+                    break;
+                }
+                if (not filter(chunk.get(), static_cast<size_t>(size), sink)) {
+                    break;
+                }
+                if (sink.Closed()) {
+                    break;
+                }
+            }
+        } catch (...) {
+            return 1;
+        }
+        return sink.Closed() ? broken_pipe : 0;
+    }
 };
 
+Pipeline
+operator|(Popen& a, Popen& b)
+{ return Pipeline(a, b); }
+
+Pipeline
+operator|(Popen&& a, Popen&& b)
+{ return Pipeline(a, b); }
+
+Pipeline
+operator|(Pipeline&& a, Popen& b)
+{ return std::move(a.Add(b)); }
+
+Pipeline
+operator|(Pipeline&& a, Popen&& b)
+{ return std::move(a.Add(b)); }
+
+Pipeline
+operator|(Popen& a, Filter b)
+{ return Pipeline(a, std::move(b)); }
+
+Pipeline
+operator|(Pipeline&& a, Filter b)
+{ return std::move(a.Add(std::move(b))); }
+
+#ifndef _WIN32
 /**
- * \example subprocess.h
- * \code
- * sp::Popen{{"cmd.exe /c echo Hello world!"}}.Wait();
+ * @brief One producer's stdout copied to the stdin of several consumers.
  *
- * sp::Popen{{"cmd.exe", "/c", "echo", "Hello world!"}, true}.Wait();
- *
- * sp::Popen().Command("cmd.exe /c echo Hello world!").Wait();
- *
- * sp::Popen().Arguments({"cmd.exe", "/c", "echo", "Hello world!"}).Wait();
- *
- * auto p1 = sp::Popen().Command("cmd.exe /c echo Hello world!").Start()();
- * // ...
- * p1.Wait();
- *
- * FILE* f = fopen("tmp.txt", "r");
- * sp::Popen().Arguments("a.exe").StdIn(f).Wait();
- * fclose(f);
- * // alternatively
- * sp::Popen().Arguments("a.exe").StdIn({fopen("tmp.txt", "r"), true}).Wait();
- *
- * sp::Popen p2;
- * p2.Command("ping -n 10 127.0.0.1").StdErr(sp::DEVNUL);
- * try {
- *     p2.Wait(100);
- * } catch (const sp::TimeoutExpired&) {
- *     p2.Terminate();
- * }
+ * On Linux, the data is duplicated with tee(2) from pipe to pipe and never
+ * copied through this process; a chunk is only read into memory when a consumer
+ * accepted part of it. The slowest consumer sets the pace, unless its Lag policy
+ * gives up on it after stall_ms without progress: lDrop closes its stdin, lKill
+ * also kills it where a pidfd can target it safely (Linux), and otherwise
+ * falls back to lDrop. A consumer exiting early is just no longer fed.
+ * \code
+ * sp::FanOut dump(sp::Popen().Arguments({"pg_dump", "db"}));
+ * dump.Add(sp::Popen().Arguments({"gzip"}).StdOut({fopen("db.gz", "w"), true}))
+ *     .Add(sp::Popen().Arguments({"sha256sum"}).StdOut(sp::PIPE))
+ *     .Add(sp::Popen().Arguments({"upload"}), sp::FanOut::lDrop, 30000);
+ * auto results = dump.Communicate();
  * \endcode
- *
- * \todo add some of the remaining parameters; see python doc
  */
-struct Popen
+class FanOut
 {
-    std::vector<std::string> args;
-    bool args_is_seq;
-    InputStream  std_in;
-    OutputStream std_out;
-    ErrorStream  std_err;
-    std::string cwd;
-    std::vector<std::string> env;
-#ifdef _WIN32
-    unsigned creation_flags = 0;
-#else
-    bool restore_signals = true;
-#endif
-    bool close_fds = true;
+public:
+    /// What to do with a consumer which stopped reading.
+    enum Lag
+    {
+        lWait,  ///< hold the producer back until it reads again
+        lDrop,  ///< close its stdin, the others go on
+        lKill   ///< close its stdin and kill it
+    };
 
-    std::unique_ptr<Popen_impl> _impl;
+private:
+    struct _Consumer
+    {
+        Popen process;
+        Lag lag;
+        duration stall_ms;
+        std::unique_ptr<Pipe::Sender> input;
+        // written by the pump thread, read by Delivered() and Dropped()
+        std::atomic<uint64_t> delivered {0};
+        std::atomic<bool> dropped {false};
+        size_t done = 0;
+        clock::time_point progress;
+        // for the pump thread to kill it, while another thread may be waiting for it
+        int pidfd = -1;
+    };
 
-    Popen() = default;
+    static constexpr size_t _chunk_size = 64 * 1024;
 
-    Popen(Popen&) = delete;
+    Popen _producer;
+    std::deque<_Consumer> _consumers;
+    std::unique_ptr<Pipe::Receiver> _source;
+    FileHandler _null;
+    std::future<void> _pump;
+    std::vector<retcode> _returncodes;
+    bool _started = false;
 
-    Popen(Popen&& o) = default;
+public:
+    explicit FanOut(Popen& producer)
+    :   _producer(std::move(producer))
+    {}
 
-    Popen&
-    operator=(Popen&) = delete;
+    explicit FanOut(Popen&& producer)
+    :   FanOut(producer)
+    {}
 
-    Popen&
-    operator=(Popen&& o) = default;
+    FanOut(FanOut&) = delete;
 
-    Popen
-    Self()
-    { return std::move(*this); }
+    FanOut&
+    operator=(FanOut&) = delete;
 
-    Popen
-    operator()()
-    { return std::move(*this); }
+    ~FanOut()
+    {
+        if (_pump.valid()) {
+            _pump.wait();
+        }
+        for (auto& c : _consumers) {
+            if (c.pidfd != -1) {
+                _ClosePidFd(c.pidfd);
+            }
+        }
+    }
 
-    Popen&
-    Arguments(const std::string& cmd)
+    /**
+     * @param stall_ms How long a consumer with the lDrop or lKill policy may accept nothing.
+     */
+    FanOut&
+    Add(Popen& consumer, Lag lag = lWait, duration stall_ms = 0)
     {
-        args.clear();
-        args.push_back(cmd);
-        args_is_seq = false;
+        not _started or _throw(std::invalid_argument("FanOut already started"));
+        _consumers.emplace_back();
+        _consumers.back().process = std::move(consumer);
+        _consumers.back().lag = lag;
+        _consumers.back().stall_ms = stall_ms;
         return *this;
     }
 
+    FanOut&
+    Add(Popen&& consumer, Lag lag = lWait, duration stall_ms = 0)
+    { return Add(consumer, lag, stall_ms); }
+
     Popen&
-    Arguments(const std::vector<std::string>& args)
+    Producer()
+    { return _producer; }
+
+    Popen&
+    operator[](size_t i)
+    { return _consumers[i].process; }
+
+    size_t
+    Size() const
+    { return _consumers.size(); }
+
+    /// Bytes written to the stdin of consumer i so far.
+    uint64_t
+    Delivered(size_t i) const
+    { return _consumers[i].delivered; }
+
+    /// Whether consumer i was given up on because of its Lag policy.
+    bool
+    Dropped(size_t i) const
+    { return _consumers[i].dropped; }
+
+    FanOut&
+    Start() noexcept(false)
     {
-        this->args = args;
-        args_is_seq = true;
+        if (_started) {
+            return *this;
+        }
+        not _consumers.empty() or _throw(std::invalid_argument("FanOut without consumers"));
+        _started = true;
+#ifdef __linux__
+        // where the chunks delivered by tee(2) alone are spliced to
+        FdBudget::Default().Acquire(1);
+        _null.Id(open("/dev/null", O_WRONLY | O_CLOEXEC));
+        _null.IsBudgeted(true);
+        _null.IsValid() or _throw(OSError("open(2)"));
+        _null.IsSelfClosing(true);
+#endif
+        for (auto& c : _consumers) {
+            auto pipe = Pipe::Pipe();
+            c.process.StdIn(InputStream(pipe.first));
+            c.input.reset(pipe.second);
+            fcntl(c.input->Id(), F_SETFL, fcntl(c.input->Id(), F_GETFL) | O_NONBLOCK) == 0
+            or _throw(OSError("fcntl(2)"));
+            c.process.Start();
+            c.pidfd = _PidFd(c.process.Pid());
+            c.progress = clock::now();
+        }
+        auto pipe = Pipe::Pipe();
+        _source.reset(pipe.first);
+        _producer.StdOut(OutputStream(pipe.second));
+        _producer.Start();
+        _pump = std::async(std::launch::async, [this] { _Pump(); });
         return *this;
     }
 
-    Popen&
-    Arguments(std::initializer_list<const char*> args)
+    /**
+     * @brief Wait for the producer and every consumer.
+     * @return The return code of the last one which failed, producer first, or 0.
+     */
+    retcode
+    Wait() noexcept(false)
     {
-        this->args.clear();
-        this->args.assign(args.begin(), args.end());
-        args_is_seq = true;
-        return *this;
+        Start();
+        if (_pump.valid()) {
+            _pump.get();
+        }
+        _producer.Wait();
+        for (auto& c : _consumers) {
+            c.process.Wait();
+        }
+        return _Collect();
     }
 
-    Popen&
-    Command(const std::string& cmd)
-    { return Arguments(cmd); }
+    /// Capture what the consumers write, each on its own thread but the last one.
+    template<class T = Bytes>
+    std::vector<BasicResult<T>>
+    Communicate() noexcept(false)
+    {
+        Start();
+        std::vector<BasicResult<T>> ret(_consumers.size());
+        std::vector<std::future<void>> readers;
+        for (size_t i = 0; i + 1 < _consumers.size(); ++i) {
+            readers.push_back(std::async(std::launch::async, [this, &ret, i] {
+                _consumers[i].process.CommunicateInto(ret[i].output, ret[i].error);
+            }));
+        }
+        _consumers.back().process.CommunicateInto(ret.back().output, ret.back().error);
+        for (auto& r : readers) {
+            r.get();
+        }
+        Wait();
+        for (size_t i = 0; i < _consumers.size(); ++i) {
+            ret[i].returncode = _consumers[i].process.ReturnCode();
+            ret[i].stats = _consumers[i].process.Stats();
+        }
+        return ret;
+    }
 
-    Popen&
-    Command(const std::vector<std::string>& args)
-    { return Arguments(args); }
+    /// Return codes of the producer then of the consumers, once waited for.
+    const std::vector<retcode>&
+    ReturnCodes() const
+    { return _returncodes; }
 
-    Popen&
-    Command(std::initializer_list<const char*> args)
-    { return Arguments(args); }
+private:
+    retcode
+    _Collect()
+    {
+        _returncodes.assign(1, _producer.ReturnCode());
+        retcode last = _returncodes[0];
+        for (auto& c : _consumers) {
+            _returncodes.push_back(c.process.ReturnCode());
+            last = _returncodes.back() != 0 ? _returncodes.back() : last;
+        }
+        return last;
+    }
 
-    Popen&
-    StdIn(InputStream&& std_in)
+    void
+    _Pump()
+    {
+        // a consumer which exited gives EPIPE
+        _BlockSigpipe();
+        std::unique_ptr<byte[]> chunk;
+        int source = _source->Id();
+        while (_Active() > 0) {
+            pollfd fd {source, POLLIN, 0};
+            if (poll(&fd, 1, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            int available = 0;
+            if (ioctl(source, FIONREAD, &available) != 0 or available <= 0) {
+                // end of the producer's output
+                break;
+            }
+            size_t size = std::min(static_cast<size_t>(available), _chunk_size);
+            bool complete = true;
+            for (auto& c : _consumers) {
+                c.done = 0;
+#ifdef __linux__
+                if (c.input != nullptr) {
+                    auto n = tee(source, c.input->Id(), size, SPLICE_F_NONBLOCK);
+                    if (n < 0 and errno == EPIPE) {
+                        c.input.reset();
+                    }
+                    _Progress(c, n);
+                }
+#endif
+                complete = complete and (c.input == nullptr or c.done == size);
+            }
+#ifdef __linux__
+            if (complete) {
+                // dropped from the producer's pipe without ever reaching this process
+                size_t moved = 0;
+                while (moved < size) {
+                    auto n = splice(source, nullptr, _null.Id(), nullptr, size - moved, 0);
+                    if (n <= 0) {
+                        break;
+                    }
+                    moved += static_cast<size_t>(n);
+                }
+                continue;
+            }
+#endif
+            if (chunk == nullptr) {
+                chunk.reset(new byte[_chunk_size]);
+            }
+            ssize_t n = read(source, chunk.get(), size);
+            if (n <= 0) {
+                break;
+            }
+            _Deliver(chunk.get(), static_cast<size_t>(n));
+        }
+        // EOF for all consumers, SIGPIPE for the producer if it is still writing
+        for (auto& c : _consumers) {
+            c.input.reset();
+        }
+        _source.reset();
+    }
+
+    size_t
+    _Active() const
+    {
+        return std::count_if(_consumers.begin(), _consumers.end(), [](const _Consumer& c) { return c.input != nullptr; });
+    }
+
+    static void
+    _Progress(_Consumer& c, ssize_t n)
+    {
+        if (n > 0) {
+            c.done += static_cast<size_t>(n);
+            c.delivered += static_cast<uint64_t>(n);
+            c.progress = clock::now();
+        }
+    }
+
+    /// Write what each consumer is missing of the chunk, waiting for the slowest one.
+    void
+    _Deliver(const byte* chunk, size_t size)
+    {
+        std::vector<pollfd> fds;
+        std::vector<_Consumer*> waiting;
+        for (;;) {
+            fds.clear();
+            waiting.clear();
+            int timeout = -1;
+            auto now = clock::now();
+            for (auto& c : _consumers) {
+                if (c.input == nullptr or c.done >= size) {
+                    continue;
+                }
+                if (c.lag != lWait) {
+                    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        c.progress + std::chrono::milliseconds(c.stall_ms) - now).count();
+                    if (left <= 0) {
+                        _GiveUp(c);
+                        continue;
+                    }
+                    timeout = timeout < 0 ? static_cast<int>(left) : std::min(timeout, static_cast<int>(left));
+                }
+                fds.push_back({c.input->Id(), POLLOUT, 0});
+                waiting.push_back(&c);
+            }
+            if (fds.empty()) {
+                return;
+            }
+            if (poll(fds.data(), fds.size(), timeout) < 0 and errno != EINTR) {
+                return;
+            }
+            for (size_t i = 0; i < fds.size(); ++i) {
+                if (fds[i].revents == 0) {
+                    continue;
+                }
+                auto& c = *waiting[i];
+                auto n = write(c.input->Id(), chunk + c.done, size - c.done);
+                if (n < 0 and errno != EAGAIN and errno != EINTR) {
+                    // the consumer is gone
+                    c.input.reset();
+                    continue;
+                }
+                _Progress(c, n);
+            }
+        }
+    }
+
+    void
+    _GiveUp(_Consumer& c)
+    {
+        c.input.reset();
+        c.dropped = true;
+        if (c.lag != lKill) {
+            return;
+        }
+        // Not through c.process, nor its pid: the thread in Communicate()
+        // or Wait() may reap it at any time, and the pid be reused. A pidfd
+        // keeps targeting that child; without one, closing stdin has to do.
+#if defined(__linux__) && defined(SYS_pidfd_send_signal)
+        if (c.pidfd != -1) {
+            syscall(SYS_pidfd_send_signal, c.pidfd, SIGKILL, nullptr, 0);
+        }
+#endif
+    }
+};
+#endif
+
+#ifndef _WIN32
+/**
+ * @brief The stdout and stderr of many children merged into one output, a whole line at a time.
+ *
+ * A single poll(2) loop reads every pipe; lines are only emitted once complete,
+ * so the lines of two children never interleave. Each line can be prefixed
+ * with its source, `[id] ` or `[id:err] `, and with the monotonic time it was
+ * read at, in seconds since Run(). Lines to a file descriptor are written in
+ * batches with writev(2), one batch per poll(2) round. A line longer than
+ * 64 KiB is cut, and each piece is emitted as a line of its own.
+ * \code
+ * sp::LineMerger merger;
+ * merger.Tag(true, true).Output(STDOUT_FILENO);
+ * for (auto& shard : shards) {
+ *     merger.Add(sp::Popen().Arguments({"./work", shard}));
+ * }
+ * merger.Run();
+ * \endcode
+ */
+class LineMerger
+{
+public:
+    typedef size_t Id;
+    /// Receives each line, '\n' included, and where and when it was read from.
+    /// A line longer than 64 KiB comes in pieces, each one terminated by '\n'.
+    typedef std::function<void(Id id, int stream, clock::time_point time, const char* line, size_t size)> LineCallback;
+
+private:
+    struct _Source
+    {
+        Id id;
+        int stream;
+        std::unique_ptr<Pipe::Receiver> pipe;
+        std::string pending;
+        size_t complete = 0;
+    };
+
+    // a longer line is cut, to bound what a source may hold
+    static constexpr size_t _max_line = 64 * 1024;
+#ifdef IOV_MAX
+    static constexpr size_t _max_iov = IOV_MAX;
+#else
+    static constexpr size_t _max_iov = _XOPEN_IOV_MAX;
+#endif
+
+    std::vector<Popen> _processes;
+    std::vector<_Source> _sources;
+    int _fd = -1;
+    std::string* _buffer = nullptr;
+    LineCallback _callback;
+    bool _tag_source = false;
+    bool _tag_time = false;
+    clock::time_point _start;
+    struct _Piece
+    {
+        const char* line;
+        size_t size;
+        bool cut;   ///< not ending with '\n', which is emitted after it
+    };
+
+    // tags of the current batch, and where the lines and tags are
+    std::string _tags;
+    std::vector<std::pair<size_t, size_t>> _tag_spans;
+    std::vector<_Piece> _lines;
+
+public:
+    LineMerger&
+    Tag(bool source, bool time = false)
     {
-        this->std_in = std::move(std_in);
+        _tag_source = source;
+        _tag_time = time;
         return *this;
     }
 
-    Popen&
-    StdOut(OutputStream&& std_out)
+    LineMerger&
+    Output(int fd)
     {
-        this->std_out = std::move(std_out);
+        _fd = fd;
         return *this;
     }
 
-    Popen&
-    StdErr(ErrorStream&& std_err)
+    LineMerger&
+    Output(std::string& buffer)
     {
-        this->std_err = std::move(std_err);
+        _buffer = &buffer;
         return *this;
     }
 
-    Popen&
-    Directory(const std::string& cwd)
+    LineMerger&
+    Output(LineCallback callback)
     {
-        this->cwd = cwd;
+        _callback = std::move(callback);
         return *this;
     }
 
     /**
-     * @param env An array of key=values strings.
+     * @brief Start a child with its stdout, and stderr if asked, merged.
+     * @return The id of the child, also the index for operator[].
      */
-    Popen&
-    Environment(const std::vector<std::string>& env)
-    {
-        this->env = env;
-        return *this;
-    }
-#ifdef _WIN32
-    Popen&
-    CreationFlags(unsigned flags)
-    {
-        this->creation_flags = flags;
-        return *this;
-    }
-#else
-    Popen&
-    RestoreSignals(bool restore_signals_)
-    {
-        restore_signals = restore_signals_;
-        return *this;
-    }
-#endif
-    Popen&
-    CloseFileDescriptors(bool close_fds)
+    Id
+    Add(Popen& process, bool merge_stderr = true)
     {
-        this->close_fds = close_fds;
-        return *this;
+        Id id = _processes.size();
+        _processes.push_back(std::move(process));
+        auto& p = _processes.back();
+        auto out = Pipe::Pipe();
+        _sources.push_back({id, 1, std::unique_ptr<Pipe::Receiver>(out.first), {}});
+        p.StdOut(OutputStream(out.second));
+        if (merge_stderr) {
+            auto err = Pipe::Pipe();
+            _sources.push_back({id, 2, std::unique_ptr<Pipe::Receiver>(err.first), {}});
+            p.StdErr(ErrorStream(err.second));
+        }
+        p.Start();
+        return id;
     }
 
-    Popen&
-    InheritHandles(bool inherit)
-    { return CloseFileDescriptors(not inherit); }
+    Id
+    Add(Popen&& process, bool merge_stderr = true)
+    { return Add(process, merge_stderr); }
 
-    Popen&
-    Start() noexcept(false)
-    {
-        Impl()->Start(*this);
-        return *this;
-    }
+    size_t
+    Size() const
+    { return _processes.size(); }
 
-    /**
-     * @brief Wait for child process to terminate. Set and return the returncode.
-     * @return retcode.
-     */
-    retcode
-    Wait(const _INFINITE_TIME& = INFINITE_TIME) noexcept(false)
-    { return Impl()->Wait(*this); }
+    Popen&
+    operator[](Id id)
+    { return _processes[id]; }
 
     /**
-     * @brief Wait for child process to terminate in timeout_ms milliseconds. Set and return the returncode.
-     * @param timeout_ms Timeout in milliseconds.
-     * @return retcode.
+     * @brief Merge until every pipe is closed, then wait for the children.
+     * @return The return code of the last child which failed, or 0.
      */
     retcode
-    Wait(duration timeout_ms) noexcept(false)
-    { return Impl()->Wait(*this, timeout_ms); }
-
-    Return
-    Communicate(const Bytes& input = {}, const _INFINITE_TIME& = INFINITE_TIME) noexcept(false)
-    { return Impl()->Communicate(*this, input); }
-
-    Return
-    Communicate(const Bytes& input, duration timeout_ms) noexcept(false)
-    { return Impl()->Communicate(*this, input, timeout_ms); }
-
-    Return
-    Communicate(duration timeout_ms, const Bytes& input = {}) noexcept(false)
-    { return Impl()->Communicate(*this, input, timeout_ms); }
-
-    Return
-    Communicate(const _INFINITE_TIME&, const Bytes& input = {}) noexcept(false)
-    { return Impl()->Communicate(*this, input); }
-
-    retcode
-    Poll() noexcept(false)
-    { return Impl()->Poll(*this); }
-
-    int
-    SendSignal(int sig)
-    { return Impl()->SendSignal(sig); }
-
-    int
-    Terminate()
-    { return Impl()->Terminate(); }
-
-    int
-    Kill()
-    { return Impl()->Kill(); }
-
-#ifdef _WIN32
-    DWORD
-#else
-    pid_t
-#endif
-    Pid() const
-    { return _impl->Pid(); }
-
-    retcode
-    ReturnCode() const
-    { return _impl->ReturnCode(); }
-
-    std::vector<std::string>
-    Arguments() const
-    { return _impl->Arguments(); }
-
-    Popen_impl*
-    Impl()
+    Run() noexcept(false)
     {
-        if (not _impl) {
-            _impl.reset(new Popen_impl);
-        }
-        return _impl.get();
-    }
-};
-
-#ifdef _WIN32
-void
-Popen_impl::
-Start(Popen& p) noexcept(false)
-{
-    if (_state != sInitial) {
-        return;
-    }
-    (not p.args.empty() and not p.args.front().empty()) or _throw(std::invalid_argument("Invalid or no arguments provided"));
-    _args = p.args;
-    _args_is_seq = p.args_is_seq;
-    _close_fds = p.close_fds;
-    _std_in = std::move(p.std_in);
-    _std_out = std::move(p.std_out);
-    _std_err = std::move(p.std_err);
-    if (_std_err.IsStdOut()) {
-        _std_err.OutputStream(_std_out);
-    }
-    // setup
-    auto si = _GetStartupInfo();
-    auto pi = std::unique_ptr<PROCESS_INFORMATION>(new PROCESS_INFORMATION());
-    auto cmd = _GetCommand();
-    auto env = _GetEnvironment(p);
-    auto cwd = p.cwd.empty() ? nullptr : p.cwd.c_str();
-    // run
-    CreateProcessA(nullptr, cmd->data(), nullptr, nullptr, not _close_fds, p.creation_flags, env.get(), cwd, si.get(), pi.get())
-    or _throw(OSError("CreateProcessA"));
-    _ph = pi->hProcess;
-    _pid = pi->dwProcessId;
-    _state = sProcessStarted;
-    // cleanup
-    CloseHandle(pi->hThread);
-    _std_in.DestroyReceiver();
-    _std_out.DestroySender();
-    _std_err.DestroySender();
-}
-
-std::unique_ptr<char[]>
-Popen_impl::
-_GetEnvironment(Popen& p) const
-{
-    size_t size = 1u;
-    for (const auto& s : p.env) {
-        size += s.size() + 1;
-    }
-    if (size == 1) {
-        return nullptr;
-    }
-    auto env = new char[size];
-    auto ptr = env;
-    for (const auto& s : p.env) {
-        size = s.size() + 1;
-        memcpy(ptr, s.data(), size);
-        ptr += size;
-    }
-    *ptr = '\0';
-    return std::unique_ptr<char[]>(env);
-}
-#else
-void
-Popen_impl::
-Start(Popen& p) noexcept(false)
-{
-    if (_state != sInitial) {
-        return;
-    }
-    (not p.args.empty() and not p.args.front().empty()) or _throw(std::invalid_argument("Invalid or no arguments provided"));
-    _args = p.args;
-    _args_is_seq = p.args_is_seq;
-    _close_fds = p.close_fds;
-    _restore_signals = p.restore_signals;
-    _std_in = std::move(p.std_in);
-    _std_out = std::move(p.std_out);
-    _std_err = std::move(p.std_err);
-    if (_std_err.IsStdOut()) {
-        _std_err.OutputStream(_std_out);
-    }
-    if (p.cwd.empty()) {
-        // setup
-        auto file_actions = _GetFileActions();
-        auto attrp = _GetAttributes();
-        auto argv = _GetArguments();
-        auto env = _GetEnvironment(p);
-        // run
-        posix_spawnp(&_pid, argv[0], file_actions.get(), attrp.get(), argv.get(), env.get()) == 0
-        or _throw(OSError("posix_spawnp(3p)"));
-    } else {
-        _pid = fork();
-        _pid >= 0 or _throw(OSError("fork(2)"));
-        _Exec(p);
-    }
-    _state = sProcessStarted;
-    // cleanup
-    _std_in.DestroyReceiver();
-    _std_out.DestroySender();
-    _std_err.DestroySender();
-    _waitpid_lock.reset(new std::mutex);
-}
-
-std::unique_ptr<char*[]>
-Popen_impl::
-_GetEnvironment(Popen& p)
-{
-    if (p.env.empty()) {
-        // maybe the system's environment should be returned instead of this
-        return nullptr;
-    }
-    auto env = new char*[p.env.size() + 1];
-    auto ptr = env;
-    for (const auto& e : p.env) {
-        *ptr = const_cast<char*>(e.c_str());
-        ++ptr;
-    }
-    *ptr = nullptr;
-    return std::unique_ptr<char*[]>(env);
-}
-
-void
-Popen_impl::
-_Exec(Popen& p)
-{
-    if (_pid != 0) {
-        // parents are not allowed here
-        return;
-    }
-    try {
-        bool v0 = _std_in .Sender  () != nullptr and _std_in .Sender  ()->IsValid();
-        bool v1 = _std_out.Receiver() != nullptr and _std_out.Receiver()->IsValid();
-        bool v2 = _std_err.Receiver() != nullptr and _std_err.Receiver()->IsValid();
-        bool v3 = _std_in .Receiver() != nullptr and _std_in .Receiver()->IsValid();
-        bool v4 = _std_out.Sender  () != nullptr and _std_out.Sender  ()->IsValid();
-        bool v5 = _std_err.Sender  () != nullptr and _std_err.Sender  ()->IsValid();
-        if (v0 or v1 or v2 or v3 or v4 or v5) {
-            if (v3 and _std_in .Receiver()->Id() > STDERR_FILENO) {
-                _std_in .Receiver()->CloseOnExec(true);
+        _start = clock::now();
+        std::vector<pollfd> fds;
+        std::vector<_Source*> ready;
+        for (;;) {
+            fds.clear();
+            ready.clear();
+            for (auto& s : _sources) {
+                if (s.pipe != nullptr) {
+                    fds.push_back({s.pipe->Id(), POLLIN, 0});
+                    ready.push_back(&s);
+                }
             }
-            if (v4 and _std_out.Sender  ()->Id() > STDERR_FILENO) {
-                _std_out.Sender  ()->CloseOnExec(true);
+            if (fds.empty()) {
+                break;
             }
-            if (v5 and _std_err.Sender  ()->Id() > STDERR_FILENO) {
-                _std_err.Sender  ()->CloseOnExec(true);
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                errno == EINTR or _throw(OSError("poll(2)"));
+                continue;
             }
-            v0 and _std_in .Sender  ()->Close();
-            v1 and _std_out.Receiver()->Close();
-            v2 and _std_err.Receiver()->Close();
-            v3 and (dup2(_std_in .Receiver()->Id(), STDIN_FILENO ) != -1 or _throw(OSError("dup2(2)")));
-            v4 and (dup2(_std_out.Sender  ()->Id(), STDOUT_FILENO) != -1 or _throw(OSError("dup2(2)")));
-            v5 and (dup2(_std_err.Sender  ()->Id(), STDERR_FILENO) != -1 or _throw(OSError("dup2(2)")));
+            auto now = clock::now();
+            for (size_t i = 0; i < fds.size(); ++i) {
+                if (fds[i].revents != 0) {
+                    _Read(*ready[i], now);
+                }
+            }
+            _Flush();
         }
-        if (_close_fds) {
-            int max_fd = sysconf(_SC_OPEN_MAX);
-            max_fd != -1 or _throw(OSError("sysconf(3)"));
-            for (int i = STDERR_FILENO + 1; i < max_fd; ++i) {
-                close(i);
+        retcode code = 0;
+        for (auto& p : _processes) {
+            code = p.Wait() != 0 ? p.ReturnCode() : code;
+        }
+        return code;
+    }
+
+private:
+    void
+    _Read(_Source& s, clock::time_point now)
+    {
+        // straight into the source's own buffer, which the batch then points to
+        size_t size = s.pending.size();
+        s.pending.resize(size + 16 * 1024);
+        ssize_t n;
+        while ((n = read(s.pipe->Id(), &s.pending[size], 16 * 1024)) < 0 and errno == EINTR) {
+        }
+        s.pending.resize(size + static_cast<size_t>(std::max<ssize_t>(n, 0)));
+        if (n <= 0) {
+            s.pipe.reset();
+            if (not s.pending.empty() and s.pending.back() != '\n') {
+                // the last line, unterminated
+                s.pending += '\n';
             }
         }
-        if (_restore_signals) {
-#   ifdef SIGPIPE
-            sigset(SIGPIPE, SIG_DFL);
-#   endif
-#   ifdef SIGXFZ
-            sigset(SIGXFZ , SIG_DFL);
-#   endif
-#   ifdef SIGXFSZ
-            sigset(SIGXFSZ, SIG_DFL);
-#   endif
+        size_t begin = 0;
+        for (;;) {
+            size_t end = s.pending.find('\n', begin);
+            bool cut = false;
+            if (end == std::string::npos) {
+                if (s.pending.size() - begin < _max_line) {
+                    break;
+                }
+                end = begin + _max_line - 1;
+                cut = true;
+            }
+            _Line(s, now, begin, end + 1 - begin, cut);
+            begin = end + 1;
         }
-        if (not p.cwd.empty()) {
-            chdir(p.cwd.c_str()) == 0 or _throw(OSError("chdir(2)"));
+        s.complete = begin;
+    }
+
+    void
+    _Line(_Source& s, clock::time_point now, size_t begin, size_t size, bool cut)
+    {
+        const char* line = s.pending.data() + begin;
+        if (_callback and cut) {
+            std::string piece(line, size);
+            piece += '\n';
+            _callback(s.id, s.stream, now, piece.data(), piece.size());
+        } else if (_callback) {
+            _callback(s.id, s.stream, now, line, size);
         }
-        auto argv = _GetArguments();
-        if (p.env.empty()) {
-            execvp(argv[0], argv.get()) or _throw(OSError("execvp(2)"));
-        } else {
-            auto env1 = _GetEnvironment(p);
-            execvpe(argv[0], argv.get(), env1.get()) or _throw(OSError("execvpe(2)"));
+        if (_fd < 0 and _buffer == nullptr) {
+            return;
         }
-    } catch (...) {
-        // ignored for now
+        size_t tag = _tags.size();
+        if (_tag_time) {
+            char t[32];
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(now - _start).count();
+            snprintf(t, sizeof t, "[%lld.%06lld] ", static_cast<long long>(us / 1000000), static_cast<long long>(us % 1000000));
+            _tags += t;
+        }
+        if (_tag_source) {
+            _tags += "[" + std::to_string(s.id) + (s.stream == 2 ? ":err] " : "] ");
+        }
+        _tag_spans.emplace_back(tag, _tags.size() - tag);
+        _lines.push_back({line, size, cut});
     }
-    _exit(0x7F);
-}
-#endif
 
-void
-_poll(Popen& process, const Return& ret) noexcept(false)
-{
-    while (true) {
-        try {
-            process.Poll() == 0 or _throw(nullptr);
-            break;
-        } catch (const WaitLockMissed&) {
-            std::this_thread::sleep_for(std::chrono::nanoseconds(50));
-        } catch (...) {
-            _throw(CalledProcessError(process.Arguments(), process.ReturnCode(), ret.output, ret.error));
+    /// Emit the lines of this round, then forget them.
+    void
+    _Flush()
+    {
+        if (_buffer != nullptr) {
+            for (size_t i = 0; i < _lines.size(); ++i) {
+                _buffer->append(_tags, _tag_spans[i].first, _tag_spans[i].second);
+                _buffer->append(_lines[i].line, _lines[i].size);
+                if (_lines[i].cut) {
+                    *_buffer += '\n';
+                }
+            }
+        }
+        if (_fd >= 0) {
+            std::vector<iovec> iov;
+            static char newline = '\n';
+            iov.reserve(_lines.size() * 2);
+            for (size_t i = 0; i < _lines.size(); ++i) {
+                if (_tag_spans[i].second > 0) {
+                    iov.push_back({&_tags[_tag_spans[i].first], _tag_spans[i].second});
+                }
+                iov.push_back({const_cast<char*>(_lines[i].line), _lines[i].size});
+                if (_lines[i].cut) {
+                    // no piece may run into the next entry
+                    iov.push_back({&newline, 1});
+                }
+            }
+            _WriteAll(iov);
+        }
+        _tags.clear();
+        _tag_spans.clear();
+        _lines.clear();
+        for (auto& s : _sources) {
+            s.pending.erase(0, s.complete);
+            s.complete = 0;
         }
     }
-}
 
-Bytes
-_check_output(Popen&& process, duration timeout_ms) noexcept(false)
-{
-    Return ret;
-    try {
-        ret = process.Communicate(timeout_ms);
-    } catch (TimeoutExpired& e) {
-        process.Kill();
-#ifdef _WIN32
-        // Windows accumulates the output in a single blocking
-        // Receive() call run on child threads, with the timeout
-        // being done in a wait_until() on those threads.
-        // Communicate() _after_ Kill() is required to collect
-        // that and add it to the exception.
-        ret = process.Communicate();
-        e.output = ret.output;
-        e.error = ret.error;
-#else
-        // POSIX _communicate() already populated the output so
-        // far into the TimeoutExpired exception.
-        process.Wait();
-#endif
-        throw;
-    } catch (...) {
-        process.Kill();
-        throw;
+    void
+    _WriteAll(std::vector<iovec>& iov)
+    {
+        size_t first = 0;
+        while (first < iov.size()) {
+            int count = static_cast<int>(std::min(iov.size() - first, _max_iov));
+            ssize_t n = writev(_fd, &iov[first], count);
+            if (n < 0) {
+                errno == EINTR or _throw(OSError("writev(2)"));
+                continue;
+            }
+            // skip what was written, possibly up to the middle of an entry
+            auto written = static_cast<size_t>(n);
+            while (first < iov.size() and written >= iov[first].iov_len) {
+                written -= iov[first].iov_len;
+                ++first;
+            }
+            if (written > 0) {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + written;
+                iov[first].iov_len -= written;
+            }
+        }
     }
-    _poll(process, ret);
-    return std::move(ret.output);
-}
+};
 
-Bytes
-_check_output(Popen&& process, const _INFINITE_TIME& = INFINITE_TIME)
+/// How parallel_map() runs its jobs and hands their results over.
+struct MapOptions
 {
-    Return ret;
-    try {
-        ret = process.Communicate();
-    } catch (...) {
-        process.Kill();
-        throw;
-    }
-    _poll(process, ret);
-    return std::move(ret.output);
-}
+    enum Order
+    {
+        oInput,         ///< results in input order, held back in a reorder buffer
+        oCompletion     ///< results as soon as their job is done
+    };
 
-Bytes
-check_output
-(   const std::string& cmd
-,             duration timeout_ms
-,        InputStream&& std_in = {}
-,        ErrorStream&& std_err = {}
-,   const std::string& cwd = {}
-)
-{
-    return _check_output(
-        Popen{
-            .args = {cmd},
-            .std_in = std::move(std_in),
-            .std_out = PIPE,
-            .std_err = std::move(std_err),
-            .cwd = cwd,
-        },
-        timeout_ms
-    );
-}
+    enum Policy
+    {
+        pCollectAll,    ///< run every input whatever fails
+        pFailFast       ///< after the first failure, start nothing more and kill the running jobs
+    };
 
-Bytes
-check_output
-(        const std::string& cmd
-,   const _INFINITE_TIME& = INFINITE_TIME
-,             InputStream&& std_in = {}
-,             ErrorStream&& std_err = {}
-,        const std::string& cwd = {}
-)
+    Order order = oInput;
+    /// With oInput, how far past the oldest unfinished job new ones may start; 0 for 4 x jobs.
+    size_t window = 0;
+    Policy policy = pCollectAll;
+    /// Per job, after which it is killed and reported as eTimeout; 0 for none.
+    duration timeout_ms = 0;
+};
+
+template<class T>
+struct _MapJob
 {
-    return _check_output(
-        Popen{
-            .args = {cmd},
-            .args_is_seq = false,
-            .std_in = std::move(std_in),
-            .std_out = PIPE,
-            .std_err = std::move(std_err),
-            .cwd = cwd,
+    size_t index;
+    Popen process;
+    std::unique_ptr<Pipe::Receiver> out;
+    std::unique_ptr<Pipe::Receiver> err;
+    int pidfd = -1;
+    bool exited = false;
+    bool timed_out = false;
+    clock::time_point deadline = clock::time_point::max();
+    BasicResult<T> result;
+
+    ~_MapJob()
+    {
+        if (pidfd != -1) {
+            _ClosePidFd(pidfd);
         }
-    );
-}
+    }
+};
 
-Bytes
-check_output
-(   const std::vector<std::string>& args
-,                          duration timeout_ms
-,                     InputStream&& std_in = {}
-,                     ErrorStream&& std_err = {}
-,                const std::string& cwd = {}
-)
+void
+_MapCommand(Popen& process, std::vector<std::string>&& args)
+{ process.Arguments(args).StdIn(DEVNUL); }
+
+void
+_MapCommand(Popen& process, Popen&& made)
+{ process = std::move(made); }
+
+/// Read once from a job's pipe into buffer; the pipe is dropped at EOF.
+template<class T>
+void
+_MapRead(Popen& process, std::unique_ptr<Pipe::Receiver>& pipe, T& buffer)
 {
-    return _check_output(
-        Popen{
-            .args = args,
-            .args_is_seq = true,
-            .std_in = std::move(std_in),
-            .std_out = PIPE,
-            .std_err = std::move(std_err),
-            .cwd = cwd,
-        },
-        timeout_ms
-    );
+    size_t room = 16 * 1024;
+    byte* data = BufferTraits<T>::Prepare(buffer, room);
+    auto size = room > 0 ? pipe->ReceiveSome(data, room) : 0;
+    bool more = BufferTraits<T>::Commit(buffer, room, size > 0 ? static_cast<size_t>(size) : 0);
+    if (size <= 0) {
+        pipe.reset();
+    } else if (not more) {
+        process.Kill();
+        pipe.reset();
+    }
 }
 
-Bytes
-check_output
-(   const std::vector<std::string>& args
-,           const _INFINITE_TIME& = INFINITE_TIME
-,                     InputStream&& std_in = {}
-,                     ErrorStream&& std_err = {}
-,                const std::string& cwd = {}
-)
+/**
+ * @brief Run make_args(input) for every input, up to jobs at a time (0 for
+ * one per core), the xargs -P pattern; f(index, result) receives each
+ * outcome, see MapOptions.
+ *
+ * make_args returns the arguments, or a configured Popen. Their stdout and
+ * stderr are captured into T buffers, stdin is /dev/null unless the Popen
+ * says otherwise. A failure is an Error (eOSError, eTimeout) or a non-zero
+ * return code. With pFailFast, the jobs killed or never started are not
+ * reported. A job past options.timeout_ms, or cancelled, gets KillTree():
+ * give the Popen a ProcessGroup() to have its descendants killed too.
+ *
+ * Every job is driven from the calling thread: one poll(2) over the pipes
+ * of all running jobs and, where available, their pidfds, so no thread is
+ * spent per job.
+ * @return The number of failures reported.
+ */
+template<class T = Bytes, class Inputs, class MakeArgs, class F>
+size_t
+parallel_map(const Inputs& inputs, MakeArgs make_args, size_t jobs, F f, const MapOptions& options = {}) noexcept(false)
 {
-    return _check_output(
-        Popen{
-            .args = args,
-            .args_is_seq = true,
-            .std_in = std::move(std_in),
-            .std_out = PIPE,
-            .std_err = std::move(std_err),
-            .cwd = cwd,
+    typedef Expected<BasicResult<T>> Outcome;
+    jobs = jobs > 0 ? jobs : std::max(1u, std::thread::hardware_concurrency());
+    size_t window = options.window > 0 ? options.window : 4 * jobs;
+    bool ordered = options.order == MapOptions::oInput;
+    // completed results waiting for an older one, by index modulo window
+    std::vector<std::unique_ptr<Outcome>> held (ordered ? window : 0);
+    std::vector<std::unique_ptr<_MapJob<T>>> running;
+    std::vector<pollfd> fds;
+    std::vector<std::pair<_MapJob<T>*, int>> owners;
+    size_t next = 0;
+    size_t next_out = 0;
+    size_t failures = 0;
+    bool stop = false;
+
+    auto flush = [&] {
+        while (next_out < next and held[next_out % window] != nullptr) {
+            auto outcome = std::move(held[next_out % window]);
+            f(next_out++, *outcome);
         }
-    );
-}
+    };
+    auto deliver = [&](size_t index, Outcome&& outcome) {
+        if (not outcome or outcome->returncode != 0) {
+            ++failures;
+            stop = stop or options.policy == MapOptions::pFailFast;
+        }
+        if (not ordered) {
+            f(index, outcome);
+            return;
+        }
+        held[index % window].reset(new Outcome(std::move(outcome)));
+        flush();
+    };
 
-Bytes
-check_output
-(   std::initializer_list<const char*> args
-,                             duration timeout_ms
-,                        InputStream&& std_in = {}
-,                        ErrorStream&& std_err = {}
-,                   const std::string& cwd = {}
-)
-{
-    return _check_output(
-        Popen{
-            .args = std::vector<std::string>(args.begin(), args.end()),
-            .args_is_seq = true,
-            .std_in = std::move(std_in),
-            .std_out = PIPE,
-            .std_err = std::move(std_err),
-            .cwd = cwd,
-        },
-        timeout_ms
-    );
+    auto input = std::begin(inputs);
+    auto end = std::end(inputs);
+    try {
+        while (true) {
+            while (not stop and input != end and running.size() < jobs and (not ordered or next < next_out + window)) {
+                std::unique_ptr<_MapJob<T>> job (new _MapJob<T>{next++});
+                try {
+                    _MapCommand(job->process, make_args(*input));
+                    auto out = Pipe::Pipe();
+                    job->out.reset(out.first);
+                    job->process.StdOut(OutputStream(out.second));
+                    auto err = Pipe::Pipe();
+                    job->err.reset(err.first);
+                    job->process.StdErr(ErrorStream(err.second));
+                    job->process.Start();
+                    job->pidfd = _PidFd(job->process.Pid());
+                    if (options.timeout_ms > 0) {
+                        job->deadline = clock::now() + std::chrono::milliseconds(options.timeout_ms);
+                    }
+                    running.push_back(std::move(job));
+                } catch (const std::exception& e) {
+                    deliver(job->index, Error{Error::eOSError, e.what()});
+                }
+                ++input;
+            }
+            if (stop) {
+                break;
+            }
+            if (running.empty()) {
+                if (input == end) {
+                    break;
+                }
+                continue;
+            }
+            fds.clear();
+            owners.clear();
+            auto wake = clock::time_point::max();
+            bool polling = false;
+            for (auto& job : running) {
+                if (job->out != nullptr) {
+                    fds.push_back({job->out->Id(), POLLIN, 0});
+                    owners.emplace_back(job.get(), 1);
+                }
+                if (job->err != nullptr) {
+                    fds.push_back({job->err->Id(), POLLIN, 0});
+                    owners.emplace_back(job.get(), 2);
+                }
+                if (job->pidfd != -1 and not job->exited) {
+                    fds.push_back({job->pidfd, POLLIN, 0});
+                    owners.emplace_back(job.get(), 0);
+                }
+                if (not job->timed_out) {
+                    wake = std::min(wake, job->deadline);
+                }
+                // without a pidfd, a child done with its pipes, or killed, is polled for
+                polling = polling or (job->pidfd == -1 and ((job->out == nullptr and job->err == nullptr) or job->timed_out));
+            }
+            int timeout = -1;
+            if (polling) {
+                timeout = 10;
+            }
+            if (wake != clock::time_point::max()) {
+                auto remaining = std::chrono::ceil<std::chrono::milliseconds>(wake - clock::now()).count();
+                remaining = std::max<decltype (remaining)>(0, std::min<decltype (remaining)>(remaining, INT_MAX));
+                timeout = timeout < 0 ? static_cast<int>(remaining) : std::min(timeout, static_cast<int>(remaining));
+            }
+            if (poll(fds.data(), fds.size(), timeout) < 0) {
+                errno == EINTR or _throw(OSError("poll(2)"));
+                continue;
+            }
+            for (size_t i = 0; i < fds.size(); ++i) {
+                if (fds[i].revents == 0) {
+                    continue;
+                }
+                auto job = owners[i].first;
+                switch (owners[i].second) {
+                    case 0: job->exited = true; break;
+                    case 1: _MapRead(job->process, job->out, job->result.output); break;
+                    case 2: _MapRead(job->process, job->err, job->result.error); break;
+                }
+            }
+            auto now = clock::now();
+            for (size_t i = 0; i < running.size();) {
+                auto& job = *running[i];
+                if (now >= job.deadline and not job.timed_out) {
+                    job.process.KillTree();
+                    job.timed_out = true;
+                }
+                if ((job.out != nullptr or job.err != nullptr) and not job.timed_out) {
+                    ++i;
+                    continue;
+                }
+                bool exited = job.exited;
+                if (job.pidfd == -1) {
+                    auto code = job.process.TryPoll();
+                    exited = code or code.Error().code != Error::eStillActive;
+                }
+                if (not exited) {
+                    ++i;
+                    continue;
+                }
+                // the descendants of a killed child may still hold the pipes
+                job.out.reset();
+                job.err.reset();
+                job.process.Wait();
+                job.result.returncode = job.process.ReturnCode();
+                job.result.stats = job.process.Stats();
+                auto done = std::move(running[i]);
+                running[i] = std::move(running.back());
+                running.pop_back();
+                if (done->timed_out) {
+                    deliver(done->index, Error{Error::eTimeout, {}});
+                } else {
+                    deliver(done->index, std::move(done->result));
+                }
+            }
+        }
+    } catch (...) {
+        for (auto& job : running) {
+            job->process.KillTree();
+        }
+        throw;
+    }
+    // fail-fast: what is still running is cancelled, what was held back goes out in order
+    for (auto& job : running) {
+        job->process.KillTree();
+        job->process.Wait();
+    }
+    for (; ordered and next_out < next; ++next_out) {
+        auto outcome = std::move(held[next_out % window]);
+        if (outcome != nullptr) {
+            f(next_out, *outcome);
+        }
+    }
+    return failures;
 }
 
-Bytes
-check_output
-(   std::initializer_list<const char*> args
-,              const _INFINITE_TIME& = INFINITE_TIME
-,                        InputStream&& std_in = {}
-,                        ErrorStream&& std_err = {}
-,                   const std::string& cwd = {}
-)
-
+/**
+ * @brief parallel_map() collecting every result, in input order; the
+ * inputs a pFailFast run cancelled have eCancelled.
+ */
+template<class T = Bytes, class Inputs, class MakeArgs>
+std::vector<Expected<BasicResult<T>>>
+parallel_map(const Inputs& inputs, MakeArgs make_args, size_t jobs = 0, MapOptions options = {}) noexcept(false)
 {
-    return _check_output(
-        Popen{
-            .args = std::vector<std::string>(args.begin(), args.end()),
-            .args_is_seq = true,
-            .std_in = std::move(std_in),
-            .std_out = PIPE,
-            .std_err = std::move(std_err),
-            .cwd = cwd,
-        }
-    );
+    std::vector<Expected<BasicResult<T>>> results (
+        static_cast<size_t>(std::distance(std::begin(inputs), std::end(inputs))), Error{Error::eCancelled, {}});
+    options.order = MapOptions::oCompletion;
+    parallel_map<T>(inputs, make_args, jobs, [&results](size_t index, Expected<BasicResult<T>>& result) {
+        results[index] = std::move(result);
+    }, options);
+    return results;
 }
+#endif
 
 int
 call
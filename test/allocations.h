@@ -0,0 +1,32 @@
+// Counts every heap allocation made through operator new, for the tests
+// checking what a call allocates; include it before anything else.
+#include <cstdlib>
+#include <new>
+#include <atomic>
+
+#ifdef __GNUC__
+// kept out of line, so that GCC does not pair an inlined free() with a new expression
+#   define ALLOCATIONS_NOINLINE __attribute__((noinline))
+#else
+#   define ALLOCATIONS_NOINLINE
+#endif
+
+static std::atomic<long> allocations {0};
+
+ALLOCATIONS_NOINLINE void*
+operator new(std::size_t n)
+{
+	++allocations;
+	if (void* p = std::malloc(n != 0 ? n : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+ALLOCATIONS_NOINLINE void
+operator delete(void* p) noexcept
+{ std::free(p); }
+
+ALLOCATIONS_NOINLINE void
+operator delete(void* p, std::size_t) noexcept
+{ operator delete(p); }
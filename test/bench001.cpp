@@ -0,0 +1,32 @@
+// Spawns per second with 1 to 64 threads spawning at once, close_fds disabled.
+// Build: c++ -std=c++17 -O2 -pthread -I.. -o bench.exe bench001.cpp
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+	const int spawns = argc > 1 ? atoi(argv[1]) : 2048;
+	for (int threads = 1; threads <= 64; threads *= 2) {
+		std::atomic<int> next {0};
+		std::vector<std::thread> pool;
+		auto start = sp::clock::now();
+		for (int t = 0; t < threads; ++t) {
+			pool.emplace_back([&] {
+				while (next++ < spawns) {
+#ifdef _WIN32
+					sp::Popen().Arguments({"cmd", "/c", "exit"}).StdOut(sp::PIPE).CloseFileDescriptors(false).Communicate();
+#else
+					sp::Popen().Arguments({"true"}).StdOut(sp::PIPE).CloseFileDescriptors(false).Communicate();
+#endif
+				}
+			});
+		}
+		for (auto& t : pool) {
+			t.join();
+		}
+		std::chrono::duration<double> elapsed = sp::clock::now() - start;
+		printf("%2d threads: %8.0f spawns/s\n", threads, spawns / elapsed.count());
+	}
+	return 0;
+}
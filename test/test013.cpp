@@ -0,0 +1,65 @@
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	// Supervise many children with one shared timer wheel instead of one sleeper each
+	std::atomic<int> notified {0};
+	std::vector<sp::Popen> children;
+	for (int i = 0; i < 100; ++i) {
+		sp::ExpiryAction action;
+		action.grace_ms = 100;
+		action.notify = [&notified] { ++notified; };
+		children.push_back(sp::Popen().Command("sleep 10").Deadline(200, action).Start()());
+	}
+	// A child finishing in time is left alone
+	auto quick = sp::Popen().Command("true").Deadline(5000).Start()();
+	auto start = sp::clock::now();
+	for (auto& p : children) {
+		if (p.Wait() != SIGTERM or not p.Expired()) {
+			return 1;
+		}
+	}
+	if (sp::clock::now() - start > std::chrono::seconds(5)) {
+		return 2;
+	}
+	if (quick.Wait() != 0 or quick.Expired()) {
+		return 3;
+	}
+	// Cancelled timers never fire
+	sp::TimerWheel wheel(1);
+	std::atomic<int> fired {0};
+	std::vector<sp::TimerWheel::Handle> handles;
+	for (int i = 0; i < 1000; ++i) {
+		handles.push_back(wheel.Schedule(i % 2 ? 20 : 50, [&fired] { ++fired; return sp::duration(0); }));
+	}
+	for (size_t i = 0; i < handles.size(); i += 2) {
+		wheel.Cancel(handles[i]);
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	if (fired != 500 or wheel.Size() != 0) {
+		return 4;
+	}
+	// A callback may cancel its own timer, which then neither rearms nor goes away under it
+	sp::TimerWheel::Handle self;
+	std::atomic<int> ran {0};
+	std::string alive(100, 'x');
+	self = wheel.Schedule(10, [&wheel, &self, &ran, alive] {
+		wheel.Cancel(self);
+		ran += alive.size() == 100;
+		return sp::duration(10);
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	// its node is free again
+	wheel.Schedule(10, [&ran] { ++ran; return sp::duration(0); });
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	if (ran != 2 or self.IsValid() or wheel.Size() != 0) {
+		return 5;
+	}
+	return 0;
+#endif
+}
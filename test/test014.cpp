@@ -0,0 +1,44 @@
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	// Dropping a running child returns at once; the reaper collects it later
+	pid_t pid;
+	auto start = sp::clock::now();
+	{
+		auto p = sp::Popen().Command("sleep 0.5").Start()();
+		pid = p.Pid();
+	}
+	if (sp::clock::now() - start > std::chrono::milliseconds(300)) {
+		return 1;
+	}
+	// Detached children keep running and are reaped in the background too
+	auto d = sp::Popen().Command("sleep 0.5").Start()();
+	d.Detach();
+	if (not d.Detached() or d.Wait() != -1 or d.Poll() != -1) {
+		return 2;
+	}
+	// The old blocking behavior is still available
+	start = sp::clock::now();
+	{
+		auto p = sp::Popen().Command("sleep 0.2").ReapInBackground(false).Start()();
+	}
+	if (sp::clock::now() - start < std::chrono::milliseconds(200)) {
+		return 3;
+	}
+	auto end = sp::clock::now() + std::chrono::seconds(5);
+	while (sp::Reaper::Default().Pending() != 0 and sp::clock::now() < end) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	// No zombie is left behind
+	if (sp::Reaper::Default().Reaped() != 2 or waitpid(pid, nullptr, WNOHANG) != -1 or errno != ECHILD) {
+		return 4;
+	}
+	return 0;
+#endif
+}
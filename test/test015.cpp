@@ -0,0 +1,31 @@
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	auto p = sp::Popen().Command("cmd /c echo start& ping -n 2 127.0.0.1 >nul& echo end").StdOut(sp::PIPE).Start()();
+#else
+	auto p = sp::Popen().Command("sh -c 'echo start; sleep 0.3; echo end'").StdOut(sp::PIPE).Start()();
+#endif
+	auto r = p.Communicate();
+	const auto& s = r.stats;
+	// The first and the last line are separated by the child's sleep
+	if (s.output.bytes != r.output.size() or s.output.last_byte - s.output.first_byte < std::chrono::milliseconds(200)) {
+		return 1;
+	}
+	if (s.spawned > s.output.first_byte or s.output.last_byte > s.exited) {
+		return 2;
+	}
+#ifndef _WIN32
+	if (s.max_rss_kb <= 0 or s.voluntary_switches <= 0 or s.error.bytes != 0) {
+		return 3;
+	}
+#endif
+	// The same figures are kept on the handle
+	if (p.Stats().exited != s.exited or p.Stats().output.bytes != s.output.bytes) {
+		return 4;
+	}
+	return 0;
+}
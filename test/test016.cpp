@@ -0,0 +1,35 @@
+#define SUBPROCESS_PROFILE_SPAWN
+#include <sstream>
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+	for (int i = 0; i < 10; ++i) {
+#ifdef _WIN32
+		auto p = sp::Popen().Command("cmd /c echo Hello world!").StdOut(sp::PIPE).Start()();
+#else
+		auto p = sp::Popen().Command("sh -c 'echo Hello world!'").StdOut(sp::PIPE).Start()();
+#endif
+		p.Communicate();
+		// Every Start() phase has been measured on the handle
+		if (p.Profile().phases[sp::pSpawn].count() <= 0 or p.Profile().phases[sp::pReceive].count() <= 0) {
+			return 1;
+		}
+	}
+	auto spawn = sp::SpawnMetrics::Global().Snapshot(sp::pSpawn);
+	uint64_t total = 0;
+	for (auto n : spawn.histogram) {
+		total += n;
+	}
+	if (spawn.count != 10 or total != 10 or spawn.sum_ns == 0) {
+		return 2;
+	}
+	std::ostringstream os;
+	sp::SpawnMetrics::Global().Dump(os);
+	if (os.str().find("subprocess_spawn_phase_ns_count{phase=\"spawn\"} 10\n") == std::string::npos) {
+		return 3;
+	}
+	return 0;
+}
@@ -0,0 +1,46 @@
+#define SUBPROCESS_OBSERVER subprocess::RuntimeObserver
+#include "subprocess.h"
+namespace sp = subprocess;
+
+struct Counter : sp::Observer
+{
+	int spawns = 0, first_outputs = 0, eofs = 0, exits = 0, timeouts = 0, kills = 0;
+	size_t bytes = 0;
+
+	void OnSpawn(long, const std::vector<std::string>&) override { ++spawns; }
+	void OnFirstOutput(long, int) override { ++first_outputs; }
+	void OnEof(long, int, size_t n) override { ++eofs; bytes += n; }
+	void OnExit(long, sp::retcode, const sp::ProcessStats&) override { ++exits; }
+	void OnTimeout(long, sp::duration) override { ++timeouts; }
+	void OnKill(long, int) override { ++kills; }
+};
+
+int
+main(int argc, char *argv[])
+{
+	Counter c;
+	sp::RuntimeObserver::Register(&c);
+#ifdef _WIN32
+	sp::Popen().Command("cmd /c echo hi").StdOut(sp::PIPE).Communicate();
+	sp::Popen p;
+	p.Command("ping -n 10 127.0.0.1").StdOut(sp::DEVNUL);
+#else
+	sp::Popen().Command("sh -c 'echo hi'").StdOut(sp::PIPE).Communicate();
+	sp::Popen p;
+	p.Command("sleep 10");
+#endif
+	try {
+		p.Wait(50);
+		return 1;
+	} catch (const sp::TimeoutExpired&) {
+		p.Kill();
+	}
+	p.Wait();
+	sp::RuntimeObserver::Unregister(&c);
+	// Unregistered observers are not called anymore
+	sp::Popen().Command("sh -c 'echo hi'").Wait();
+	if (c.spawns != 2 or c.first_outputs != 1 or c.eofs != 1 or c.bytes == 0 or c.exits != 2 or c.timeouts != 1 or c.kills != 1) {
+		return 2;
+	}
+	return 0;
+}
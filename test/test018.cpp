@@ -0,0 +1,44 @@
+#include "allocations.h"
+#include "subprocess.h"
+namespace sp = subprocess;
+
+// Allocations done by Start() and Wait(), the handle itself included
+long
+spawn(sp::Popen& p)
+{
+	long before = allocations;
+	p.Start();
+	p.Wait();
+	return allocations - before;
+}
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	// The only allocation left is the Popen_impl behind the handle; fail if that grows
+	const long budget = 1;
+	{
+		// warm up the lazily created statics
+		sp::Popen p;
+		p.Arguments({"true"}).StdErr(sp::DEVNUL);
+		spawn(p);
+	}
+	sp::Popen p1;
+	p1.Arguments({"true", "a", "b"});
+	sp::Popen p2;
+	p2.Command("true 'a b' c d e f g h i j k l m n o p");
+	sp::Popen p3;
+	p3.Arguments({"true"}).Environment({"A=1", "B=2"});
+	sp::Popen p4;
+	p4.Arguments({"true"}).StdOut(sp::PIPE).StdErr(sp::DEVNUL).CloseFileDescriptors(false).RestoreSignals(false);
+	for (auto p : {&p1, &p2, &p3, &p4}) {
+		if (spawn(*p) > budget) {
+			return 1;
+		}
+	}
+	return 0;
+#endif
+}
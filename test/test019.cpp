@@ -0,0 +1,51 @@
+#include <cstring>
+#if __has_include(<memory_resource>)
+#   include <memory_resource>
+#endif
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	const char* hello = "cmd /c echo Hello world!";
+	const char* fail = "cmd /c echo Hello world!& exit 1";
+#else
+	const char* hello = "sh -c 'echo Hello world!'";
+	const char* fail = "sh -c 'echo Hello world!; exit 1'";
+#endif
+	// Capture straight into the caller's type
+	auto r1 = sp::Popen().Command(hello).StdOut(sp::PIPE).Communicate<std::string>();
+	if (r1.output.rfind("Hello world!", 0) != 0 or r1.stats.output.bytes != r1.output.size()) {
+		return 1;
+	}
+	auto r2 = sp::Popen().Command(hello).StdOut(sp::PIPE).Communicate<std::vector<char>>();
+	if (r2.output.size() < 12 or memcmp(r2.output.data(), "Hello world!", 12) != 0) {
+		return 2;
+	}
+	std::string out = sp::check_output<std::string>(hello);
+	if (out != r1.output) {
+		return 3;
+	}
+	// The outputs of a failed command still reach the exception
+	try {
+		sp::check_output<std::string>(fail);
+		return 4;
+	} catch (const sp::CalledProcessError& e) {
+		if (e.output.string() != out) {
+			return 5;
+		}
+	}
+#if __has_include(<memory_resource>) && defined(__cpp_lib_memory_resource)
+	// Capture into a caller's arena, appending to what is already there
+	char storage[32768];
+	std::pmr::monotonic_buffer_resource arena(storage, sizeof storage, std::pmr::null_memory_resource());
+	std::pmr::string output("> ", &arena), error(&arena);
+	sp::Popen().Command(hello).StdOut(sp::PIPE).CommunicateInto(output, error);
+	if (output.rfind("> Hello world!", 0) != 0 or not error.empty()) {
+		return 6;
+	}
+#endif
+	return 0;
+}
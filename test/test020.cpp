@@ -0,0 +1,97 @@
+#include "allocations.h"
+#include <cstring>
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	const char* both = "echo 0123456789; echo abc >&2";
+	{
+		// warm up the lazily created statics
+		char out[64], err[64];
+		sp::FixedBuffer o(out), e(err);
+		sp::Popen().Arguments({"sh", "-c", both}).StdOut(sp::PIPE).StdErr(sp::PIPE).Communicate(o, e);
+	}
+	// Everything fits: no allocation besides the Popen_impl behind the handle
+	char out[64], err[64];
+	sp::FixedBuffer o(out), e(err);
+	sp::Popen p;
+	p.Arguments({"sh", "-c", both}).StdOut(sp::PIPE).StdErr(sp::PIPE);
+	long before = allocations;
+	auto n = p.Communicate(o, e);
+	if (allocations - before > 1) {
+		return 1;
+	}
+	if (n.first != 11 or n.second != 4 or memcmp(out, "0123456789\n", 11) != 0 or memcmp(err, "abc\n", 4) != 0) {
+		return 2;
+	}
+	// Truncate keeps the head and counts the rest
+	char small[4];
+	sp::FixedBuffer t(small), none(nullptr, 0);
+	n = sp::Popen().Arguments({"sh", "-c", both}).StdOut(sp::PIPE).StdErr(sp::PIPE).Communicate(t, none);
+	if (n.first != 4 or t.overflowed != 7 or memcmp(small, "0123", 4) != 0 or n.second != 0 or none.overflowed != 4) {
+		return 3;
+	}
+	// Spill keeps the rest on the heap
+	sp::FixedBuffer s(small, sp::oSpill), s2(err);
+	sp::Popen().Arguments({"sh", "-c", both}).StdOut(sp::PIPE).StdErr(sp::PIPE).Communicate(s, s2);
+	if (s.size != 4 or s.spill.string() != "456789\n") {
+		return 4;
+	}
+	// Fail kills a child that keeps writing instead of blocking forever
+	sp::FixedBuffer f(small, sp::oFail), f2(err);
+	try {
+		sp::Popen().Arguments({"yes"}).StdOut(sp::PIPE).StdErr(sp::PIPE).Communicate(f, f2, {}, 5000);
+		return 5;
+	} catch (const sp::OutputOverflow& e) {
+		if (e.output.string() != "y\ny\n") {
+			return 6;
+		}
+	}
+	// check_output() flavor, stderr goes to the second buffer
+	sp::FixedBuffer c(out), c2(err);
+	n = sp::check_output({"sh", "-c", both}, c, c2, 5000);
+	if (n.first != 11 or n.second != 4) {
+		return 7;
+	}
+	try {
+		sp::FixedBuffer c3(out), c4(err);
+		sp::check_output({"sh", "-c", "echo x; exit 3"}, c3, c4);
+		return 8;
+	} catch (const sp::CalledProcessError& e) {
+		if (e.returncode != 3 or e.output.string() != "x\n") {
+			return 9;
+		}
+	}
+	// The input is written while the outputs are drained
+	std::string input(1 << 20, 'x');
+	char big[16];
+	sp::FixedBuffer w(big), w2(err);
+	n = sp::Popen().Arguments({"sh", "-c", "wc -c"}).StdIn(sp::PIPE).StdOut(sp::PIPE).StdErr(sp::PIPE).Communicate(w, w2, input);
+	if (std::string(big, n.first).find("1048576") == std::string::npos) {
+		return 10;
+	}
+	// A child closing its stdin early ends the input, even with errno left at EINTR by a signal
+	struct sigaction action {};
+	action.sa_handler = [](int) {};
+	sigaction(SIGALRM, &action, nullptr);
+	struct itimerval every {{0, 1000}, {0, 1000}};
+	setitimer(ITIMER_REAL, &every, nullptr);
+	try {
+		sp::FixedBuffer q(big), q2(err);
+		sp::Popen().Arguments({"sh", "-c", "exec sleep 0.3"}).StdIn(sp::PIPE).StdOut(sp::PIPE).StdErr(sp::PIPE).Communicate(q, q2, input, 5000);
+	} catch (const sp::TimeoutExpired&) {
+		return 11;
+	}
+	every = {};
+	setitimer(ITIMER_REAL, &every, nullptr);
+	return 0;
+#endif
+}
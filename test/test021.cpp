@@ -0,0 +1,70 @@
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	sp::ProcessSet set;
+	set.Reserve(64);
+	std::vector<sp::ProcessSet::Id> failing;
+	for (int i = 0; i < 60; ++i) {
+		auto id = set.Add(sp::Popen().Command(i % 10 == 0 ? "sh -c 'exit 3'" : "true"));
+		if (i % 10 == 0) {
+			failing.push_back(id);
+		}
+	}
+	if (set.Size() != 60 or set.Running() != 60) {
+		return 1;
+	}
+	auto end = sp::clock::now() + std::chrono::seconds(5);
+	while (set.Running() > 0 and sp::clock::now() < end) {
+		set.PollAll(100);
+	}
+	if (set.Running() != 0) {
+		return 2;
+	}
+	size_t failed = 0;
+	auto collected = set.CollectFinished([&](sp::ProcessSet::Id id, sp::retcode code, const std::vector<std::string>& args) {
+		bool expected = std::find(failing.begin(), failing.end(), id) != failing.end();
+		if ((code == 3) != expected or args.empty()) {
+			failed = 1000;
+		}
+		failed += code != 0;
+	});
+	if (collected != 60 or failed != failing.size() or set.Size() != 0) {
+		return 3;
+	}
+	// Bulk signal, and collection keeps the children still running
+	for (int i = 0; i < 10; ++i) {
+		set.Add(sp::Popen().Arguments({"sleep", "10"}));
+	}
+	set.Add(sp::Popen().Arguments({"true"}));
+	set.PollAll(2000);
+	if (set.CollectFinished() != 1 or set.Running() != 10) {
+		return 4;
+	}
+	if (set.SignalAll(SIGTERM) != 10) {
+		return 5;
+	}
+	while (set.Running() > 0 and set.PollAll(sp::INFINITE_TIME) > 0) {
+	}
+	set.CollectFinished([&](sp::ProcessSet::Id, sp::retcode code, const std::vector<std::string>&) {
+		failed += code != SIGTERM;
+	});
+	if (failed != failing.size() or set.Size() != 0) {
+		return 6;
+	}
+	// A process that was already waited for cannot be handed over
+	try {
+		sp::Popen p;
+		p.Arguments({"true"}).Wait();
+		set.Add(p);
+		return 7;
+	} catch (const sp::Exception&) {
+	}
+	return 0;
+#endif
+}
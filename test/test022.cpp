@@ -0,0 +1,96 @@
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	const char* fail = "cmd /c echo Hello world!& exit 1";
+	const char* slow = "ping -n 3 127.0.0.1";
+#else
+	const char* fail = "sh -c 'echo Hello world!; exit 1'";
+	const char* slow = "sleep 2";
+#endif
+	// A non-zero return code is a result, not an error
+	auto r1 = sp::run<std::string>(sp::Popen().Command(fail).StdOut(sp::PIPE));
+	if (not r1 or r1->returncode != 1 or r1->output.rfind("Hello world!", 0) != 0) {
+		return 1;
+	}
+	// Errors come back instead of being thrown
+	auto r2 = sp::run(sp::Popen().Arguments({"/nonexistent/command"}));
+	if (r2 or r2.Error().code != sp::Error::eOSError or r2.Error().message.empty()) {
+		return 2;
+	}
+	// A child that never started is not signaled, with or without a timeout
+	auto r2b = sp::run(sp::Popen().Arguments({"/nonexistent/command"}).StdOut(sp::PIPE));
+	auto r2c = sp::run(sp::Popen().Arguments({"/nonexistent/command"}).StdOut(sp::PIPE), {}, 1000);
+	if (r2b or r2b.Error().code != sp::Error::eOSError or r2c or r2c.Error().code != sp::Error::eOSError) {
+		return 2;
+	}
+	auto r3 = sp::run(sp::Popen().Command(slow).StdOut(sp::PIPE), {}, 100);
+	if (r3 or r3.Error().code != sp::Error::eTimeout) {
+		return 3;
+	}
+	// TryPoll() and TryWait()
+	sp::Popen p;
+	p.Command(slow);
+	auto c1 = p.TryPoll();
+	if (c1 or c1.Error().code != sp::Error::eStillActive) {
+		return 4;
+	}
+	auto c2 = p.TryWait(50);
+	if (c2 or c2.Error().code != sp::Error::eTimeout) {
+		return 5;
+	}
+	p.Kill();
+	if (not p.TryWait()) {
+		return 6;
+	}
+	auto c3 = sp::Popen().Command(fail).StdOut(sp::DEVNUL).TryWait();
+	if (not c3 or c3.Value() != 1) {
+		return 7;
+	}
+	// The exception owns its arguments and its message
+	try {
+		sp::check_output(fail);
+		return 8;
+	} catch (const sp::CalledProcessError& e) {
+		if (e.args.size() != 1 or e.args[0] != fail) {
+			return 9;
+		}
+		if (e.what() != e.what() or strstr(e.what(), "Return code: 1") == nullptr) {
+			return 10;
+		}
+	}
+#ifndef _WIN32
+	// A timeout reports the output captured so far
+	try {
+		sp::check_output("sh -c 'echo partial; exec sleep 5'", 300);
+		return 12;
+	} catch (const sp::TimeoutExpired& e) {
+		if (e.output.string() != "partial\n") {
+			return 13;
+		}
+	}
+#endif
+	// what() may be asked from several threads at once, all getting the same message
+	try {
+		sp::check_output(fail);
+	} catch (const sp::CalledProcessError& e) {
+		std::vector<const char*> seen(8);
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < seen.size(); ++i) {
+			threads.emplace_back([&e, &seen, i] { seen[i] = e.what(); });
+		}
+		for (auto& t : threads) {
+			t.join();
+		}
+		if (std::count(seen.begin(), seen.end(), seen[0]) != 8 or seen[0] != e.what()) {
+			return 11;
+		}
+	}
+	return 0;
+}
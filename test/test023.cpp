@@ -0,0 +1,55 @@
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	const char* noisy = "echo START; yes | head -n 100000; echo END";
+	// Keep the head and the tail, count the rest
+	auto r1 = sp::Popen().Arguments({"sh", "-c", noisy}).StdOut(sp::PIPE).StdOutLimit({6, 4}).Communicate<std::string>();
+	if (r1.output != "START\nEND\n" or r1.stats.output.bytes != 200010 or r1.stats.output.dropped != 200000) {
+		return 1;
+	}
+	// A tail shorter than what was dropped, and no tail at all
+	auto r2 = sp::Popen().Arguments({"sh", "-c", noisy}).StdOut(sp::PIPE).StdOutLimit({0, 6}).Communicate<std::string>();
+	if (r2.output != "y\nEND\n") {
+		return 2;
+	}
+	// A small tail across chunk boundaries, over a large stream
+	auto r2b = sp::Popen().Arguments({"seq", "1", "2000000"}).StdOut(sp::PIPE).StdOutLimit({0, 13}).Communicate<std::string>();
+	if (r2b.output != "9999\n2000000\n" or r2b.stats.output.dropped != r2b.stats.output.bytes - 13) {
+		return 2;
+	}
+	auto r3 = sp::Popen().Arguments({"sh", "-c", noisy}).StdOut(sp::PIPE).StdOutLimit(8).Communicate();
+	if (r3.output.string() != "START\ny\n" or r3.stats.output.dropped != 200002) {
+		return 3;
+	}
+	// Unbounded output gets the child killed instead of drained
+	auto r4 = sp::Popen().Arguments({"yes"}).StdOut(sp::PIPE).StdOutLimit({10, 10, sp::CaptureLimit::aKill}).Communicate<std::string>({}, 5000);
+	if (r4.output.size() != 20 or r4.output.compare(0, 10, "y\ny\ny\ny\ny\n") != 0 or r4.stats.output.dropped == 0) {
+		return 4;
+	}
+	// Error reports carry the head and the tail
+	try {
+		sp::Popen p;
+		p.Arguments({"sh", "-c", "echo oops; yes | head -n 10000 >&2; echo tail >&2; exit 2"})
+			.StdOut(sp::PIPE).StdErr(sp::PIPE).StdErrLimit({5, 5});
+		sp::check_output(p, 5000);
+		return 5;
+	} catch (const sp::CalledProcessError& e) {
+		if (e.returncode != 2 or e.output.string() != "oops\n" or e.error.string() != "y\ny\nytail\n") {
+			return 6;
+		}
+	}
+	// The caller's Popen is run in place, not moved from
+	sp::Popen p;
+	p.Arguments({"sh", "-c", "echo kept"}).StdOut(sp::PIPE);
+	if (sp::check_output<std::string>(p) != "kept\n" or p.Pid() <= 0 or p.ReturnCode() != 0) {
+		return 7;
+	}
+	return 0;
+#endif
+}
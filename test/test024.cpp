@@ -0,0 +1,76 @@
+#include <cstdlib>
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	setenv("SUBPROCESS_TEST_KEPT", "kept", 1);
+	setenv("SUBPROCESS_TEST_GONE", "gone", 1);
+	// Without Environment(), the child inherits the parent's environment
+	auto r1 = sp::Popen().Command("sh -c 'echo $SUBPROCESS_TEST_KEPT'").StdOut(sp::PIPE).Communicate<std::string>();
+	if (r1.output != "kept\n") {
+		return 1;
+	}
+	// Parent environment plus a delta
+	auto env = sp::Environ().Set("SUBPROCESS_TEST_NEW", "new").Set("SUBPROCESS_TEST_KEPT", "changed").Unset("SUBPROCESS_TEST_GONE");
+	auto r2 = sp::Popen().Command("sh -c 'echo $SUBPROCESS_TEST_KEPT $SUBPROCESS_TEST_NEW ${SUBPROCESS_TEST_GONE-unset} $HOME'")
+		.Environment(env).StdOut(sp::PIPE).Communicate<std::string>();
+	if (r2.output != std::string("changed new unset ") + getenv("HOME") + "\n") {
+		return 2;
+	}
+	// Identical environments share one block
+	auto same = sp::Environ().Unset("SUBPROCESS_TEST_GONE").Set("SUBPROCESS_TEST_KEPT", "x").Set("SUBPROCESS_TEST_NEW", "new").Set("SUBPROCESS_TEST_KEPT", "changed");
+	if (same.Block() != env.Block() or env.Block()->Get("SUBPROCESS_TEST_GONE") != nullptr) {
+		return 3;
+	}
+	if (sp::Environ().Block() != sp::Environ().Block() or sp::Environ().Set("A", "1").Block() == env.Block()) {
+		return 4;
+	}
+	// The snapshot is taken once, until refreshed
+	setenv("SUBPROCESS_TEST_LATE", "late", 1);
+	if (sp::Environ().Block()->Get("SUBPROCESS_TEST_LATE") != nullptr) {
+		return 5;
+	}
+	sp::Environ::Refresh();
+	if (std::string(sp::Environ().Block()->Get("SUBPROCESS_TEST_LATE")) != "late") {
+		return 6;
+	}
+	// An empty base
+	auto r3 = sp::Popen().Arguments({"/usr/bin/env"}).Environment(sp::Environ::Empty().Set("ONLY", "1"))
+		.StdOut(sp::PIPE).Communicate<std::string>();
+	if (r3.output != "ONLY=1\n") {
+		return 7;
+	}
+	// The fork() path (with a working directory) uses the same block
+	auto r4 = sp::Popen().Command("sh -c 'echo $SUBPROCESS_TEST_NEW'").Directory("/").Environment(env)
+		.StdOut(sp::PIPE).Communicate<std::string>();
+	if (r4.output != "new\n") {
+		return 8;
+	}
+	// One const Environ shared by concurrent spawns
+	const auto shared = sp::Environ().Set("SUBPROCESS_TEST_SHARED", "shared");
+	std::vector<std::shared_ptr<const sp::EnvBlock>> blocks(4);
+	std::vector<std::string> outputs(4);
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		threads.emplace_back([&shared, &blocks, &outputs, i] {
+			blocks[i] = shared.Block();
+			outputs[i] = sp::Popen().Command("sh -c 'echo $SUBPROCESS_TEST_SHARED'").Environment(shared)
+				.StdOut(sp::PIPE).Communicate<std::string>().output;
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		if (blocks[i] != blocks[0] or outputs[i] != "shared\n") {
+			return 9;
+		}
+	}
+	return 0;
+#endif
+}
@@ -0,0 +1,76 @@
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	auto& budget = sp::FdBudget::Default();
+	// warm up /dev/null, held for good
+	sp::Popen().Arguments({"true"}).StdErr(sp::DEVNUL).Wait();
+	auto base = budget.Snapshot();
+	if (base.fds != 1 or base.children != 0 or base.limit == 0) {
+		return 1;
+	}
+	// Pipe ends are counted while alive (the child's ones are closed by Start()), children until reaped
+	{
+		sp::Popen p;
+		p.Arguments({"sh", "-c", "read x"}).StdIn(sp::PIPE).StdOut(sp::PIPE).Start();
+		auto c = budget.Snapshot();
+		if (c.fds != 3 or c.children != 1) {
+			return 2;
+		}
+		p.Communicate();
+		if (budget.Snapshot().children != 0) {
+			return 3;
+		}
+	}
+	if (budget.Snapshot().fds != 1) {
+		return 4;
+	}
+	// Room for exactly one pipe
+	size_t system = budget.Fraction(1).Headroom(0).Limit();
+	budget.Headroom(system - 3);
+	if (budget.Limit() != 3) {
+		return 5;
+	}
+	budget.FailFast(true);
+	{
+		sp::Pipe::Receiver reader;
+		sp::Pipe::Sender held;
+		sp::Pipe::Open(reader, held);
+		try {
+			sp::Popen().Arguments({"true"}).StdOut(sp::PIPE).Start();
+			return 6;
+		} catch (const sp::OSError&) {
+		}
+		if (budget.Snapshot().rejected != 1 or budget.Snapshot().fds != 3) {
+			return 7;
+		}
+	}
+	// Waiting admission goes through once the held pipe is released
+	budget.FailFast(false);
+	{
+		auto reader = std::unique_ptr<sp::Pipe::Receiver>(new sp::Pipe::Receiver);
+		auto held = std::unique_ptr<sp::Pipe::Sender>(new sp::Pipe::Sender);
+		sp::Pipe::Open(*reader, *held);
+		std::thread releaser([&reader, &held] {
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			reader.reset();
+			held.reset();
+		});
+		auto r = sp::Popen().Arguments({"echo", "admitted"}).StdOut(sp::PIPE).Communicate();
+		releaser.join();
+		if (r.output.string() != "admitted\n" or budget.Snapshot().waited != 1) {
+			return 8;
+		}
+	}
+	budget.Fraction(0.9).Headroom(16);
+	if (budget.Snapshot().fds != 1 or budget.Snapshot().waiting != 0) {
+		return 9;
+	}
+	return 0;
+#endif
+}
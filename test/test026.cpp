@@ -0,0 +1,75 @@
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	auto& budget = sp::FdBudget::Default();
+	auto before = budget.Snapshot().fds;
+	// Queued work holds no descriptor until started
+	std::vector<sp::Popen> queue(1000);
+	for (auto& p : queue) {
+		p.Arguments({"sh", "-c", "cat; echo err >&2"}).StdIn(sp::PIPE).StdOut(sp::PIPE).StdErr(sp::PIPE);
+	}
+	if (budget.Snapshot().fds != before) {
+		return 1;
+	}
+	auto r = queue[0].Communicate(std::string("out\n"));
+	if (r.output.string() != "out\n" or r.error.string() != "err\n") {
+		return 2;
+	}
+	// Moving a prepared Popen keeps its deferred streams
+	sp::Popen moved = std::move(queue[1]);
+	if (moved.Communicate(std::string("x")).output.string() != "x") {
+		return 3;
+	}
+	// /dev/null is opened once, and counted once, by concurrent first users
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 16; ++i) {
+		threads.emplace_back([] { sp::Popen().Arguments({"true"}).StdIn(sp::DEVNUL).Wait(); });
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	if (budget.Snapshot().fds != before + 1) {
+		return 7;
+	}
+	// DEVNUL, and stderr sent to a deferred stdout pipe
+	auto r2 = sp::Popen().Arguments({"sh", "-c", "echo a; echo b >&2"}).StdIn(sp::DEVNUL).StdOut(sp::PIPE).StdErr(sp::STDOUT).Communicate();
+	if (r2.output.string() != "a\nb\n") {
+		return 4;
+	}
+	auto r3 = sp::Popen().Arguments({"sh", "-c", "echo a; echo b >&2"}).StdOut(sp::DEVNUL).StdErr(sp::PIPE).Communicate();
+	if (r3.output.string() != "" or r3.error.string() != "b\n") {
+		return 5;
+	}
+	queue.clear();
+	if (budget.Snapshot().fds > before + 1) {
+		return 6;
+	}
+	// A spawn is admitted whole: concurrent ones never each hold a part of what they need
+	size_t system = budget.Fraction(1).Headroom(0).Limit();
+	budget.Headroom(system - 32);
+	threads.clear();
+	std::atomic<int> echoed {0};
+	for (int i = 0; i < 16; ++i) {
+		threads.emplace_back([&echoed] {
+			for (int j = 0; j < 20; ++j) {
+				auto r = sp::Popen().Arguments({"cat"}).StdIn(sp::PIPE).StdOut(sp::PIPE).StdErr(sp::PIPE).Communicate(std::string("x"));
+				echoed += r.output.string() == "x";
+			}
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	budget.Fraction(0.9).Headroom(16);
+	if (echoed != 16 * 20 or budget.Snapshot().fds != before + 1) {
+		return 8;
+	}
+	return 0;
+#endif
+}
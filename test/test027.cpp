@@ -0,0 +1,69 @@
+#include <cstring>
+#include "subprocess.h"
+namespace sp = subprocess;
+
+#ifndef _WIN32
+// Child mode: report the descriptors inherited beyond stdin, stdout and stderr
+int
+count_fds()
+{
+	int n = 0;
+	for (int fd = STDERR_FILENO + 1; fd < 1024; ++fd) {
+		n += fcntl(fd, F_GETFD) != -1;
+	}
+	printf("%d\n", n);
+	return 0;
+}
+#endif
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	if (argc > 1 and strcmp(argv[1], "fds") == 0) {
+		return count_fds();
+	}
+	// Without close_fds, no child may see the pipes of its siblings
+	const int threads = 32, spawns = 8;
+	std::atomic<int> leaked {0}, failed {0};
+	std::vector<std::thread> pool;
+	for (int t = 0; t < threads; ++t) {
+		pool.emplace_back([&, t] {
+			for (int i = 0; i < spawns; ++i) {
+				sp::Popen p;
+				p.Arguments({argv[0], "fds"}).StdIn(sp::PIPE).StdOut(sp::PIPE).StdErr(sp::PIPE).CloseFileDescriptors(false);
+				if (t % 2 == 1) {
+					// the fork() path
+					p.Directory(".");
+				}
+				auto r = p.Communicate<std::string>();
+				if (r.output.empty()) {
+					++failed;
+				} else if (r.output != "0\n") {
+					++leaked;
+				}
+			}
+		});
+	}
+	for (auto& t : pool) {
+		t.join();
+	}
+	if (failed != 0) {
+		return 1;
+	}
+	if (leaked != 0) {
+		return 2;
+	}
+	// A descriptor handed to the child keeps its flags in the parent
+	int fd = open("/dev/null", O_WRONLY);
+	int flags = fcntl(fd, F_GETFD);
+	sp::Popen().Arguments({"true"}).StdOut(fd).CloseFileDescriptors(false).Wait();
+	if (fcntl(fd, F_GETFD) != flags) {
+		return 3;
+	}
+	close(fd);
+	return 0;
+#endif
+}
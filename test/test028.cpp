@@ -0,0 +1,54 @@
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	// Input through the first stage, output from the last one
+	auto r1 = (sp::Popen().Arguments({"tr", "a-z", "A-Z"}).StdIn(sp::PIPE)
+		| sp::Popen().Arguments({"sort"})
+		| sp::Popen().Arguments({"uniq", "-c"}).StdOut(sp::PIPE)).Communicate<std::string>(sp::Bytes("b\na\nb\n"));
+	if (r1.returncode != 0 or r1.returncodes.size() != 3 or r1.output != "      1 A\n      2 B\n") {
+		return 1;
+	}
+	// Stages overlap: the consumer stops early and the producer gets SIGPIPE
+	sp::Popen yes, head;
+	yes.Arguments({"yes"});
+	head.Arguments({"head", "-n", "3"}).StdOut(sp::PIPE);
+	sp::Pipeline p1{yes, head};
+	auto r2 = p1.Communicate<std::string>();
+	if (r2.output != "y\ny\ny\n" or p1.ReturnCodes()[0] != SIGPIPE or r2.returncode != SIGPIPE) {
+		return 2;
+	}
+	// pipefail reports the last failing stage
+	sp::Pipeline p2 = sp::Popen().Command("sh -c 'exit 3'") | sp::Popen().Command("sh -c 'exit 4'") | sp::Popen().Arguments({"cat"});
+	if (p2.Wait() != 4 or p2.ReturnCodes() != std::vector<sp::retcode>{3, 4, 0}) {
+		return 3;
+	}
+	// A single stage, and the timeout
+	if (sp::Pipeline{sp::Popen().Arguments({"true"})}.Wait(5000) != 0) {
+		return 4;
+	}
+	sp::Pipeline slow = sp::Popen().Arguments({"sleep", "5"}) | sp::Popen().Arguments({"cat"}).StdOut(sp::PIPE);
+	try {
+		slow.Communicate({}, 100);
+		return 5;
+	} catch (const sp::TimeoutExpired&) {
+		slow[0].Kill();
+	}
+	// The parent holds no end of the inner pipes once started
+	auto before = sp::FdBudget::Default().Snapshot().fds;
+	sp::Pipeline p3 = sp::Popen().Arguments({"cat"}).StdIn(sp::PIPE) | sp::Popen().Arguments({"cat"}) | sp::Popen().Arguments({"wc", "-c"}).StdOut(sp::PIPE);
+	p3.Start();
+	if (sp::FdBudget::Default().Snapshot().fds != before + 2) {
+		return 6;
+	}
+	if (p3.Communicate<std::string>(sp::Bytes(100000, 'x')).output.find("100000") == std::string::npos) {
+		return 7;
+	}
+	return 0;
+#endif
+}
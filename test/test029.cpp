@@ -0,0 +1,73 @@
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	// Keep the lines with an 'x', across chunk boundaries
+	std::string partial;
+	sp::Filter grep_x = [&partial](const sp::byte* data, size_t size, sp::FilterSink& out) {
+		partial.append(reinterpret_cast<const char*>(data), size);
+		size_t begin = 0, end;
+		while ((end = partial.find('\n', begin)) != std::string::npos) {
+			if (partial.find('x', begin) < end) {
+				out.Write(partial.data() + begin, end + 1 - begin);
+			}
+			begin = end + 1;
+		}
+		partial.erase(0, begin);
+		return true;
+	};
+	auto r1 = (sp::Popen().Arguments({"sh", "-c", "for i in $(seq 1 20000); do echo a$i; echo x$i; done"})
+		| grep_x
+		| sp::Popen().Arguments({"wc", "-l"}).StdOut(sp::PIPE)).Communicate<std::string>();
+	if (r1.returncode != 0 or r1.returncodes.size() != 3 or r1.output.find("20000") == std::string::npos) {
+		return 1;
+	}
+	// Zero-copy pass-through of 16 MiB; the filter only sees bounded chunks
+	size_t largest = 0;
+	sp::Pipeline p2{
+		sp::Popen().Arguments({"head", "-c", "16777216", "/dev/zero"}),
+		[&largest](const sp::byte* data, size_t size, sp::FilterSink& out) {
+			largest = std::max(largest, size);
+			return out.Write(data, size);
+		},
+		sp::Popen().Arguments({"wc", "-c"}).StdOut(sp::PIPE)
+	};
+	auto r2 = p2.Communicate<std::string>();
+	if (r2.output.find("16777216") == std::string::npos or largest == 0 or largest > 64 * 1024) {
+		return 2;
+	}
+	// The next stage stops reading: the filter ends with SIGPIPE, and so does the producer
+	auto r3 = (sp::Popen().Arguments({"yes"})
+		| sp::Filter([](const sp::byte* data, size_t size, sp::FilterSink& out) { return out.Write(data, size); })
+		| sp::Popen().Arguments({"head", "-n", "2"}).StdOut(sp::PIPE)).Communicate<std::string>();
+	if (r3.output != "y\ny\n" or r3.returncodes[1] != SIGPIPE or r3.returncodes[0] != SIGPIPE) {
+		return 3;
+	}
+	// The filter stops early, and throws
+	sp::Pipeline p4 = sp::Popen().Arguments({"yes"})
+		| sp::Filter([](const sp::byte*, size_t, sp::FilterSink& out) { out.Write("done\n"); return false; })
+		| sp::Popen().Arguments({"cat"}).StdOut(sp::PIPE);
+	auto r4 = p4.Communicate<std::string>();
+	if (r4.output != "done\n" or p4.ReturnCodes() != std::vector<sp::retcode>{SIGPIPE, 0, 0}) {
+		return 4;
+	}
+	auto r5 = (sp::Popen().Arguments({"echo"})
+		| sp::Filter([](const sp::byte*, size_t, sp::FilterSink&) -> bool { throw std::runtime_error("bad record"); })
+		| sp::Popen().Arguments({"cat"})).Wait();
+	if (r5 != 1) {
+		return 5;
+	}
+	// Filters are only allowed between two children
+	try {
+		sp::Pipeline(sp::Popen().Arguments({"true"}), sp::Filter([](const sp::byte*, size_t, sp::FilterSink&) { return true; })).Wait();
+		return 6;
+	} catch (const std::invalid_argument&) {
+	}
+	return 0;
+#endif
+}
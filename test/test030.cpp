@@ -0,0 +1,44 @@
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	// Every consumer gets the same 8 MiB
+	sp::FanOut f1(sp::Popen().Arguments({"head", "-c", "8388608", "/dev/urandom"}));
+	f1.Add(sp::Popen().Arguments({"cksum"}).StdOut(sp::PIPE))
+		.Add(sp::Popen().Arguments({"cksum"}).StdOut(sp::PIPE))
+		.Add(sp::Popen().Arguments({"sh", "-c", "sleep 0.2; cksum"}).StdOut(sp::PIPE));
+	auto r1 = f1.Communicate<std::string>();
+	if (r1.size() != 3 or r1[0].output.empty() or r1[0].output != r1[1].output or r1[0].output != r1[2].output) {
+		return 1;
+	}
+	if (f1.Delivered(2) != 8388608 or f1.Wait() != 0 or f1.ReturnCodes().size() != 4) {
+		return 2;
+	}
+	// A consumer exiting early does not stop the others
+	sp::FanOut f2(sp::Popen().Arguments({"head", "-c", "1000000", "/dev/zero"}));
+	f2.Add(sp::Popen().Arguments({"head", "-c", "10"}).StdOut(sp::DEVNUL))
+		.Add(sp::Popen().Arguments({"wc", "-c"}).StdOut(sp::PIPE));
+	auto r2 = f2.Communicate<std::string>();
+	if (r2[1].output.find("1000000") == std::string::npos or f2.Dropped(0)) {
+		return 3;
+	}
+	// Stalled consumers are dropped or killed, the others are still fed
+	sp::FanOut f3(sp::Popen().Arguments({"head", "-c", "4000000", "/dev/zero"}));
+	f3.Add(sp::Popen().Arguments({"sleep", "5"}), sp::FanOut::lKill, 200)
+		.Add(sp::Popen().Arguments({"sleep", "1"}), sp::FanOut::lDrop, 200)
+		.Add(sp::Popen().Arguments({"wc", "-c"}).StdOut(sp::PIPE));
+	auto r3 = f3.Communicate<std::string>();
+	if (r3[2].output.find("4000000") == std::string::npos or not f3.Dropped(0) or not f3.Dropped(1)) {
+		return 4;
+	}
+	if (r3[0].returncode != SIGKILL or f3.Delivered(0) >= 4000000) {
+		return 5;
+	}
+	return 0;
+#endif
+}
@@ -0,0 +1,102 @@
+#include <cstring>
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	// Many children writing long lines at once: every line comes out whole
+	const int shards = 50, lines = 200;
+	std::string merged;
+	sp::LineMerger m1;
+	m1.Tag(true).Output(merged);
+	for (int i = 0; i < shards; ++i) {
+		auto script = "for i in $(seq 1 " + std::to_string(lines) + "); do echo " + std::string(300, 'a' + i % 26) + "; done; echo oops >&2";
+		m1.Add(sp::Popen().Arguments({"sh", "-c", script}));
+	}
+	if (m1.Run() != 0) {
+		return 1;
+	}
+	size_t count = 0, errors = 0, begin = 0, end;
+	while ((end = merged.find('\n', begin)) != std::string::npos) {
+		std::string line = merged.substr(begin, end - begin);
+		begin = end + 1;
+		auto tag = line.find("] ");
+		if (line[0] != '[' or tag == std::string::npos) {
+			return 2;
+		}
+		auto id = std::stoul(line.substr(1));
+		if (tag >= 4 and line.compare(tag - 4, 4, ":err") == 0) {
+			errors += line.compare(tag + 2, std::string::npos, "oops") == 0;
+			continue;
+		}
+		if (line.compare(tag + 2, std::string::npos, std::string(300, 'a' + id % 26)) != 0) {
+			return 3;
+		}
+		++count;
+	}
+	if (count != shards * lines or errors != shards or begin != merged.size()) {
+		return 4;
+	}
+	// Callback with the source and time; an unterminated last line; pipefail-like code
+	std::vector<std::string> seen;
+	sp::LineMerger m2;
+	m2.Output([&seen](sp::LineMerger::Id id, int stream, sp::clock::time_point, const char* line, size_t size) {
+		seen.push_back(std::to_string(id) + "/" + std::to_string(stream) + ":" + std::string(line, size));
+	});
+	m2.Add(sp::Popen().Arguments({"printf", "a\\nb"}), false);
+	m2.Add(sp::Popen().Arguments({"sh", "-c", "sleep 0.2; echo c >&2; exit 3"}));
+	if (m2.Run() != 3 or seen != std::vector<std::string>{"0/1:a\n", "0/1:b\n", "1/2:c\n"}) {
+		return 5;
+	}
+	// To a file descriptor, with timestamps
+	int fd[2];
+	if (pipe(fd) != 0) {
+		return 6;
+	}
+	sp::LineMerger m3;
+	m3.Tag(false, true).Output(fd[1]);
+	m3.Add(sp::Popen().Arguments({"echo", "hello"}));
+	m3.Run();
+	close(fd[1]);
+	char out[64] = {};
+	auto n = read(fd[0], out, sizeof out - 1);
+	close(fd[0]);
+	if (n <= 0 or out[0] != '[' or strstr(out, "] hello\n") == nullptr) {
+		return 7;
+	}
+	// A line too long to hold is cut into lines of its own, never glued to another source's
+	FILE* file = tmpfile();
+	sp::LineMerger m4;
+	m4.Tag(true).Output(fileno(file));
+	m4.Add(sp::Popen().Arguments({"sh", "-c", "head -c 100000 /dev/zero | tr '\\0' a; echo"}));
+	m4.Add(sp::Popen().Arguments({"sh", "-c", "for i in $(seq 1 50); do echo second; done"}));
+	m4.Run();
+	std::string cut;
+	rewind(file);
+	while ((n = read(fileno(file), out, sizeof out)) > 0) {
+		cut.append(out, static_cast<size_t>(n));
+	}
+	fclose(file);
+	size_t as = 0, seconds = 0;
+	begin = 0;
+	while ((end = cut.find('\n', begin)) != std::string::npos) {
+		std::string line = cut.substr(begin, end - begin);
+		begin = end + 1;
+		if (line == "[1] second") {
+			++seconds;
+		} else if (line.compare(0, 4, "[0] ") == 0 and line.find_first_not_of('a', 4) == std::string::npos) {
+			as += line.size() - 4;
+		} else {
+			return 8;
+		}
+	}
+	if (as != 100000 or seconds != 50 or begin != cut.size()) {
+		return 9;
+	}
+	return 0;
+#endif
+}
@@ -0,0 +1,86 @@
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	// A shell wrapper whose grandchild holds stdout open
+	const char* wrapper = "sleep 30 & echo started; wait";
+	sp::Popen p1;
+	p1.Arguments({"sh", "-c", wrapper}).StdOut(sp::PIPE).ProcessGroup();
+	p1.Start();
+	if (p1.ProcessGroupId() != p1.Pid() or getpgid(p1.Pid()) != p1.Pid()) {
+		return 1;
+	}
+	std::thread killer([&p1] {
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		p1.KillTree();
+	});
+	auto start = sp::clock::now();
+	auto r1 = p1.Communicate<std::string>();
+	killer.join();
+	// EOF as soon as the whole tree is gone, not 30 s later
+	if (r1.output != "started\n" or p1.ReturnCode() != SIGKILL or sp::clock::now() - start > std::chrono::seconds(5)) {
+		return 2;
+	}
+	// A new session
+	sp::Popen p2;
+	p2.Arguments({"sleep", "5"}).NewSession().Start();
+	if (getsid(p2.Pid()) != p2.Pid() or getpgid(p2.Pid()) != p2.Pid()) {
+		return 3;
+	}
+	p2.TerminateTree();
+	if (p2.Wait() != SIGTERM) {
+		return 4;
+	}
+	// The fork() path, and joining an existing group
+	sp::Popen p3, p4;
+	p3.Arguments({"sleep", "5"}).Directory("/").ProcessGroup().Start();
+	p4.Arguments({"sleep", "5"}).Directory("/").ProcessGroup(p3.Pid()).Start();
+	if (getpgid(p3.Pid()) != p3.Pid() or getpgid(p4.Pid()) != p3.Pid()) {
+		return 5;
+	}
+	p3.KillTree();
+	if (p3.Wait() != SIGKILL or p4.Wait() != SIGKILL) {
+		return 6;
+	}
+	// Without a group of its own, only the child is signaled
+	sp::Popen p5;
+	p5.Arguments({"sleep", "5"}).Start();
+	if (p5.ProcessGroupId() != 0 or getpgid(p5.Pid()) != getpgrp()) {
+		return 7;
+	}
+	p5.KillTree();
+	p5.Wait();
+	// A deadline brings the whole tree down
+	auto r2 = sp::Popen().Arguments({"sh", "-c", wrapper}).StdOut(sp::PIPE).ProcessGroup()
+		.Deadline(200, {SIGKILL, 0, 0}).Communicate<std::string>();
+	if (r2.output != "started\n" or sp::clock::now() - start > std::chrono::seconds(10)) {
+		return 8;
+	}
+	// Pipelines share one group when the first stage asks for it
+	sp::Pipeline line = sp::Popen().Arguments({"sleep", "5"}).ProcessGroup() | sp::Popen().Arguments({"sleep", "5"});
+	line.Start();
+	if (getpgid(line[0].Pid()) != line[0].Pid() or getpgid(line[1].Pid()) != line[0].Pid()) {
+		return 9;
+	}
+	line.KillTree();
+	if (line.Wait() != SIGKILL or line.ReturnCodes()[0] != SIGKILL) {
+		return 10;
+	}
+	// and otherwise stay in the caller's group, e.g. to keep the terminal, each one signaled in turn
+	sp::Pipeline foreground = sp::Popen().Arguments({"sleep", "5"}) | sp::Popen().Arguments({"sleep", "5"});
+	foreground.Start();
+	if (getpgid(foreground[0].Pid()) != getpgrp() or getpgid(foreground[1].Pid()) != getpgrp()) {
+		return 11;
+	}
+	foreground.KillTree();
+	if (foreground.Wait() != SIGKILL or foreground.ReturnCodes() != std::vector<sp::retcode>{SIGKILL, SIGKILL}) {
+		return 12;
+	}
+	return 0;
+#endif
+}
@@ -0,0 +1,46 @@
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	// A background grandchild holds stdout: return shortly after the child exits
+	auto start = sp::clock::now();
+	sp::Popen p1;
+	p1.Arguments({"sh", "-c", "sleep 30 & echo started"}).StdOut(sp::PIPE).ProcessGroup().ExitGrace(100);
+	auto r1 = p1.Communicate<std::string>();
+	if (r1.output != "started\n" or p1.ReturnCode() != 0 or sp::clock::now() - start > std::chrono::seconds(5)) {
+		return 1;
+	}
+	p1.KillTree();
+	// Output written within the grace period is kept
+	auto r2 = sp::Popen().Arguments({"sh", "-c", "(sleep 0.1; echo late) & echo early"}).StdOut(sp::PIPE)
+		.ExitGrace(3000).Communicate<std::string>();
+	if (r2.output != "early\nlate\n") {
+		return 2;
+	}
+#ifdef __linux__
+	// Orphaned grandchildren come back to us and are reaped, our own children are left alone
+	if (not sp::Subreaper::Default().Enable(20)) {
+		return 0;
+	}
+	sp::Popen().Arguments({"sh", "-c", "sleep 0.1 & sleep 0.1 & exit 0"}).Wait();
+	for (int i = 0; i < 50; ++i) {
+		if (sp::Popen().Arguments({"sh", "-c", "sleep 0.01; exit 7"}).Wait() != 7) {
+			return 3;
+		}
+	}
+	auto end = sp::clock::now() + std::chrono::seconds(5);
+	while (sp::Subreaper::Default().Reaped() < 2 and sp::clock::now() < end) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	if (sp::Subreaper::Default().Reaped() != 2) {
+		return 4;
+	}
+#endif
+	return 0;
+#endif
+}
@@ -0,0 +1,73 @@
+#include <string>
+#include "subprocess.h"
+namespace sp = subprocess;
+
+template<class D>
+uint64_t
+hash(const std::string& s)
+{
+	D d;
+	d.Update(reinterpret_cast<const sp::byte*>(s.data()), s.size());
+	return d.Value();
+}
+
+int
+main(int argc, char *argv[])
+{
+	// Reference values
+	if (hash<sp::Xxh64>("") != 0xEF46DB3751D8E999ULL or hash<sp::Xxh64>("abc") != 0x44BC2CF5AD770999ULL) {
+		return 1;
+	}
+	if (hash<sp::Crc32c>("123456789") != 0xE3069283 or hash<sp::Crc32c>("") != 0) {
+		return 2;
+	}
+	// Chunking does not change the result
+	std::string text;
+	for (int i = 0; i < 1000; ++i) {
+		text += std::to_string(i * 7919) + "\n";
+	}
+	sp::Xxh64 x;
+	sp::Crc32c c;
+	for (size_t pos = 0, step = 1; pos < text.size(); pos += step, step = step % 67 + 5) {
+		auto n = std::min(step, text.size() - pos);
+		x.Update(reinterpret_cast<const sp::byte*>(text.data()) + pos, n);
+		c.Update(reinterpret_cast<const sp::byte*>(text.data()) + pos, n);
+	}
+	if (x.Value() != hash<sp::Xxh64>(text) or c.Value() != hash<sp::Crc32c>(text)) {
+		return 3;
+	}
+#ifdef _WIN32
+	return 0;
+#else
+	// Digest of the whole stream, even past what StdOutLimit() keeps
+	const char* noisy = "yes | head -n 100000";
+	std::string all(200000, 'y');
+	for (size_t i = 1; i < all.size(); i += 2) {
+		all[i] = '\n';
+	}
+	sp::Xxh64 out;
+	sp::Crc32c err;
+	auto r1 = sp::Popen().Arguments({"sh", "-c", std::string(noisy) + "; echo oops >&2"}).StdOut(sp::PIPE).StdErr(sp::PIPE)
+		.StdOutLimit(10).StdOutDigest(out).StdErrDigest(err).Communicate<std::string>();
+	if (r1.output != all.substr(0, 10) or out.Value() != hash<sp::Xxh64>(all) or err.Value() != hash<sp::Crc32c>("oops\n")) {
+		return 4;
+	}
+	// Forwarded output is digested without being kept
+	sp::Crc32c forwarded;
+	size_t seen = 0;
+	sp::Forward forward{[&seen](const sp::byte*, size_t size) { seen += size; return true; }};
+	sp::Digested<sp::Forward> sink(forward, forwarded);
+	std::string error;
+	sp::Popen().Arguments({"sh", "-c", noisy}).StdOut(sp::PIPE).CommunicateInto(sink, error);
+	if (seen != all.size() or forwarded.Value() != hash<sp::Crc32c>(all)) {
+		return 5;
+	}
+	// With a timeout too
+	sp::Xxh64 timed;
+	auto r2 = sp::Popen().Arguments({"echo", "abc"}).StdOut(sp::PIPE).StdOutDigest(timed).Communicate<std::string>({}, 5000);
+	if (r2.output != "abc\n" or timed.Value() != hash<sp::Xxh64>("abc\n")) {
+		return 6;
+	}
+	return 0;
+#endif
+}
@@ -0,0 +1,138 @@
+#include <cstdio>
+#include <fstream>
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	// Each run appends to a log, so that spawns can be counted
+	char cwd[PATH_MAX];
+	std::string log = std::string(getcwd(cwd, sizeof cwd)) + "/test035.log";
+	const char* dep = "test035.dep";
+	std::remove(log.c_str());
+	std::ofstream(dep) << "1";
+	auto counting = [log](const std::string& out) {
+		sp::Popen p;
+		p.Arguments({"sh", "-c", std::string("echo x >> ") + log + "; echo " + out + "; cat"}).StdIn(sp::PIPE).StdOut(sp::PIPE);
+		return p;
+	};
+	auto runs = [log] {
+		std::ifstream in(log);
+		return static_cast<size_t>(std::count(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>(), '\n'));
+	};
+	sp::OutputCache cache;
+	for (int i = 0; i < 3; ++i) {
+		auto p = counting("a");
+		if (cache.CheckOutput<std::string>(p, sp::Bytes(std::string("in"))) != "a\nin") {
+			return 1;
+		}
+	}
+	if (runs() != 1 or cache.Hits() != 2 or cache.Misses() != 1) {
+		return 2;
+	}
+	// A miss runs the caller's Popen in place, a hit leaves it unstarted
+	auto miss = counting("m");
+	auto hit = counting("m");
+	if (cache.CheckOutput<std::string>(miss) != "m\n" or not miss.Started() or miss.ReturnCode() != 0) {
+		return 12;
+	}
+	if (cache.CheckOutput<std::string>(hit) != "m\n" or hit.Started()) {
+		return 13;
+	}
+	// Input, environment and directory are part of the key
+	auto p1 = counting("a");
+	auto p2 = counting("a");
+	auto p3 = counting("a");
+	cache.CheckOutput<std::string>(p1, sp::Bytes(std::string("other")));
+	cache.CheckOutput<std::string>(p2.Environment(sp::Environ().Set("SUBPROCESS_TEST", "1")), sp::Bytes(std::string("in")));
+	cache.CheckOutput<std::string>(p3.Directory("/"), sp::Bytes(std::string("in")));
+	if (runs() != 5) {
+		return 3;
+	}
+	// Failures are not cached
+	for (int i = 0; i < 2; ++i) {
+		try {
+			sp::Popen p;
+			p.Arguments({"sh", "-c", std::string("echo x >> ") + log + "; exit 1"}).StdOut(sp::PIPE);
+			cache.CheckOutput(p);
+			return 4;
+		} catch (const sp::CalledProcessError&) {
+		}
+	}
+	if (runs() != 7) {
+		return 5;
+	}
+	// A changed dependency invalidates the result
+	auto depending = [&] {
+		auto p = counting("dep");
+		return cache.CheckOutput<std::string>(p, {}, std::vector<std::string>{dep});
+	};
+	depending();
+	depending();
+	if (runs() != 8) {
+		return 6;
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	std::ofstream(dep) << "22";
+	depending();
+	if (runs() != 9) {
+		return 7;
+	}
+	// TTL
+	cache.Clear();
+	cache.Ttl(100);
+	auto p4 = counting("ttl");
+	cache.CheckOutput<std::string>(p4);
+	auto p5 = counting("ttl");
+	cache.CheckOutput<std::string>(p5);
+	std::this_thread::sleep_for(std::chrono::milliseconds(150));
+	auto p6 = counting("ttl");
+	cache.CheckOutput<std::string>(p6);
+	if (runs() != 11) {
+		return 8;
+	}
+	// LRU eviction by size: "b\n" and "c\n" fit, "a\n" was the least recently used
+	cache.Clear();
+	cache.Ttl(0).MaxBytes(4);
+	for (auto out : {"a", "b", "c", "b", "a"}) {
+		auto p = counting(out);
+		cache.CheckOutput<std::string>(p);
+	}
+	if (runs() != 15 or cache.Size() != 4) {
+		return 9;
+	}
+	// The mapped store outlives the cache and is shared with a new one
+	const char* store = "test035.cache";
+	std::remove(store);
+	{
+		sp::OutputCache persistent;
+		persistent.Persist(store, 4096);
+		auto p = counting("kept");
+		persistent.CheckOutput<std::string>(p);
+	}
+	sp::OutputCache reloaded;
+	reloaded.Persist(store);
+	auto p7 = counting("kept");
+	if (reloaded.CheckOutput<std::string>(p7) != "kept\n" or reloaded.Hits() != 1 or runs() != 16) {
+		return 10;
+	}
+	// A full store starts over
+	for (int i = 0; i < 100; ++i) {
+		auto p = counting(std::string(40, 'x') + std::to_string(i));
+		reloaded.CheckOutput<std::string>(p);
+	}
+	auto p8 = counting(std::string(40, 'x') + "99");
+	sp::OutputCache third;
+	if (third.Persist(store).CheckOutput<std::string>(p8) != std::string(40, 'x') + "99\n" or third.Hits() != 1) {
+		return 11;
+	}
+	std::remove(log.c_str());
+	std::remove(dep);
+	std::remove(store);
+	return 0;
+#endif
+}
@@ -0,0 +1,153 @@
+#include <fstream>
+#include <sys/stat.h>
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	char cwd[PATH_MAX];
+	std::string dir = getcwd(cwd, sizeof cwd);
+	std::string log = dir + "/test036.log";
+	std::string fifo = dir + "/test036.fifo";
+	std::remove(log.c_str());
+	std::remove(fifo.c_str());
+	if (mkfifo(fifo.c_str(), 0600) != 0) {
+		return 100;
+	}
+	auto runs = [&log] {
+		std::ifstream in(log);
+		return static_cast<size_t>(std::count(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>(), '\n'));
+	};
+	// Children block until released, so that the flight lasts as long as the test needs
+	auto command = [&](const std::string& out, bool gated = true) {
+		std::string wait = gated ? "read go < " + fifo + "; " : "cat > /dev/null; ";
+		return std::vector<std::string>{"sh", "-c", "echo x >> " + log + "; " + wait + "echo " + out + "; exit ${CODE-0}"};
+	};
+	auto release = [&fifo] {
+		std::ofstream(fifo) << "go\n";
+	};
+	auto wait_for = [](std::function<bool()> done) {
+		auto end = sp::clock::now() + std::chrono::seconds(20);
+		while (not done() and sp::clock::now() < end) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		return done();
+	};
+	// A stampede spawns one child, and everybody shares its result
+	sp::SingleFlight flight;
+	const size_t n = 16;
+	std::vector<std::shared_ptr<const sp::Expected<sp::Result>>> results(n);
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < n; ++i) {
+		threads.emplace_back([&, i] {
+			sp::Popen p;
+			p.Arguments(command("same")).StdOut(sp::PIPE);
+			results[i] = flight.Run(p);
+		});
+	}
+	if (not wait_for([&] { return flight.Coalesced() == n - 1; })) {
+		return 1;
+	}
+	release();
+	for (auto& t : threads) {
+		t.join();
+	}
+	threads.clear();
+	if (runs() != 1) {
+		return 1;
+	}
+	for (const auto& r : results) {
+		if (r != results[0] or not *r or (*r)->output.string() != "same\n") {
+			return 2;
+		}
+	}
+	// Once landed, the next call runs again
+	std::shared_ptr<const sp::Expected<sp::Result>> next;
+	std::thread again([&] {
+		sp::Popen p;
+		p.Arguments(command("same")).StdOut(sp::PIPE);
+		next = flight.Run(p);
+	});
+	if (not wait_for([&] { return runs() == 2; })) {
+		return 3;
+	}
+	release();
+	again.join();
+	if (next == results[0]) {
+		return 3;
+	}
+	// Different input, different flight, however the two overlap
+	auto coalesced = flight.Coalesced();
+	std::shared_ptr<const std::string> a, b, c, d;
+	std::thread ta([&] {
+		sp::Popen p;
+		p.Arguments(command("a", false)).StdIn(sp::PIPE).StdOut(sp::PIPE);
+		a = flight.CheckOutput<std::string>(p, sp::Bytes(std::string("1")));
+	});
+	std::thread tb([&] {
+		sp::Popen p;
+		p.Arguments(command("a", false)).StdIn(sp::PIPE).StdOut(sp::PIPE);
+		b = flight.CheckOutput<std::string>(p, sp::Bytes(std::string("2")));
+	});
+	ta.join();
+	tb.join();
+	if (runs() != 4 or flight.Coalesced() != coalesced or a == b or *a != "a\n" or *b != "a\n") {
+		return 4;
+	}
+	// A caller-chosen key coalesces them anyway
+	flight.KeyBy([](const sp::Popen& p, const sp::Bytes&) { return sp::OutputCache::KeyOf(p, {}); });
+	std::thread tc([&] {
+		sp::Popen p;
+		p.Arguments(command("c")).StdIn(sp::PIPE).StdOut(sp::PIPE);
+		c = flight.CheckOutput<std::string>(p, sp::Bytes(std::string("1")));
+	});
+	if (not wait_for([&] { return runs() == 5; })) {
+		return 5;
+	}
+	std::thread td([&] {
+		sp::Popen p;
+		p.Arguments(command("c")).StdIn(sp::PIPE).StdOut(sp::PIPE);
+		d = flight.CheckOutput<std::string>(p, sp::Bytes(std::string("2")));
+	});
+	if (not wait_for([&] { return flight.Coalesced() == coalesced + 1; })) {
+		return 5;
+	}
+	release();
+	tc.join();
+	td.join();
+	if (runs() != 5 or c != d or *d != "c\n") {
+		return 5;
+	}
+	// A failure is thrown in every caller
+	coalesced = flight.Coalesced();
+	std::atomic<int> failed{0};
+	for (size_t i = 0; i < 4; ++i) {
+		threads.emplace_back([&] {
+			try {
+				sp::Popen p;
+				p.Arguments(command("fail")).StdOut(sp::PIPE).Environment(sp::Environ().Set("CODE", "3"));
+				flight.CheckOutput(p);
+			} catch (const sp::CalledProcessError& e) {
+				failed += e.returncode == 3 and e.output.string() == "fail\n";
+			}
+		});
+	}
+	if (not wait_for([&] { return flight.Coalesced() == coalesced + 3; })) {
+		return 6;
+	}
+	release();
+	for (auto& t : threads) {
+		t.join();
+	}
+	if (failed != 4 or runs() != 6) {
+		return 6;
+	}
+	std::remove(log.c_str());
+	std::remove(fifo.c_str());
+	return 0;
+#endif
+}
@@ -0,0 +1,113 @@
+#include "subprocess.h"
+namespace sp = subprocess;
+
+int
+main(int argc, char *argv[])
+{
+#ifdef _WIN32
+	return 0;
+#else
+	// Input order, whatever the completion order: later inputs finish first
+	std::vector<int> inputs;
+	for (int i = 0; i < 20; ++i) {
+		inputs.push_back(i);
+	}
+	auto sleeper = [](int i) {
+		return std::vector<std::string>{"sh", "-c", "sleep 0.$((9 - $1 % 10)); echo $1", "sh", std::to_string(i)};
+	};
+	std::vector<size_t> order;
+	size_t ok = 0;
+	auto start = sp::clock::now();
+	auto failures = sp::parallel_map<std::string>(inputs, sleeper, 10, [&](size_t index, sp::Expected<sp::BasicResult<std::string>>& r) {
+		order.push_back(index);
+		ok += r and r->returncode == 0 and r->output == std::to_string(index) + "\n";
+	});
+	auto elapsed = sp::clock::now() - start;
+	if (failures != 0 or ok != inputs.size() or not std::is_sorted(order.begin(), order.end())) {
+		return 1;
+	}
+	// two rounds of at most 0.9s, not twenty
+	if (elapsed > std::chrono::seconds(4)) {
+		return 2;
+	}
+	// Completion order
+	sp::MapOptions completion;
+	completion.order = sp::MapOptions::oCompletion;
+	order.clear();
+	sp::parallel_map(std::vector<int>{0, 5, 9}, sleeper, 3, [&](size_t index, sp::Expected<sp::Result>&) {
+		order.push_back(index);
+	}, completion);
+	if (order != std::vector<size_t>{2, 1, 0}) {
+		return 3;
+	}
+	// A small reorder window bounds how far ahead jobs start
+	sp::MapOptions narrow;
+	narrow.window = 2;
+	size_t most = 0;
+	std::atomic<size_t> active{0};
+	order.clear();
+	std::vector<int> few {5, 6, 7, 8, 9, 10};
+	sp::parallel_map(few, [&](int i) {
+		most = std::max(most, ++active);
+		return sleeper(i);
+	}, 8, [&](size_t index, sp::Expected<sp::Result>&) {
+		--active;
+		order.push_back(index);
+	}, narrow);
+	if (most > 2 or order.size() != few.size()) {
+		return 4;
+	}
+	// Collect-all: failures, errors and timeouts are reported in place
+	sp::MapOptions timed;
+	timed.timeout_ms = 300;
+	auto results = sp::parallel_map<std::string>(std::vector<std::string>{"exit 0", "exit 3", "sleep 5", "echo err >&2"}, [](const std::string& s) {
+		return std::vector<std::string>{"sh", "-c", s};
+	}, 4, timed);
+	if (results.size() != 4 or not results[0] or results[1]->returncode != 3 or results[3]->error != "err\n") {
+		return 5;
+	}
+	if (results[2] or results[2].Error().code != sp::Error::eTimeout) {
+		return 6;
+	}
+	auto missing = sp::parallel_map(std::vector<int>{1}, [](int) { return std::vector<std::string>{"/nonexistent/command"}; });
+	if (missing[0] or missing[0].Error().code != sp::Error::eOSError) {
+		return 7;
+	}
+	// Fail-fast cancels the rest
+	sp::MapOptions fast;
+	fast.policy = sp::MapOptions::pFailFast;
+	start = sp::clock::now();
+	auto cancelled = sp::parallel_map(inputs, [](int i) {
+		return std::vector<std::string>{"sh", "-c", i == 1 ? "exit 1" : "sleep 5"};
+	}, 4, fast);
+	if (sp::clock::now() - start > std::chrono::seconds(3)) {
+		return 8;
+	}
+	if (not cancelled[1] or cancelled[1]->returncode != 1 or cancelled[0] or cancelled[19] or cancelled[19].Error().code != sp::Error::eCancelled) {
+		return 10;
+	}
+	// Cancelled jobs with a group of their own lose their descendants too
+	char cwd[PATH_MAX];
+	std::string marker = std::string(getcwd(cwd, sizeof cwd)) + "/test037.marker";
+	std::remove(marker.c_str());
+	sp::parallel_map(std::vector<int>{0, 1}, [&marker](int i) {
+		sp::Popen p;
+		p.Arguments({"sh", "-c", i == 1 ? "sleep 0.2; exit 1" : "(sleep 0.6; touch " + marker + ") & wait"}).ProcessGroup();
+		return p;
+	}, 2, fast);
+	std::this_thread::sleep_for(std::chrono::seconds(1));
+	if (std::remove(marker.c_str()) == 0) {
+		return 12;
+	}
+	// A Popen from make_args keeps its own configuration
+	auto configured = sp::parallel_map<std::string>(std::vector<std::string>{"a", "b"}, [](const std::string& s) {
+		sp::Popen p;
+		p.Arguments({"sh", "-c", "echo $X"}).Environment(sp::Environ().Set("X", s));
+		return p;
+	});
+	if (configured[0]->output != "a\n" or configured[1]->output != "b\n") {
+		return 11;
+	}
+	return 0;
+#endif
+}